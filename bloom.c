@@ -0,0 +1,207 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the Bloom filter that each intent keeps over its
+ * entities, so that a question about an entity that is not known can be
+ * answered without searching the BST. A filter never says that a known entity
+ * is unknown; it says that an unknown entity might be known about once in a
+ * hundred times, when it has no more than the keys it was sized for.
+ *
+ * The filter is case-insensitive, like compare_token(). Entities that are
+ * forgotten stay in the filter (they only cost a search) until it is rebuilt.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include "chat1002.h"
+
+/*
+ * Hash an entity case-insensitively (64-bit FNV-1a over the upper-cased
+ * characters). The two halves of the hash are combined to give each of the
+ * BLOOM_HASHES bit positions.
+ */
+static uint64_t bloom_hash(const char *entity)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*entity != '\0')
+    {
+        hash ^= (uint64_t) toupper((unsigned char) *entity);
+        hash *= 1099511628211ULL;
+        entity++;
+    }
+    return hash;
+}
+
+/*
+ * Get the position of the i-th bit for a hash.
+ */
+static size_t bloom_bit(const BLOOM_FILTER *filter, uint64_t hash, int i)
+{
+    uint32_t h1 = (uint32_t) hash;
+    uint32_t h2 = (uint32_t) (hash >> 32) | 1;
+
+    return (size_t) (h1 + (uint32_t) i * h2) & (filter->n_bits - 1);
+}
+
+/*
+ * Set the bits of an entity, without growing the filter.
+ */
+static void bloom_set(BLOOM_FILTER *filter, const char *entity)
+{
+    uint64_t hash = bloom_hash(entity);
+
+    for (int i = 0; i < BLOOM_HASHES; i++)
+    {
+        size_t bit = bloom_bit(filter, hash, i);
+        filter->bits[bit / 8] |= (unsigned char) (1 << (bit % 8));
+    }
+    filter->count++;
+}
+
+/*
+ * Empty a filter and free its bits. An empty filter has no bits, and so
+ * cannot rule anything out until something is added to it.
+ *
+ * Input:
+ *   filter     - the filter
+ */
+void bloom_clear(BLOOM_FILTER *filter)
+{
+    free(filter->bits);
+    filter->bits = NULL;
+    filter->n_bits = 0;
+    filter->capacity = 0;
+    filter->count = 0;
+}
+
+/*
+ * Rebuild a filter from the entities of a BST, sized for at least <n> of them
+ * (and room to grow). If there is not enough memory, the filter is left
+ * empty, so lookups fall back to searching the BST.
+ *
+ * Input:
+ *   filter     - the filter
+ *   root       - the root of the BST
+ *   n          - the number of nodes in the BST
+ */
+void bloom_build(BLOOM_FILTER *filter, KB_NODE *root, int n)
+{
+    int capacity = BLOOM_MIN;
+    while (capacity < n * 2)
+    {
+        capacity *= 2;
+    }
+
+    bloom_clear(filter);
+
+    // BLOOM_BITS bits per key, rounded up to a power of two
+    size_t n_bits = 8;
+    while (n_bits < (size_t) capacity * BLOOM_BITS)
+    {
+        n_bits *= 2;
+    }
+
+    int stack_size = 64;
+    int top = 0;
+    KB_NODE **stack = malloc(stack_size * sizeof(KB_NODE *));
+    filter->bits = calloc(n_bits / 8, 1);
+    if (stack == NULL || filter->bits == NULL)
+    {
+        free(stack);
+        bloom_clear(filter);
+        return;
+    }
+    filter->n_bits = n_bits;
+    filter->capacity = capacity;
+
+    // Add every node, keeping a stack rather than recursing
+    if (root != NULL)
+    {
+        stack[top++] = root;
+    }
+    while (top > 0)
+    {
+        KB_NODE *node = stack[--top];
+        bloom_set(filter, node->entity);
+
+        if (top + 2 > stack_size)
+        {
+            KB_NODE **bigger = realloc(stack, stack_size * 2 * sizeof(KB_NODE *));
+            if (bigger == NULL)
+            {
+                free(stack);
+                bloom_clear(filter);
+                return;
+            }
+            stack = bigger;
+            stack_size *= 2;
+        }
+        if (node->left_child != NULL)
+        {
+            stack[top++] = node->left_child;
+        }
+        if (node->right_child != NULL)
+        {
+            stack[top++] = node->right_child;
+        }
+    }
+
+    free(stack);
+}
+
+/*
+ * Add a new entity to a filter. When the filter holds more keys than it was
+ * sized for, it is rebuilt from the BST at twice the size.
+ *
+ * Input:
+ *   filter     - the filter
+ *   entity     - the entity that was added
+ *   root       - the root of the BST, including the new entity
+ *   n          - the number of nodes in the BST
+ */
+void bloom_add(BLOOM_FILTER *filter, const char *entity, KB_NODE *root, int n)
+{
+    if (filter->bits == NULL || filter->count >= filter->capacity)
+    {
+        bloom_build(filter, root, n);
+        return;
+    }
+
+    bloom_set(filter, entity);
+}
+
+/*
+ * Check whether an entity might be in a filter.
+ *
+ * Input:
+ *   filter     - the filter
+ *   entity     - the entity (case-insensitive)
+ *
+ * Returns:
+ *   true, if the entity might have been added (or the filter is empty)
+ *   false, if it has definitely not been added
+ */
+bool bloom_maybe(const BLOOM_FILTER *filter, const char *entity)
+{
+    if (filter->bits == NULL)
+    {
+        return true;
+    }
+
+    uint64_t hash = bloom_hash(entity);
+
+    for (int i = 0; i < BLOOM_HASHES; i++)
+    {
+        size_t bit = bloom_bit(filter, hash, i);
+        if ((filter->bits[bit / 8] & (1 << (bit % 8))) == 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
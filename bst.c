@@ -3,9 +3,139 @@
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
 #include "chat1002.h"
 
 
+/*
+ * Utility function for comparing string case-insensitively.
+ *
+ * Input:
+ *   token1 - the first token
+ *   token2 - the second token
+ *
+ * Returns:
+ *   as strcmp()
+ */
+int compare_token(const char *token1, const char *token2)
+{
+    int i = 0;
+    while (token1[i] != '\0' && token2[i] != '\0')
+    {
+        if (toupper(token1[i]) < toupper(token2[i]))
+            return -1;
+        else if (toupper(token1[i]) > toupper(token2[i]))
+            return 1;
+        i++;
+    }
+
+    if (token1[i] == '\0' && token2[i] == '\0')
+        return 0;
+    else if (token1[i] == '\0')
+        return -1;
+    else
+        return 1;
+}
+
+/*
+ * Determine whether a word is one of the articles removed by
+ * normalize_entity() (case-insensitively).
+ */
+static bool is_article(const char *word, int length)
+{
+    static const char *const articles[] = { "a", "an", "the" };
+
+    for (size_t k = 0; k < sizeof(articles) / sizeof(articles[0]); k++)
+    {
+        int i = 0;
+        while (i < length && articles[k][i] != '\0' && toupper((unsigned char) word[i]) == toupper((unsigned char) articles[k][i]))
+        {
+            i++;
+        }
+        if (i == length && articles[k][i] == '\0')
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Normalize an entity, so that variants of it that differ only in the ways
+ * chosen compare equal under compare_token() (e.g. "the  ICT Cluster." and
+ * "ICT cluster"). Punctuation is removed first, then articles (with the
+ * whitespace after them), then whitespace is collapsed.
+ *
+ * Input:
+ *   entity     - the entity
+ *   steps      - the steps to apply (NORMALIZE_WHITESPACE, NORMALIZE_PUNCTUATION
+ *                and/or NORMALIZE_ARTICLES)
+ *   key        - a buffer of MAX_ENTITY characters to receive the normalized
+ *                entity (truncated to fit)
+ */
+void normalize_entity(const char *entity, int steps, char *key)
+{
+    int n = 0;
+
+    for (const char *c = entity; *c != '\0' && n < MAX_ENTITY - 1; c++)
+    {
+        if (!(steps & NORMALIZE_PUNCTUATION) || !ispunct((unsigned char) *c))
+        {
+            key[n++] = *c;
+        }
+    }
+    key[n] = '\0';
+
+    if (steps & NORMALIZE_ARTICLES)
+    {
+        int used = 0;
+        int i = 0;
+        while (i < n)
+        {
+            int end = i;
+            while (end < n && !isspace((unsigned char) key[end]))
+            {
+                end++;
+            }
+
+            bool article = end > i && is_article(key + i, end - i);
+            while (i < end)
+            {
+                key[used] = key[i++];
+                used += !article;
+            }
+            while (i < n && isspace((unsigned char) key[i]))
+            {
+                key[used] = key[i++];
+                used += !article;
+            }
+        }
+        key[used] = '\0';
+        n = used;
+    }
+
+    if (steps & NORMALIZE_WHITESPACE)
+    {
+        int used = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (!isspace((unsigned char) key[i]))
+            {
+                key[used++] = key[i];
+            }
+            else if (used > 0 && key[used - 1] != ' ')
+            {
+                key[used++] = ' ';
+            }
+        }
+        if (used > 0 && key[used - 1] == ' ')
+        {
+            used--;
+        }
+        key[used] = '\0';
+    }
+}
+
 /*
  * Find the absolute ASCII difference between two strings. 
  * Used for finding the closest match in the BST if a match is not found.
@@ -52,6 +182,38 @@ int get_ascii_difference(const char *str1, const char *str2)
     return difference;
 }
 
+/*
+ * Compares an entity with the entity of a node, as compare_token() does. The
+ * node's key prefix is compared first, so the node's entity (which is stored
+ * apart from the node, see create_new_node()) is only read when the first
+ * KEY_PREFIX characters are the same.
+ *
+ * Input:
+ *   entity     - the entity
+ *   node       - the node
+ *
+ * Returns:
+ *   -1, 0 or 1, as compare_token()
+ */
+static int compare_key(const char *entity, const KB_NODE *node)
+{
+    for (int i = 0; i < KEY_PREFIX; i++)
+    {
+        // One of them ends within the prefix
+        if (entity[i] == '\0' || node->key[i] == '\0')
+        {
+            return entity[i] == node->key[i] ? 0 : entity[i] == '\0' ? -1 : 1;
+        }
+        if (toupper(entity[i]) != toupper(node->key[i]))
+        {
+            return toupper(entity[i]) < toupper(node->key[i]) ? -1 : 1;
+        }
+    }
+
+    // Same prefix (compare the rest)
+    return compare_token(entity + KEY_PREFIX, node->entity + KEY_PREFIX);
+}
+
 
 /* 
  * Iteratively searches for the node with <entity>. If <entity> is not found, 
@@ -72,6 +234,7 @@ KB_NODE *search(KB_NODE *root, const char *entity)
     KB_NODE *closest_so_far = NULL;
     int difference_so_far;
     int curr_diff;
+    int cmp;
 
     bool done = false;
     while (!done)
@@ -86,12 +249,12 @@ KB_NODE *search(KB_NODE *root, const char *entity)
             }
         }
         // Found
-        else if (compare_token(entity, root->entity) == 0)
+        else if ((cmp = compare_key(entity, root)) == 0)
         {
             done = true;
         }
         // Greater than (traverse to right subtree)
-        else if (compare_token(entity, root->entity) == 1)
+        else if (cmp == 1)
         {
             curr_diff = get_ascii_difference(entity, root->entity);
             if (closest_so_far == NULL || curr_diff < difference_so_far)
@@ -117,151 +280,1035 @@ KB_NODE *search(KB_NODE *root, const char *entity)
 }
 
 /* 
- * Creates a new node, and returns its pointer.
+ * Iteratively searches for the node with <entity>, without looking for the
+ * closest match.
  * 
  * Input:
- *   entity     - the entity attribute of the new node
- *   response   - the response attribute of the new node
+ *   root       - the root of the BST
+ *   entity     - the entity to search for
  * 
  * Returns:
- *   the pointer to the new node, if successful
- *   NULL, if unsuccessful
+ *   the pointer to the node, if found
+ *   NULL, if not found
  */
-KB_NODE *create_new_node(const char *entity, const char *response)
+KB_NODE *search_exact(KB_NODE *root, const char *entity)
 {
-    KB_NODE *new_node;
-    new_node = malloc(sizeof(KB_NODE));
-     
+    while (root != NULL)
+    {
+        int cmp = compare_key(entity, root);
+
+        if (cmp == 0)
+        {
+            return root;
+        }
+        root = cmp > 0 ? root->right_child : root->left_child;
+    }
+    return NULL;
+}
+
+/*
+ * Creates a node for an entity and a response that is already stored.
+ *
+ * Input:
+ *   entity     - the entity of the new node
+ *   stored     - the stored response (see intern_put()), whose reference the
+ *                node takes over
+ *
+ * Returns:
+ *   the pointer to the new node (with one reference), if successful
+ *   NULL, if unsuccessful (the response is released)
+ */
+static KB_NODE *create_node(const char *entity, const char *stored)
+{
+    size_t length = strlen(entity);
+    KB_NODE *new_node = malloc(sizeof(KB_NODE));
+    char *text = malloc(length + 1);
+
     // Memory allocation failure
-    if (new_node == NULL)
+    if (new_node == NULL || text == NULL)
     {
+        free(new_node);
+        free(text);
+        intern_release(stored);
         return NULL;
     }
 
     /* Set the entity and response attributes */
-    strcpy(new_node->entity, entity);
-    strcpy(new_node->response, response);
+    new_node->entity = strcpy(text, entity);
+    new_node->response = stored;
 
-    /* New nodes are always leaves */
+    /* The key is the first KEY_PREFIX characters, zero-padded but not terminated */
+    size_t prefix = length < KEY_PREFIX ? length : KEY_PREFIX;
+    memcpy(new_node->key, entity, prefix);
+    memset(new_node->key + prefix, 0, KEY_PREFIX - prefix);
+
+    /* New nodes are always leaves, and have not been asked about */
     new_node->left_child = NULL;
     new_node->right_child = NULL;
+    new_node->hits = 0;
+
+    /* The reference is held by whoever links the node into a tree */
+    atomic_init(&new_node->refcount, 1);
 
     return new_node;
 }
 
+/* 
+ * Creates a new node, and returns its pointer.
+ *
+ * The node holds what a search reads at each level (the first KEY_PREFIX
+ * characters of the entity and the children), so that a search touches one
+ * small node per level. The entity is stored apart from it, in a block of
+ * exactly the size it needs; the response is kept in the response store (see
+ * intern.c), shared with every other node that has the same response.
+ * 
+ * Input:
+ *   entity     - the entity attribute of the new node
+ *   response   - the response attribute of the new node
+ * 
+ * Returns:
+ *   the pointer to the new node (with one reference), if successful
+ *   NULL, if unsuccessful
+ */
+KB_NODE *create_new_node(const char *entity, const char *response)
+{
+    const char *stored = intern_put(response);
+
+    return stored == NULL ? NULL : create_node(entity, stored);
+}
+
+/*
+ * Frees a node, its entity and its reference to its response.
+ */
+static void free_node(KB_NODE *node)
+{
+    intern_release(node->response);
+    free(node->entity);
+    free(node);
+}
+
+/*
+ * Replaces the response of a node.
+ *
+ * Input:
+ *   node       - the node (not shared with a snapshot)
+ *   response   - the new response
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure (the node keeps its
+ *   old response)
+ */
+int set_response(KB_NODE *node, const char *response)
+{
+    const char *stored = intern_put(response);
+
+    if (stored == NULL)
+    {
+        return KB_NOMEM;
+    }
+
+    intern_release(node->response);
+    node->response = stored;
+    return KB_OK;
+}
+
+/*
+ * Adds a reference to a node, e.g. to keep a snapshot of a tree alive.
+ * 
+ * Input:
+ *   node       - the node (may be NULL)
+ */
+void retain_node(KB_NODE *node)
+{
+    if (node != NULL)
+    {
+        atomic_fetch_add(&node->refcount, 1);
+    }
+}
+
+/*
+ * Drops a reference to a node. When the last reference is dropped, the node
+ * is freed and its references to its children are dropped in turn, so only
+ * the nodes that are not shared with another version of the tree are freed.
+ *
+ * The teardown uses constant stack, however deep the tree: a dying node with
+ * a dying left child is rotated right, so the dying nodes form a vine that is
+ * freed from the left. Only dying nodes (refcount 0) are ever restructured;
+ * a shared child just loses a reference. A dying node reached through a
+ * rotation is told apart from a live child by its refcount of 0, which a live
+ * child cannot have while this node holds a reference to it.
+ * 
+ * Input:
+ *   node       - the node (may be NULL)
+ */
+void release_node(KB_NODE *node)
+{
+    if (node == NULL || atomic_fetch_sub(&node->refcount, 1) != 1)
+    {
+        return;
+    }
+
+    while (node != NULL)
+    {
+        KB_NODE *left = node->left_child;
+
+        // Dying left child (rotate it above this node)
+        if (left != NULL && atomic_fetch_sub(&left->refcount, 1) == 1)
+        {
+            node->left_child = left->right_child;
+            left->right_child = node;
+            node = left;
+            continue;
+        }
+
+        // No dying left child (free this node and carry on to the right)
+        KB_NODE *right = node->right_child;
+        free_node(node);
+
+        if (right != NULL && atomic_load(&right->refcount) != 0 && atomic_fetch_sub(&right->refcount, 1) != 1)
+        {
+            right = NULL;
+        }
+        node = right;
+    }
+}
+
+/*
+ * Creates a copy of a node that shares its children with the original.
+ * 
+ * Input:
+ *   node       - the node to copy
+ * 
+ * Returns:
+ *   the pointer to the copy (with one reference), if successful
+ *   NULL, if unsuccessful
+ */
+static KB_NODE *copy_node(KB_NODE *node)
+{
+    KB_NODE *copy = create_node(node->entity, intern_retain(node->response));
+
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+
+    copy->left_child = node->left_child;
+    copy->right_child = node->right_child;
+    copy->hits = node->hits;
+    retain_node(copy->left_child);
+    retain_node(copy->right_child);
+
+    return copy;
+}
+
 /* 
  * Inserts a new node with <entity> and <response> to the BST.
  * 
+ * The tree is persistent: a node with more than one reference is shared with
+ * a snapshot (see knowledge_write_async()), so it is copied rather than
+ * modified, along with the rest of the path below it. Nodes that only the
+ * tree refers to are modified in place, so no copies are made when there is
+ * no snapshot.
+ * 
  * Input:
+ *   root       - pointer to the root of the BST (updated if the root is
+ *                created or copied)
  *   entity     - the entity attribute of the new node
  *   response   - the response attribute of the new node
+ *   depth      - set to the depth of the new node (1 for the root), or 0 if
+ *                an existing node was updated instead
  * 
  * Returns:
  *   KB_OK, if successful
  *   KB_NOMEM, if there was a memory allocation failure
  */
-int insert(KB_NODE *root, const char *entity, const char *response)
+int insert(KB_NODE **root, const char *entity, const char *response, int *depth)
 {
-    int status = KB_OK;
-    bool done = false;
-    while (!done)
+    KB_NODE **link = root;          // the pointer to the node being examined
+    int cmp;
+
+    *depth = 0;
+
+    while (*link != NULL)
     {
+        KB_NODE *node = *link;
+
+        // Shared with a snapshot (copy it, and drop the tree's reference to the original)
+        if (atomic_load(&node->refcount) > 1)
+        {
+            KB_NODE *copy = copy_node(node);
+            if (copy == NULL)
+            {
+                return KB_NOMEM;
+            }
+            *link = copy;
+            release_node(node);
+            node = copy;
+        }
+
+        cmp = compare_key(entity, node);
+
         // Equal (update the response)
-        if (compare_token(entity, root->entity) == 0)
+        if (cmp == 0)
         {
-            strcpy(root->response, response);
-            done = true;
+            *depth = 0;
+            return set_response(node, response);
         }
 
-        // Greater than (traverse to right subtree)
-        else if (compare_token(entity, root->entity) == 1)
+        // Greater than (traverse to right subtree), less than (traverse to left subtree)
+        link = cmp > 0 ? &node->right_child : &node->left_child;
+        (*depth)++;
+    }
+
+    // Found location to insert
+    *link = create_new_node(entity, response);
+
+    // Memory allocation error
+    if (*link == NULL)
+    {
+        *depth = 0;
+        return KB_NOMEM;
+    }
+
+    (*depth)++;
+    return KB_OK;
+}
+
+/*
+ * Deletes the node with <entity> from the BST in O(height) time, and frees it.
+ * The tree must not be shared with a snapshot.
+ *
+ * A node with two children is replaced by its in-order successor or
+ * predecessor, picked by a bit of the node's address so that repeated
+ * deletions do not skew the tree to one side (without keeping state that
+ * knowledge bases on different threads would share). No node moves further
+ * from the root, so a deletion never increases the height of the tree; it
+ * does not decrease it either, so knowledge_forget() rebuilds a tree that has
+ * shrunk to well below the size it was built for.
+ *
+ * Input:
+ *   root       - pointer to the root of the BST (updated if the root is deleted)
+ *   entity     - the entity to delete
+ *
+ * Returns:
+ *   KB_OK, if the node was deleted
+ *   KB_NOTFOUND, if there is no node with <entity>
+ */
+int delete_node(KB_NODE **root, const char *entity)
+{
+    KB_NODE **link = root;          // the pointer to the node being examined
+    int cmp;
+
+    while (*link != NULL && (cmp = compare_key(entity, *link)) != 0)
+    {
+        link = cmp > 0 ? &(*link)->right_child : &(*link)->left_child;
+    }
+
+    // Not found
+    if (*link == NULL)
+    {
+        return KB_NOTFOUND;
+    }
+
+    KB_NODE *node = *link;
+    bool use_successor = ((uintptr_t) node / sizeof(KB_NODE)) % 2 == 0;
+
+    // At most one child (splice it into the node's place)
+    if (node->left_child == NULL)
+    {
+        *link = node->right_child;
+    }
+    else if (node->right_child == NULL)
+    {
+        *link = node->left_child;
+    }
+
+    // Two children (move the successor into the node's place)
+    else if (use_successor)
+    {
+        KB_NODE **succ_link = &node->right_child;
+        while ((*succ_link)->left_child != NULL)
         {
-            // Found location to insert
-            if (root->right_child == NULL)
-            {
-                root->right_child = create_new_node(entity, response);
+            succ_link = &(*succ_link)->left_child;
+        }
 
-                // Memory allocation error
-                if (root->right_child == NULL)
-                {
-                    status = KB_NOMEM;
-                }
-                done = true;
-            }
+        KB_NODE *succ = *succ_link;
+        *succ_link = succ->right_child;
+        succ->left_child = node->left_child;
+        succ->right_child = node->right_child;
+        *link = succ;
+    }
+
+    // Two children (move the predecessor into the node's place)
+    else
+    {
+        KB_NODE **pred_link = &node->left_child;
+        while ((*pred_link)->right_child != NULL)
+        {
+            pred_link = &(*pred_link)->right_child;
+        }
+
+        KB_NODE *pred = *pred_link;
+        *pred_link = pred->left_child;
+        pred->left_child = node->left_child;
+        pred->right_child = node->right_child;
+        *link = pred;
+    }
+
+    // Deallocate the memory previously allocated to the node
+    free_node(node);
+
+    return KB_OK;
+}
+
+/*
+ * Clear the contents of the BST, by dropping the tree's reference to its root.
+ * Nodes still shared with a snapshot are freed when the snapshot is released.
+ * 
+ * Input
+ *   root       - the root of the BST
+ */
+int reset(KB_NODE *root) 
+{
+    release_node(root);
+
+    return 0;
+}
+
+/*
+ * Measures the height of the BST (the number of nodes on its longest path),
+ * keeping a stack rather than recursing so that any shape can be measured.
+ *
+ * Input:
+ *   root       - the root of the BST
+ *
+ * Returns:
+ *   the height of the BST (0 if it is empty)
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int tree_height(KB_NODE *root)
+{
+    int capacity = 64;
+    int top = 0;
+    int height = 0;
+    KB_NODE **nodes = malloc(capacity * sizeof(KB_NODE *));
+    int *depths = malloc(capacity * sizeof(int));
 
-            // Continue traversing
-            else
+    if (nodes == NULL || depths == NULL)
+    {
+        free(nodes);
+        free(depths);
+        return KB_NOMEM;
+    }
+
+    if (root != NULL)
+    {
+        nodes[top] = root;
+        depths[top++] = 1;
+    }
+
+    while (top > 0)
+    {
+        KB_NODE *node = nodes[--top];
+        int depth = depths[top];
+
+        if (depth > height)
+        {
+            height = depth;
+        }
+
+        // Room for both children
+        if (top + 2 > capacity)
+        {
+            KB_NODE **more_nodes = realloc(nodes, capacity * 2 * sizeof(KB_NODE *));
+            if (more_nodes != NULL)
+            {
+                nodes = more_nodes;
+            }
+            int *more_depths = realloc(depths, capacity * 2 * sizeof(int));
+            if (more_depths != NULL)
+            {
+                depths = more_depths;
+            }
+            if (more_nodes == NULL || more_depths == NULL)
             {
-                root = root->right_child;
+                free(nodes);
+                free(depths);
+                return KB_NOMEM;
             }
+            capacity *= 2;
         }
-        // Less than (traverse to left subtree)
-        else if (compare_token(entity, root->entity) == -1)
+
+        if (node->left_child != NULL)
+        {
+            nodes[top] = node->left_child;
+            depths[top++] = depth + 1;
+        }
+        if (node->right_child != NULL)
+        {
+            nodes[top] = node->right_child;
+            depths[top++] = depth + 1;
+        }
+    }
+
+    free(nodes);
+    free(depths);
+    return height;
+}
+
+/*
+ * Counts the nodes of a BST without recursing or allocating, by a Morris
+ * traversal: the way back up from each left subtree is threaded through the
+ * right_child of its greatest node, and unthreaded once it has been taken.
+ * The tree is restored by the time it returns, but must not be shared with a
+ * snapshot meanwhile.
+ *
+ * Input:
+ *   root       - the root of the BST
+ *
+ * Returns:
+ *   the number of nodes
+ */
+int tree_size(KB_NODE *root)
+{
+    int size = 0;
+    KB_NODE *node = root;
+
+    while (node != NULL)
+    {
+        if (node->left_child == NULL)
+        {
+            size++;
+            node = node->right_child;
+            continue;
+        }
+
+        // The greatest node of the left subtree
+        KB_NODE *last = node->left_child;
+        while (last->right_child != NULL && last->right_child != node)
+        {
+            last = last->right_child;
+        }
+
+        // Thread it to node, then walk the left subtree
+        if (last->right_child == NULL)
+        {
+            last->right_child = node;
+            node = node->left_child;
+        }
+        // Back from the left subtree: unthread it
+        else
+        {
+            last->right_child = NULL;
+            size++;
+            node = node->right_child;
+        }
+    }
+    return size;
+}
+
+/*
+ * Flattens the BST into a "vine": a sorted list of its nodes linked through
+ * right_child, with every left_child NULL. Uses right rotations, so it needs
+ * only constant extra space and O(n) time, and no nodes are allocated.
+ * The tree must not be shared with a snapshot.
+ *
+ * Input:
+ *   root       - the root of the BST
+ *   n          - set to the number of nodes in the vine
+ *
+ * Returns:
+ *   the head of the vine (the smallest entity), or NULL if the tree is empty
+ */
+KB_NODE *tree_to_vine(KB_NODE *root, int *n)
+{
+    KB_NODE head;                   // pseudo-root whose right child is the vine
+    KB_NODE *tail = &head;          // last node known to have no left child
+    KB_NODE *rest = root;           // remainder of the tree still to flatten
+
+    TRACE_BEGIN(span, "tree_to_vine");
+
+    head.right_child = root;
+    *n = 0;
+
+    while (rest != NULL)
+    {
+        // No left child: move it onto the vine
+        if (rest->left_child == NULL)
+        {
+            tail = rest;
+            rest = rest->right_child;
+            (*n)++;
+        }
+        // Rotate the left child up, so it takes the place of rest
+        else
+        {
+            KB_NODE *left = rest->left_child;
+            rest->left_child = left->right_child;
+            left->right_child = rest;
+            rest = left;
+            tail->right_child = left;
+        }
+    }
+
+    TRACE_END(span);
+    return head.right_child;
+}
+
+/*
+ * Builds a balanced BST from the first <n> nodes of a vine (see tree_to_vine()),
+ * relinking the existing nodes. The tree is built bottom-up in the same way as
+ * convert_to_balanced_bst(), so no nodes are allocated.
+ *
+ * Input:
+ *   head       - the head of the vine; advanced past the nodes used
+ *   n          - the number of nodes to take from the vine
+ *
+ * Returns:
+ *   the root of the balanced BST
+ */
+KB_NODE *vine_to_balanced_bst(KB_NODE **head, int n)
+{
+    if (n <= 0)
+    {
+        return NULL;
+    }
+
+    // Left subtree has n/2 nodes
+    KB_NODE *left_subtree = vine_to_balanced_bst(head, n/2);
+
+    // The next node in the vine is the root
+    KB_NODE *root = *head;
+    *head = root->right_child;
+    root->left_child = left_subtree;
+
+    // Right subtree has n (total) - n/2 (left subtree) - 1 (root) nodes
+    root->right_child = vine_to_balanced_bst(head, n - n/2 - 1);
+
+    return root;
+}
+
+/*
+ * Rebalances a BST after inserting a node that is too deep, in the manner of a
+ * scapegoat tree: going up from the new node, the first subtree that is more
+ * than <factor> times as deep as a balanced one of its size is rebuilt in
+ * place (see tree_to_vine()), and so on until the new node is no longer too
+ * deep for the whole BST. Rebuilding the smallest such subtree keeps a run of
+ * sorted inserts from rebuilding the whole BST every few nodes.
+ *
+ * Nothing is allocated: the sizes of the subtrees are counted in place (see
+ * tree_size()), and only the REBALANCE_PATH links nearest the new node are
+ * kept. If none of those subtrees is too deep, the whole BST (whose size is
+ * known) is rebuilt instead. The tree must not be shared with a snapshot.
+ *
+ * Input:
+ *   root       - pointer to the root of the BST
+ *   entity     - the entity of the new node
+ *   depth      - the depth of the new node (the root is 1)
+ *   count      - the number of nodes in the BST
+ *   factor     - how many times the balanced height a subtree may be
+ *
+ * Returns:
+ *   KB_OK, if a subtree was rebuilt
+ *   KB_NOTFOUND, if the new node is not too deep
+ */
+int rebalance_path(KB_NODE **root, const char *entity, int depth, int count, double factor)
+{
+    KB_NODE **links[REBALANCE_PATH];    // link j of the path is links[j % REBALANCE_PATH]
+    int n = 0;
+
+    TRACE_BEGIN(span, "rebalance_path");
+
+    // The links from the root down to the new node
+    KB_NODE **link = root;
+    while (*link != NULL && n < depth)
+    {
+        links[n++ % REBALANCE_PATH] = link;
+
+        int cmp = compare_key(entity, *link);
+        if (cmp == 0)
+        {
+            break;
+        }
+        link = cmp < 0 ? &(*link)->left_child : &(*link)->right_child;
+    }
+
+    int status = KB_NOTFOUND;
+    int top = n > REBALANCE_PATH ? n - REBALANCE_PATH : 0;
+    int size = n > 0 ? tree_size(*links[(n - 1) % REBALANCE_PATH]) : 0;
+    for (int j = n - 2; j >= top; j--)
+    {
+        KB_NODE *node = *links[j % REBALANCE_PATH];
+        KB_NODE *below = *links[(j + 1) % REBALANCE_PATH];
+        size += tree_size(node->left_child == below ? node->right_child : node->left_child) + 1;
+
+        // Subtree j (at depth j + 1) holds nodes down to <depth>
+        if (depth - j > factor * balanced_height(size))
         {
-            // Found location to insert
-            if (root->left_child == NULL)
+            int m;
+            KB_NODE *vine = tree_to_vine(node, &m);
+            *links[j % REBALANCE_PATH] = vine_to_balanced_bst(&vine, m);
+            depth = j + balanced_height(size);
+            status = KB_OK;
+
+            if (depth <= factor * balanced_height(count))
             {
-                root->left_child = create_new_node(entity, response);
+                break;
+            }
+        }
+    }
+
+    // Still too deep, above the links that were kept
+    if (top > 0 && depth > factor * balanced_height(count))
+    {
+        int m;
+        KB_NODE *vine = tree_to_vine(*root, &m);
+        *root = vine_to_balanced_bst(&vine, m);
+        status = KB_OK;
+    }
+
+    TRACE_END(span);
+    return status;
+}
+
+/*
+ * Builds a weight-balanced BST from nodes[lo..hi), given the prefix sums of
+ * their weights (see vine_to_weighted_bst()).
+ */
+static KB_NODE *weighted_subtree(KB_NODE **nodes, unsigned long long *prefix, int lo, int hi)
+{
+    if (lo >= hi)
+    {
+        return NULL;
+    }
+
+    // Find the first node at which the weight before it reaches half
+    unsigned long long half = prefix[lo] + (prefix[hi] - prefix[lo]) / 2;
+    int low = lo;
+    int high = hi - 1;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (prefix[mid + 1] > half)
+        {
+            high = mid;
+        }
+        else
+        {
+            low = mid + 1;
+        }
+    }
+
+    KB_NODE *root = nodes[low];
+    root->left_child = weighted_subtree(nodes, prefix, lo, low);
+    root->right_child = weighted_subtree(nodes, prefix, low + 1, hi);
+
+    return root;
+}
+
+/*
+ * Builds a weight-balanced BST from a vine (see tree_to_vine()), relinking the
+ * existing nodes so that often-asked entities end up near the root. Each
+ * node weighs its hits plus one; the root of each subtree is the node at
+ * which the weight of the nodes before it reaches half the subtree's weight,
+ * so each subtree weighs at most half its parent and a node with a share p
+ * of the hits is at depth O(log(1/p)). The hits are halved afterwards, so
+ * that the next rebuild favours recent questions.
+ *
+ * Input:
+ *   root       - set to the root of the new BST
+ *   head       - the head of the vine
+ *   n          - the number of nodes in the vine
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure (the BST is built
+ *   balanced instead)
+ */
+int vine_to_weighted_bst(KB_NODE **root, KB_NODE *head, int n)
+{
+    KB_NODE **nodes = malloc(((size_t) n + 1) * sizeof(KB_NODE *));
+    unsigned long long *prefix = malloc(((size_t) n + 1) * sizeof(unsigned long long));
+
+    if (nodes == NULL || prefix == NULL)
+    {
+        free(nodes);
+        free(prefix);
+        *root = vine_to_balanced_bst(&head, n);
+        return KB_NOMEM;
+    }
+
+    TRACE_BEGIN(span, "vine_to_weighted_bst");
+
+    // Number the nodes and add up their weights
+    prefix[0] = 0;
+    for (int i = 0; i < n; i++)
+    {
+        nodes[i] = head;
+        prefix[i + 1] = prefix[i] + head->hits + 1;
+        head = head->right_child;
+    }
+
+    *root = weighted_subtree(nodes, prefix, 0, n);
+
+    for (int i = 0; i < n; i++)
+    {
+        nodes[i]->hits /= 2;
+    }
+
+    free(nodes);
+    free(prefix);
+    TRACE_END(span);
+    return KB_OK;
+}
+
+/*
+ * Moves the node with <entity> (or the last node on the path to where it
+ * would be) to the root, using top-down splaying: the path is split into a
+ * tree of smaller and a tree of larger nodes, rotating at each zig-zig step
+ * so that the path is roughly halved in depth. Uses constant extra space, and
+ * relinks nodes in place, so the tree must not be shared with a snapshot.
+ *
+ * Input:
+ *   root       - the root of the BST
+ *   entity     - the entity to splay
+ *
+ * Returns:
+ *   the new root of the BST
+ */
+KB_NODE *splay(KB_NODE *root, const char *entity)
+{
+    KB_NODE header;                 // left_child: the larger nodes; right_child: the smaller
+    KB_NODE *smaller = &header;     // the largest of the smaller nodes
+    KB_NODE *larger = &header;      // the smallest of the larger nodes
+
+    if (root == NULL)
+    {
+        return NULL;
+    }
+    header.left_child = header.right_child = NULL;
+
+    while (true)
+    {
+        int cmp = compare_key(entity, root);
 
-                // Memory allocation error
+        if (cmp < 0 && root->left_child != NULL)
+        {
+            // Zig-zig (rotate right)
+            if (compare_key(entity, root->left_child) < 0)
+            {
+                KB_NODE *left = root->left_child;
+                root->left_child = left->right_child;
+                left->right_child = root;
+                root = left;
                 if (root->left_child == NULL)
                 {
-                    status = KB_NOMEM;
+                    break;
                 }
-                done = true;
             }
-            
-            // Continue traversing
-            else
+
+            // Link root into the larger nodes
+            larger->left_child = root;
+            larger = root;
+            root = root->left_child;
+        }
+        else if (cmp > 0 && root->right_child != NULL)
+        {
+            // Zag-zag (rotate left)
+            if (compare_key(entity, root->right_child) > 0)
             {
-                root = root->left_child;
+                KB_NODE *right = root->right_child;
+                root->right_child = right->left_child;
+                right->left_child = root;
+                root = right;
+                if (root->right_child == NULL)
+                {
+                    break;
+                }
             }
+
+            // Link root into the smaller nodes
+            smaller->right_child = root;
+            smaller = root;
+            root = root->right_child;
+        }
+        else
+        {
+            break;
         }
     }
-    return status;
+
+    // Reassemble the smaller and larger nodes around the new root
+    smaller->right_child = root->left_child;
+    larger->left_child = root->right_child;
+    root->left_child = header.right_child;
+    root->right_child = header.left_child;
+
+    return root;
 }
+
 /*
- * Recursively clear the contents of the BST
- * 
- * Input
+ * Gets the height of a balanced BST, as built by vine_to_balanced_bst() and
+ * build_balanced_bst().
+ *
+ * Input:
+ *   n          - the number of nodes
+ *
+ * Returns:
+ *   the height of the BST (floor(log2(n)) + 1, or 0 if it is empty)
+ */
+int balanced_height(int n)
+{
+    int height = 0;
+
+    while (n > 0)
+    {
+        height++;
+        n /= 2;
+    }
+    return height;
+}
+
+/*
+ * Pushes the right spine of a subtree, so that its greatest node is on top.
+ */
+static void cursor_push(TREE_CURSOR *cursor, KB_NODE *node)
+{
+    while (node != NULL)
+    {
+        if (cursor->top == cursor->capacity)
+        {
+            KB_NODE **bigger = realloc(cursor->stack, cursor->capacity * 2 * sizeof(KB_NODE *));
+            if (bigger == NULL)
+            {
+                cursor->failed = true;
+                return;
+            }
+            cursor->stack = bigger;
+            cursor->capacity *= 2;
+        }
+        cursor->stack[cursor->top++] = node;
+        node = node->right_child;
+    }
+}
+
+/*
+ * Starts walking a BST in descending order. The cursor keeps its own stack
+ * rather than recursing, so a degenerate tree (see insert()) cannot overflow
+ * the call stack.
+ *
+ * Input:
+ *   cursor     - the cursor
  *   root       - the root of the BST
+ *
+ * Returns:
+ *   true, if successful
+ *   false, if there was a memory allocation failure
  */
-int reset(KB_NODE *root) 
+bool cursor_open(TREE_CURSOR *cursor, KB_NODE *root)
 {
-    // Recursively traverse left subtree
-    if (root->left_child != NULL)
+    cursor->capacity = 64;
+    cursor->top = 0;
+    cursor->failed = false;
+    cursor->stack = malloc(cursor->capacity * sizeof(KB_NODE *));
+    if (cursor->stack == NULL)
     {
-        reset(root->left_child);
+        cursor->failed = true;
+        return false;
     }
-    // Recursively traverse right subtree
-    if (root->right_child != NULL)
+
+    cursor_push(cursor, root);
+    return !cursor->failed;
+}
+
+/*
+ * Gets the next node of a walk in descending order.
+ *
+ * Input:
+ *   cursor     - the cursor
+ *
+ * Returns:
+ *   the node
+ *   NULL, if there are no more nodes (or the cursor has failed, see
+ *   cursor_open())
+ */
+KB_NODE *cursor_next(TREE_CURSOR *cursor)
+{
+    if (cursor->failed || cursor->top == 0)
     {
-        reset(root->right_child);
+        return NULL;
     }
 
-    // Deallocate the memory previously allocated to the node
-    free(root);
+    // Then the left subtree
+    KB_NODE *node = cursor->stack[--cursor->top];
+    cursor_push(cursor, node->left_child);
+    return node;
+}
 
-    return 0;
+/*
+ * Finishes a walk, freeing the cursor's stack.
+ *
+ * Input:
+ *   cursor     - the cursor
+ */
+void cursor_close(TREE_CURSOR *cursor)
+{
+    free(cursor->stack);
+    cursor->stack = NULL;
+}
+
+/*
+ * Writes one entity/response pair as a line of a knowledge file. Each pair is
+ * copied straight into the output buffer rather than formatted.
+ *
+ * Input:
+ *   out        - the output buffer of the file to write to
+ *   node       - the node to write
+ *   counters   - write the entity's access counter instead of its response
+ */
+void write_node(WRITE_BUFFER *out, const KB_NODE *node, bool counters)
+{
+    write_bytes(out, node->entity, strlen(node->entity));
+    write_bytes(out, "=", 1);
+    if (counters)
+    {
+        char hits[16];
+        write_bytes(out, hits, snprintf(hits, sizeof(hits), "%u", node->hits));
+    }
+    else
+    {
+        char text[MAX_RESPONSE];
+        const char *response = intern_read(node->response, text);
+        write_bytes(out, response, strlen(response));
+    }
+    write_bytes(out, "\n", 1);
 }
 
 /* 
- * Performs a recursive reverse in-order (descending order) write to file.
+ * Performs a reverse in-order (descending order) write to file.
  * 
  * Input:
- *   f          - the file to write to
+ *   out        - the output buffer of the file to write to (its status is set
+ *                to KB_NOMEM if the walk runs out of memory)
+ *   counters   - write each entity's access counter instead of its response
  */
-void reverse_in_order_write(KB_NODE *root, FILE *f)
+void reverse_in_order_write(KB_NODE *root, WRITE_BUFFER *out, bool counters)
 {
-    if (root != NULL) 
-        {
-            reverse_in_order_write(root->right_child, f);        // visiting right child
-            
-            // Write entity and response
-            fprintf(f, "%s=%s\n", root->entity, root->response);
+    TREE_CURSOR cursor;
+    KB_NODE *node;
 
-            reverse_in_order_write(root->left_child, f);         // visiting left child
-        }
+    cursor_open(&cursor, root);
+    while (out->status == KB_OK && (node = cursor_next(&cursor)) != NULL)
+    {
+        write_node(out, node, counters);
+    }
+
+    if (cursor.failed)
+    {
+        out->status = KB_NOMEM;
+    }
+    cursor_close(&cursor);
 }
 
 /* 
@@ -316,6 +1363,9 @@ void print_tree(KB_NODE *root, int level) {
  */
 int bst_tests()
 {
+    char text[MAX_RESPONSE];
+    char other[MAX_RESPONSE];
+
     printf("== BEGIN bst.c TESTS ==\n\n");
     /*
                         ICT1003
@@ -327,79 +1377,92 @@ int bst_tests()
                       \       /      \
                    ICT1002  ICT1005  SIT
     */
-    WHAT_root = create_new_node("ICT1003", "Computer Organisation and Architecture.");
-    insert(WHAT_root, "ICT1001", "Introduction to ICT.");
-    insert(WHAT_root, "ICT1002", "Programming Fundamentals.");
-    insert(WHAT_root, "ICT1004", "Web Systems and Technologies.");
-    insert(WHAT_root, "SIT", "SIT is an autonomous university in Singapore.");
-    insert(WHAT_root, "ICT1005", "Mathematics and Statistics for ICT.");
+    KNOWLEDGE_BASE *kb = knowledge_create("bst_tests");
+    int depth;
+
+    KB_NODE *WHAT_root = create_new_node("ICT1003", "Computer Organisation and Architecture.");
+    insert(&WHAT_root, "ICT1001", "Introduction to ICT.", &depth);
+    insert(&WHAT_root, "ICT1002", "Programming Fundamentals.", &depth);
+    insert(&WHAT_root, "ICT1004", "Web Systems and Technologies.", &depth);
+    insert(&WHAT_root, "SIT", "SIT is an autonomous university in Singapore.", &depth);
+    insert(&WHAT_root, "ICT1005", "Mathematics and Statistics for ICT.", &depth);
     
     printf(" -- In-order Traversal (WHAT):");
     in_order(WHAT_root);
     printf("-- \n\n");
 
     KB_NODE *WHAT_ICT1004 = search(WHAT_root, "ICT1004");
-    printf("Entity: %s, Response: %s\n", WHAT_ICT1004->entity, WHAT_ICT1004->response);
+    printf("Entity: %s, Response: %s\n", WHAT_ICT1004->entity, intern_read(WHAT_ICT1004->response, text));
 
     KB_NODE *WHAT_SIT = search(WHAT_root, "SIT");
-    printf("Entity: %s, Response: %s\n\n", WHAT_SIT->entity, WHAT_SIT->response);
+    printf("Entity: %s, Response: %s\n\n", WHAT_SIT->entity, intern_read(WHAT_SIT->response, text));
+
+    normalize_entity("  The ICT-Cluster,  an   example. ", NORMALIZE_ALL, text);
+    printf("Normalized: '%s'\n\n", text);
 
-    WHO_root = create_new_node("Frank Guan", "Frank teaches the C section of ICT1002.");
-    insert(WHO_root, "Wang Zhengkui", "Zhengkui teaches the Python section of ICT1002.");
+    KB_NODE *WHO_root = create_new_node("Frank Guan", "Frank teaches the C section of ICT1002.");
+    insert(&WHO_root, "Wang Zhengkui", "Zhengkui teaches the Python section of ICT1002.", &depth);
+
+    /* Snapshot the WHO tree, then learn: the snapshot keeps the old version */
+    KB_NODE *WHO_snapshot = WHO_root;
+    retain_node(WHO_snapshot);
+    insert(&WHO_root, "Frank Guan", "Frank teaches ICT1002 and ICT2104.", &depth);
+
+    printf("Snapshot: %s\nCurrent: %s\n\n", intern_read(search(WHO_snapshot, "Frank Guan")->response, text),
+        intern_read(search(WHO_root, "Frank Guan")->response, other));
+    release_node(WHO_snapshot);
     
     printf(" -- In-order Traversal (WHO):");
     in_order(WHO_root);
     printf("-- \n\n");
 
     KB_NODE *WHO_Frank = search(WHO_root, "Frank Guan");
-    printf("Entity: %s\nResponse: %s\n\n", WHO_Frank->entity, WHO_Frank->response);
+    printf("Entity: %s\nResponse: %s\n\n", WHO_Frank->entity, intern_read(WHO_Frank->response, text));
 
     printf("RESET\n\n");
-    knowledge_reset();
-
-    in_order(WHO_root);
-    in_order(WHAT_root);
+    reset(WHAT_root);
+    reset(WHO_root);
 
     printf("LOADING sample.sorted.ini\n");
-    knowledge_read(fopen("sample.sorted.ini", "r"));
+    knowledge_read(kb, fopen("sample.sorted.ini", "r"));
     printf("LOADED sample.sorted.ini\n\n");
 
     printf(" \n-- WHAT TREE\n");
-    print_tree(WHAT_root, 0);
+    print_tree(kb->root[INTENT_WHAT], 0);
 
     printf(" \n-- WHO TREE\n");
-	print_tree(WHO_root, 0);
+	print_tree(kb->root[INTENT_WHO], 0);
 
     printf(" \n-- WHERE TREE\n");
-	print_tree(WHERE_root, 0);
+	print_tree(kb->root[INTENT_WHERE], 0);
 
     printf("LOADING sample.unsorted.ini\n");
-    knowledge_read(fopen("sample.unsorted.ini", "r"));
+    knowledge_read(kb, fopen("sample.unsorted.ini", "r"));
     printf("LOADED sample.unsorted.ini\n\n");
 
     printf(" \n-- WHAT TREE\n");
-    print_tree(WHAT_root, 0);
+    print_tree(kb->root[INTENT_WHAT], 0);
 
     printf(" \n-- WHO TREE\n");
-	print_tree(WHO_root, 0);
+	print_tree(kb->root[INTENT_WHO], 0);
 
     printf(" \n-- WHERE TREE\n");
-	print_tree(WHERE_root, 0);
+	print_tree(kb->root[INTENT_WHERE], 0);
 
     printf("\n -- In-order Traversal (WHO):");
-    in_order(WHO_root);
+    in_order(kb->root[INTENT_WHO]);
     printf("-- \n\n");
 
     printf(" -- In-order Traversal (WHAT):");
-    in_order(WHAT_root);
+    in_order(kb->root[INTENT_WHAT]);
     printf("-- \n\n");
 
     printf(" -- In-order Traversal (WHERE):");
-    in_order(WHERE_root);
+    in_order(kb->root[INTENT_WHERE]);
     printf(" -- \n\n");
 
     printf("RESET\n\n");
-    knowledge_reset();
+    knowledge_free(kb);
 
     printf("== END bst.c TESTS ==\n\n");
     return 0;
@@ -0,0 +1,198 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the response cache, which remembers how recent
+ * questions were answered so that a repeated question does not walk the BST
+ * (or look for the closest match) again. Each knowledge base has its own.
+ *
+ * The cache holds up to CACHE_SIZE answers, indexed by a case-insensitive
+ * hash table of "<intent> <entity>" keys. When it is full, an answer is
+ * evicted using the CLOCK algorithm: the hand sweeps the entries, sparing
+ * each one that has been used since the hand last passed it.
+ *
+ * Changing the knowledge of an intent (see knowledge_put()) invalidates the
+ * cached answers of that intent by bumping its generation; an entry from an
+ * older generation is a miss, and is the first to be reused.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "chat1002.h"
+
+/*
+ * Build the key of a question in the cache.
+ *
+ * Returns:
+ *   true, if the key fits in <key>
+ *   false, if the entity is too long to be cached
+ */
+static bool cache_key(int intent, const char *entity, char *key)
+{
+    return snprintf(key, CACHE_KEY, "%d %s", intent, entity) < CACHE_KEY;
+}
+
+/*
+ * Creates an empty response cache.
+ *
+ * Returns:
+ *   the pointer to the new cache, if successful
+ *   NULL, if there was a memory allocation failure
+ */
+RESPONSE_CACHE *cache_create()
+{
+    RESPONSE_CACHE *cache = calloc(1, sizeof(RESPONSE_CACHE));
+
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    cache->index = hash_create(CACHE_SIZE);
+    if (cache->index == NULL)
+    {
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+/*
+ * Free a response cache.
+ *
+ * Input:
+ *   cache      - the cache (may be NULL)
+ */
+void cache_free(RESPONSE_CACHE *cache)
+{
+    if (cache != NULL)
+    {
+        hash_destroy(cache->index, NULL);
+        free(cache);
+    }
+}
+
+/*
+ * Look up the cached answer to a question.
+ *
+ * Input:
+ *   cache      - the cache
+ *   intent     - the index of the intent
+ *   entity     - the entity (case-insensitive)
+ *
+ * Returns:
+ *   the cached answer, if there is a current one
+ *   NULL, otherwise
+ */
+CACHE_ENTRY *cache_get(RESPONSE_CACHE *cache, int intent, const char *entity)
+{
+    char key[CACHE_KEY];
+    CACHE_ENTRY *entry = NULL;
+
+    if (cache_key(intent, entity, key))
+    {
+        entry = hash_get(cache->index, key);
+    }
+
+    if (entry == NULL || entry->generation != cache->generation[intent])
+    {
+        cache->misses++;
+        return NULL;
+    }
+
+    entry->referenced = true;
+    cache->hits++;
+    return entry;
+}
+
+/*
+ * Find an entry to hold a new answer, evicting the answer it holds.
+ *
+ * Returns:
+ *   the entry
+ */
+static CACHE_ENTRY *cache_victim(RESPONSE_CACHE *cache)
+{
+    while (true)
+    {
+        CACHE_ENTRY *entry = &cache->entries[cache->hand];
+        cache->hand = (cache->hand + 1) % CACHE_SIZE;
+
+        bool stale = entry->generation != cache->generation[entry->intent];
+        if (!entry->used || stale || !entry->referenced)
+        {
+            if (entry->used)
+            {
+                hash_remove(cache->index, entry->key);
+                entry->used = false;
+                cache->count--;
+            }
+            return entry;
+        }
+
+        // Used since the hand last passed (spare it this time round)
+        entry->referenced = false;
+    }
+}
+
+/*
+ * Remember the answer to a question. Failing to remember it is not an error.
+ *
+ * Input:
+ *   cache      - the cache
+ *   intent     - the index of the intent
+ *   entity     - the entity asked about
+ *   status     - KB_OK (<node> matches the entity), KB_CLOSESTMATCH (<node>
+ *                is the closest match) or KB_NOTFOUND (<node> is NULL)
+ *   node       - the node that answers the question
+ *   response   - the text of the node's response (see intern_read()), or
+ *                NULL if there is no node
+ */
+void cache_put(RESPONSE_CACHE *cache, int intent, const char *entity, int status, KB_NODE *node, const char *response)
+{
+    char key[CACHE_KEY];
+
+    if (!cache_key(intent, entity, key))
+    {
+        return;
+    }
+
+    // Already cached (but stale), otherwise a new entry
+    CACHE_ENTRY *entry = hash_get(cache->index, key);
+    if (entry == NULL)
+    {
+        entry = cache_victim(cache);
+        strcpy(entry->key, key);
+        if (hash_put(cache->index, key, entry) != KB_OK)
+        {
+            return;
+        }
+        entry->used = true;
+        cache->count++;
+    }
+
+    entry->intent = intent;
+    entry->generation = cache->generation[intent];
+    entry->referenced = false;
+    entry->status = status;
+    entry->node = node;
+    snprintf(entry->entity, MAX_ENTITY, "%s", node == NULL ? "" : node->entity);
+    snprintf(entry->response, MAX_RESPONSE, "%s", node == NULL ? "" : response);
+}
+
+/*
+ * Forget the cached answers for an intent, after its knowledge has changed.
+ *
+ * Input:
+ *   cache      - the cache (may be NULL)
+ *   intent     - the index of the intent
+ */
+void cache_invalidate(RESPONSE_CACHE *cache, int intent)
+{
+    if (cache != NULL)
+    {
+        cache->generation[intent]++;
+    }
+}
@@ -10,6 +10,9 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 /* the maximum number of characters we expect in a line of input (including the terminating null)  */
 #define MAX_INPUT    256
@@ -29,15 +32,19 @@
 #define KB_NOTFOUND        -1
 #define KB_INVALID         -2
 #define KB_NOMEM           -3
+
+/* how knowledge_read() resolves an entity that is defined more than once */
+#define KB_MERGE_REPLACE    0   /* the last definition wins */
+#define KB_MERGE_KEEP       1   /* the first definition wins */
  
 /* functions defined in main.c */
-int compare_token(const char *token1, const char *token2);
 void prompt_user(char *buf, int n, const char *format, ...);
 
 /* functions defined in chatbot.c */
 const char *chatbot_botname();
 const char *chatbot_username();
 int chatbot_main(int inc, char *inv[], char *response, int n);
+void chatbot_close();
 int chatbot_is_exit(const char *intent);
 int chatbot_do_exit(int inc, char *inv[], char *response, int n);
 int chatbot_is_load(const char *intent);
@@ -48,48 +55,185 @@ int chatbot_is_reset(const char *intent);
 int chatbot_do_reset(int inc, char *inv[], char *response, int n);
 int chatbot_is_save(const char *intent);
 int chatbot_do_save(int inc, char *inv[], char *response, int n);
+int chatbot_is_forget(const char *intent);
+int chatbot_do_forget(int inc, char *inv[], char *response, int n);
+int chatbot_is_set(const char *intent);
+int chatbot_do_set(int inc, char *inv[], char *response, int n);
+int chatbot_is_tenant(const char *intent);
+int chatbot_do_tenant(int inc, char *inv[], char *response, int n);
+int chatbot_is_cache(const char *intent);
+int chatbot_do_cache(int inc, char *inv[], char *response, int n);
+int chatbot_is_export(const char *intent);
+int chatbot_do_export(int inc, char *inv[], char *response, int n);
+int chatbot_is_diagnostics(const char *intent);
+int chatbot_do_diagnostics(int inc, char *inv[], char *response, int n);
+int chatbot_is_publish(const char *intent);
+int chatbot_do_publish(int inc, char *inv[], char *response, int n);
+int chatbot_is_attach(const char *intent);
+int chatbot_do_attach(int inc, char *inv[], char *response, int n);
+int chatbot_is_alias(const char *intent);
+int chatbot_do_alias(int inc, char *inv[], char *response, int n);
+int chatbot_is_search(const char *intent);
+int chatbot_do_search(int inc, char *inv[], char *response, int n);
+int chatbot_is_trace(const char *intent);
+int chatbot_do_trace(int inc, char *inv[], char *response, int n);
 int chatbot_is_smalltalk(const char *intent);
 int chatbot_do_smalltalk(int inc, char *inv[], char *resonse, int n);
 
 char *get_entity(int inc, char *inv[]);
 
-/* functions defined in knowledge.c */
-int knowledge_get(const char *intent, const char *entity, char *response, int n);
-int knowledge_put(const char *intent, const char *entity, const char *response);
-void knowledge_reset();
-int knowledge_read(FILE *f);
-void knowledge_write(FILE *f);
+/* functions defined in smalltalk.c */
+int smalltalk_read(FILE *f);
+void smalltalk_reset();
+int smalltalk_is_keyword(const char *word);
+int smalltalk_respond(int inc, char *inv[], char *response, int n);
+
+
+/* ALLOCATION TRACKING
+–––––––––––––––––––––––––––––––––––––––––––––––––– */
+/*
+ * FOR TESTING ONLY: compile with -DKB_ALLOC_TRACKING to count the memory each
+ * source file allocates, and to fail allocations on a schedule (see my_alloc.c).
+ */
+#ifdef KB_ALLOC_TRACKING
+#include <stdlib.h>
+#define malloc(s)       my_alloc((s), __FILE__)
+#define calloc(n, s)    my_calloc((n), (s), __FILE__)
+#define realloc(p, s)   my_realloc((p), (s), __FILE__)
+#define free            my_free
+#endif
+
+/* the allocations of one subsystem (source file), or of all of them */
+typedef struct alloc_stats
+{
+    const char *subsystem;                  // the name of the source file, or "total"
+    long allocs;                            // the blocks allocated
+    long frees;                             // the blocks freed
+    long failures;                          // the allocations failed on schedule (see alloc_fail())
+    size_t live;                            // the bytes allocated and not yet freed
+    size_t peak;                            // the most bytes live at once (see alloc_reset_peaks())
+} ALLOC_STATS;
+
+/* functions defined in my_alloc.c */
+void *my_alloc(size_t s, const char *file);
+void *my_calloc(size_t n, size_t s, const char *file);
+void *my_realloc(void *p, size_t s, const char *file);
+void my_free(void *p);
+void alloc_fail(long nth, long count);
+long alloc_counted();
+const char *alloc_last_failure();
+ALLOC_STATS alloc_total();
+void alloc_reset_peaks();
+void alloc_report(FILE *f);
+int alloc_tests(const char *filename);
+
+/* TRACING
+–––––––––––––––––––––––––––––––––––––––––––––––––– */
+/*
+ * FOR PROFILING: compile with -DKB_TRACING to record how long each phase marked
+ * with TRACE_BEGIN() and TRACE_END() takes (see trace.c); otherwise they
+ * compile to nothing. A span must be ended on every path out of its phase.
+ */
+#ifdef KB_TRACING
+#define TRACE_BEGIN(span, name)     TRACE_SPAN span = trace_begin((name), __FILE__)
+#define TRACE_END(span)             trace_end(&(span))
+#else
+#define TRACE_BEGIN(span, name)     ((void) 0)
+#define TRACE_END(span)             ((void) 0)
+#endif
+
+/* the number of spans kept for each thread (the oldest are overwritten) */
+#define TRACE_EVENTS    8192
 
-/* FOR TESTING ONLY: uncomment to 'fake' malloc and test memory allocation failures */
-//#define malloc(s) my_alloc(s)
-void *my_alloc(size_t s);
+/* the file the trace is written to when the chatbot exits */
+#define TRACE_FILE      "trace.json"
+
+/* a phase being timed */
+typedef struct trace_span
+{
+    const char *name;                       // the name of the phase
+    const char *category;                   // the source file it is in
+    uint64_t start;                         // when it started, in ns
+} TRACE_SPAN;
+
+/* functions defined in trace.c */
+TRACE_SPAN trace_begin(const char *name, const char *file);
+void trace_end(TRACE_SPAN *span);
+int trace_dump(const char *filename);
 
 /* BINARY SEARCH TREE
 –––––––––––––––––––––––––––––––––––––––––––––––––– */
-/* BST node */
+/* the number of characters of an entity kept in its BST node */
+#define KEY_PREFIX   8
+
+/* BST node (the fields a search reads first; see create_new_node()) */
 typedef struct node
 {
-    char entity[MAX_ENTITY];        // the entity (key for the BST)
-    char response[MAX_RESPONSE];    // the response for this entity
+    char key[KEY_PREFIX];           // the start of the entity (NUL-padded, not NUL-terminated)
     struct node *right_child;       // right child
     struct node *left_child;        // left child
+    char *entity;                   // the entity (key for the BST)
+    const char *response;           // the response for this entity, shared with others (read it with intern_read())
+    atomic_int refcount;            // references from parents, roots and snapshots
+    unsigned hits;                  // how often it has answered a question (see knowledge_get())
 } KB_NODE;
 
-/* root pointers for WHERE, WHAT and WHO trees */
-KB_NODE *WHERE_root;
-KB_NODE *WHAT_root;
-KB_NODE *WHO_root;
-
 /* the maximum ASCII difference to accept the closest match */
 #define MAX_DIFFERENCE  200
 
+/* the steps of normalize_entity(), which may be combined */
+#define NORMALIZE_WHITESPACE    1   /* collapse runs of whitespace to one space, and trim it */
+#define NORMALIZE_PUNCTUATION   2   /* remove punctuation */
+#define NORMALIZE_ARTICLES      4   /* remove the words "a", "an" and "the" */
+#define NORMALIZE_ALL           (NORMALIZE_WHITESPACE | NORMALIZE_PUNCTUATION | NORMALIZE_ARTICLES)
+
+/* the size of the blocks in which knowledge files are written */
+#define WRITE_BLOCK     (1024 * 1024)
+
+/* the output buffer of a knowledge file being written */
+typedef struct write_buffer
+{
+    FILE *f;                        // the file
+    char *data;                     // WRITE_BLOCK bytes waiting to be written
+    size_t used;                    // the number of bytes in data
+    int status;                     // KB_OK, or the first error
+} WRITE_BUFFER;
+
+/* a walk of a BST in descending order (see cursor_open()) */
+typedef struct tree_cursor
+{
+    KB_NODE **stack;                // the nodes still to visit, the next on top
+    int top;                        // the number of nodes on the stack
+    int capacity;                   // the size of the stack
+    bool failed;                    // the stack could not grow
+} TREE_CURSOR;
+
 /* functions defined in bst.c */
+int compare_token(const char *token1, const char *token2);
 int get_ascii_difference(const char *str1, const char *str2);
+void normalize_entity(const char *entity, int steps, char *key);
 KB_NODE *search(KB_NODE *root, const char *entity);
+KB_NODE *search_exact(KB_NODE *root, const char *entity);
 KB_NODE *create_new_node(const char *entity, const char *response);
-int insert(KB_NODE *root, const char *entity, const char *response);
+void retain_node(KB_NODE *node);
+void release_node(KB_NODE *node);
+int set_response(KB_NODE *node, const char *response);
+int insert(KB_NODE **root, const char *entity, const char *response, int *depth);
+int delete_node(KB_NODE **root, const char *entity);
 int reset(KB_NODE *root);
-void reverse_in_order_write(KB_NODE *root, FILE *f);
+int tree_height(KB_NODE *root);
+int tree_size(KB_NODE *root);
+int rebalance_path(KB_NODE **root, const char *entity, int depth, int count, double factor);
+KB_NODE *tree_to_vine(KB_NODE *root, int *n);
+KB_NODE *vine_to_balanced_bst(KB_NODE **head, int n);
+int balanced_height(int n);
+int vine_to_weighted_bst(KB_NODE **root, KB_NODE *head, int n);
+KB_NODE *splay(KB_NODE *root, const char *entity);
+bool cursor_open(TREE_CURSOR *cursor, KB_NODE *root);
+KB_NODE *cursor_next(TREE_CURSOR *cursor);
+void cursor_close(TREE_CURSOR *cursor);
+void write_node(WRITE_BUFFER *out, const KB_NODE *node, bool counters);
+void reverse_in_order_write(KB_NODE *root, WRITE_BUFFER *out, bool counters);
 int in_order(KB_NODE *root);
 int bst_tests();
 
@@ -105,11 +249,6 @@ typedef struct list_node
     struct list_node *next_ptr;     // ptr to the next node 
 } LIST_NODE;
 
-/* head pointers for WHERE, WHAT and WHO lists */
-LIST_NODE *WHERE_head;
-LIST_NODE *WHAT_head;
-LIST_NODE *WHO_head;
-
 /* functions defined in linkedlist.c */
 int display_list(LIST_NODE *head);
 int insert_to_list(LIST_NODE **head, const char *entity, const char *response);
@@ -118,4 +257,453 @@ KB_NODE *balanced_bst(LIST_NODE *head, bool *mem_error);
 void reset_list(LIST_NODE *head);
 int linkedlist_tests();
 
+/* BLOOM FILTER
+–––––––––––––––––––––––––––––––––––––––––––––––––– */
+/* the number of bits per key, and of bits set for each key (about 1% false positives) */
+#define BLOOM_BITS      10
+#define BLOOM_HASHES    7
+
+/* the smallest number of keys a filter is sized for */
+#define BLOOM_MIN       64
+
+/* a Bloom filter over the entities of a BST */
+typedef struct bloom_filter
+{
+    unsigned char *bits;            // the bits (NULL if the filter is empty)
+    size_t n_bits;                  // the number of bits (a power of two)
+    int capacity;                   // the number of keys it is sized for
+    int count;                      // the number of keys added since it was built
+} BLOOM_FILTER;
+
+/* functions defined in bloom.c */
+void bloom_clear(BLOOM_FILTER *filter);
+void bloom_build(BLOOM_FILTER *filter, KB_NODE *root, int n);
+void bloom_add(BLOOM_FILTER *filter, const char *entity, KB_NODE *root, int n);
+bool bloom_maybe(const BLOOM_FILTER *filter, const char *entity);
+
+/* KNOWLEDGE BASE
+–––––––––––––––––––––––––––––––––––––––––––––––––– */
+/* the maximum number of characters allowed in the name of a tenant (including the terminating null) */
+#define MAX_TENANT      64
+
+/* indexes of the intents within a knowledge base */
+#define INTENT_WHAT     0
+#define INTENT_WHERE    1
+#define INTENT_WHO      2
+#define NUM_INTENTS     3
+
+/* how a knowledge base lays out its BSTs as questions are asked */
+#define LAYOUT_STATIC   0   /* balanced when loaded, never restructured */
+#define LAYOUT_WEIGHTED 1   /* rebuilt weight-balanced by hits every LAYOUT_PERIOD questions */
+#define LAYOUT_SPLAY    2   /* each entity asked about is splayed to the root */
+
+/* the number of questions about an intent between weighted rebuilds */
+#define LAYOUT_PERIOD   1024
+
+/* by default, a BST is rebalanced when it is more than this many times the height of a balanced one */
+#define REBALANCE_FACTOR    2.0
+
+/* the links nearest a new node that rebalance_path() looks for a subtree to rebuild in */
+#define REBALANCE_PATH      128
+
+/* the initial number of buckets of an intent's table of aliases */
+#define ALIAS_BUCKETS   16
+
+/* the most aliases followed to find the entity an alias stands for */
+#define ALIAS_HOPS      8
+
+/* a knowledge base, with a BST for each intent */
+typedef struct knowledge_base
+{
+    char name[MAX_TENANT];                  // the tenant this knowledge base belongs to
+    KB_NODE *root[NUM_INTENTS];             // root of the BST for each intent
+    int count[NUM_INTENTS];                 // number of nodes in each BST
+    int peak[NUM_INTENTS];                  // the most nodes each BST has held since it was last rebuilt
+    size_t text_bytes[NUM_INTENTS];         // about the size of the entities of each BST (see knowledge_memory() for responses)
+    int rebalances[NUM_INTENTS];            // the number of times each BST has been rebalanced
+    double rebalance_factor;                // rebalance when height > factor * balanced height (0 = never)
+    BLOOM_FILTER filter[NUM_INTENTS];       // the entities of each BST (see bloom.c)
+    bool fuzzy;                             // suggest the closest match for unknown entities
+    int layout;                             // LAYOUT_STATIC, LAYOUT_WEIGHTED or LAYOUT_SPLAY
+    unsigned asked[NUM_INTENTS];            // questions about each intent since the last rebuild
+    int merge_policy;                       // KB_MERGE_REPLACE or KB_MERGE_KEEP
+    bool dirty;                             // changed since it was last written back
+    bool saving;                            // a background save is in progress
+    pthread_t save_thread;                  // the thread performing the background save
+    atomic_bool save_done;                  // the background save has finished (it can be joined without waiting)
+    int save_status;                        // the first background save to fail since it was last reported (see knowledge_save_status())
+    bool tearing_down;                      // a background teardown is in progress
+    pthread_t teardown_thread;              // the thread freeing the trees from the last reset
+    struct response_cache *cache;           // recent answers (see cache.c; NULL for an overlay)
+    struct knowledge_base *below;           // the layer this one overlays, if any (see knowledge_get())
+    KB_NODE *forgotten[NUM_INTENTS];        // tombstones hiding the entities forgotten from the layers below
+    int tombstones[NUM_INTENTS];            // number of nodes in each tree of tombstones
+    size_t tombstone_bytes;                 // about the size of all the tombstones
+    struct hash_table *aliases[NUM_INTENTS];// the entity each alias stands for (NULL until the first alias)
+    size_t alias_bytes;                     // about the size of all the aliases
+    int normalize;                          // the steps of normalize_entity() applied to questions (0 = none)
+    struct hash_table *normal[NUM_INTENTS]; // the entity of each normalized key that differs from it
+    size_t normal_bytes[NUM_INTENTS];       // about the size of each table of normalized keys
+    struct fulltext_index *fulltext;        // the words of the responses (see knowledge_search(); NULL if not indexed)
+    struct phonetic_index *phonetic[NUM_INTENTS];// how the entities of each intent sound (see phonetic.c; NULL if not indexed)
+    struct knowledge_base *lru_prev;        // more recently used tenant
+    struct knowledge_base *lru_next;        // less recently used tenant
+} KNOWLEDGE_BASE;
+
+/* an answer found by knowledge_search() (see fulltext.c) */
+struct fulltext_hit;
+
+/* functions defined in knowledge.c */
+int get_intent(const char *intent);
+KNOWLEDGE_BASE *knowledge_create(const char *name);
+KNOWLEDGE_BASE *knowledge_create_overlay(const char *name, KNOWLEDGE_BASE *below);
+void knowledge_set_below(KNOWLEDGE_BASE *kb, KNOWLEDGE_BASE *below);
+void knowledge_free(KNOWLEDGE_BASE *kb);
+size_t knowledge_memory(KNOWLEDGE_BASE *kb);
+int knowledge_get(KNOWLEDGE_BASE *kb, const char *intent, const char *entity, char *match, char *response, int n);
+int knowledge_accept(KNOWLEDGE_BASE *kb, const char *intent, const char *match, char *response, int n);
+int knowledge_put(KNOWLEDGE_BASE *kb, const char *intent, const char *entity, const char *response);
+int knowledge_forget(KNOWLEDGE_BASE *kb, const char *intent, const char *entity);
+int knowledge_alias(KNOWLEDGE_BASE *kb, const char *intent, const char *alias, const char *entity);
+int knowledge_search(KNOWLEDGE_BASE *kb, int inc, char *inv[], struct fulltext_hit *hits, int max);
+void knowledge_reset(KNOWLEDGE_BASE *kb);
+int knowledge_read(KNOWLEDGE_BASE *kb, FILE *f);
+int knowledge_write(KNOWLEDGE_BASE *kb, const char *filename);
+int knowledge_write_async(KNOWLEDGE_BASE *kb, const char *filename);
+int knowledge_wait_save(KNOWLEDGE_BASE *kb);
+int knowledge_save_status(KNOWLEDGE_BASE *kb, bool wait);
+void knowledge_wait_teardown(KNOWLEDGE_BASE *kb);
+void write_bytes(WRITE_BUFFER *out, const char *data, size_t n);
+void knowledge_set_merge_policy(KNOWLEDGE_BASE *kb, int policy);
+void knowledge_set_fuzzy(KNOWLEDGE_BASE *kb, bool fuzzy);
+void knowledge_set_layout(KNOWLEDGE_BASE *kb, int layout);
+void knowledge_set_rebalance(KNOWLEDGE_BASE *kb, double factor);
+void knowledge_set_normalize(KNOWLEDGE_BASE *kb, int steps);
+int knowledge_set_fulltext(KNOWLEDGE_BASE *kb, bool on);
+int knowledge_set_phonetic(KNOWLEDGE_BASE *kb, const char *intent, bool on);
+int knowledge_write_counters(KNOWLEDGE_BASE *kb, const char *filename);
+
+/* the directory holding each tenant's knowledge base, as <name>.ini */
+#define TENANT_DIR      "."
+
+/* the default memory budget for resident tenants, in bytes */
+#define TENANT_BUDGET   (64 * 1024 * 1024)
+
+/* functions defined in tenant.c */
+KNOWLEDGE_BASE *tenant_open(const char *name, int *status);
+int tenant_check_budget();
+int tenant_set_budget(size_t budget);
+size_t tenant_memory();
+int tenant_count();
+int tenant_close_all();
+
+/* LOADER
+–––––––––––––––––––––––––––––––––––––––––––––––––– */
+/* the size of the first block in which a knowledge file of unknown length is read */
+#define LOADER_BLOCK        (1024 * 1024)
+
+/* files are only split into chunks of at least this many bytes */
+#define LOADER_MIN_CHUNK    (1024 * 1024)
+
+/* the maximum number of threads used to load a file */
+#define LOADER_MAX_THREADS  64
+
+/* a section's merge is only split into parts of at least this many entries */
+#define LOADER_MIN_MERGE    16384
+
+/* the entries each run offers per part when splitting a merge (see split_merge()) */
+#define LOADER_SAMPLES      8
+
+/* the sections of a knowledge file: one per intent, then "[<intent> aliases]" for each */
+#define NUM_SECTIONS        (2 * NUM_INTENTS)
+#define ALIAS_SECTION(i)    (NUM_INTENTS + (i))
+
+/* an entity/response pair read from a file, or an alias and the entity it
+   stands for (both point into the file buffer) */
+typedef struct kb_entry
+{
+    const char *entity;                     // the entity
+    const char *response;                   // the response for this entity
+} KB_ENTRY;
+
+/* the entries read from a file by load_entries() */
+typedef struct kb_load
+{
+    char *buffer;                           // the contents of the file
+    struct chunk *chunks;                   // the chunks the file was split into
+    int n_chunks;                           // the number of chunks
+    KB_ENTRY **sorted[NUM_SECTIONS];        // the entries of each section, sorted
+    int count[NUM_SECTIONS];                // the number of entries of each section
+} KB_LOAD;
+
+/* an item to build into a BST: an existing node, an entry that needs a node, or both */
+typedef struct build_item
+{
+    KB_NODE *node;                          // the existing node, or NULL
+    const KB_ENTRY *entry;                  // the entry to create or update the node from, or NULL
+} BUILD_ITEM;
+
+/* subtrees smaller than this are built on the thread that needs them */
+#define BUILD_PARALLEL_CUTOFF   16384
+
+/* functions defined in loader.c */
+int loader_threads();
+void run_parallel(void *(*fn)(void *), void *jobs, size_t size, int n);
+int load_entries(FILE *f, KB_LOAD *load);
+void free_entries(KB_LOAD *load);
+int merge_entries(KB_NODE *vine, KB_ENTRY **entries, int m, int policy, BUILD_ITEM *items);
+KB_NODE *build_balanced_bst(BUILD_ITEM *items, int n, int threads, int *count, bool *mem_error);
+
+/* HASH TABLE
+–––––––––––––––––––––––––––––––––––––––––––––––––– */
+/* hash table entry (keys are compared case-insensitively) */
+typedef struct hash_entry
+{
+    char *key;                      // the key (a private copy)
+    void *value;                    // the value stored for this key
+    struct hash_entry *next_ptr;    // ptr to the next entry in the same bucket
+} HASH_ENTRY;
+
+typedef struct hash_table
+{
+    HASH_ENTRY **buckets;           // array of bucket chains
+    int n_buckets;                  // number of buckets
+    int count;                      // number of entries
+} HASH_TABLE;
+
+/* functions defined in hashtable.c */
+unsigned long hash_string(const char *key);
+HASH_TABLE *hash_create(int n_buckets);
+void *hash_get(HASH_TABLE *table, const char *key);
+int hash_put(HASH_TABLE *table, const char *key, void *value);
+void *hash_remove(HASH_TABLE *table, const char *key);
+void hash_destroy(HASH_TABLE *table, void (*free_value)(void *));
+
+/* RESPONSE CACHE
+–––––––––––––––––––––––––––––––––––––––––––––––––– */
+/* the number of answers cached for each knowledge base */
+#define CACHE_SIZE      512
+
+/* the maximum length of a cache key, "<intent> <entity>" (including the terminating null) */
+#define CACHE_KEY       (MAX_ENTITY + 4)
+
+/* a cached answer to a question */
+typedef struct cache_entry
+{
+    char key[CACHE_KEY];                    // "<intent> <entity>"
+    int intent;                             // the index of the intent
+    unsigned generation;                    // the intent's generation when cached
+    bool used;                              // holds an answer
+    bool referenced;                        // used since the CLOCK hand last passed
+    int status;                             // KB_OK, KB_CLOSESTMATCH or KB_NOTFOUND
+    char entity[MAX_ENTITY];                // the matching (or closest) entity
+    char response[MAX_RESPONSE];            // its response
+    KB_NODE *node;                          // its node (valid while the generation is current)
+} CACHE_ENTRY;
+
+/* the cached answers of a knowledge base */
+typedef struct response_cache
+{
+    CACHE_ENTRY entries[CACHE_SIZE];        // the answers
+    HASH_TABLE *index;                      // key -> CACHE_ENTRY
+    int hand;                               // the CLOCK hand
+    int count;                              // the number of entries in use
+    unsigned generation[NUM_INTENTS];       // bumped when an intent's knowledge changes
+    long hits;                              // questions answered from the cache
+    long misses;                            // questions that were not
+} RESPONSE_CACHE;
+
+/* functions defined in cache.c */
+RESPONSE_CACHE *cache_create();
+void cache_free(RESPONSE_CACHE *cache);
+CACHE_ENTRY *cache_get(RESPONSE_CACHE *cache, int intent, const char *entity);
+void cache_put(RESPONSE_CACHE *cache, int intent, const char *entity, int status, KB_NODE *node, const char *response);
+void cache_invalidate(RESPONSE_CACHE *cache, int intent);
+
+/* RESPONSE STORE
+–––––––––––––––––––––––––––––––––––––––––––––––––– */
+/* the number of independently locked parts of the store */
+#define INTERN_SHARDS       64
+
+/* the size of the dictionary that compressed responses refer to */
+#define INTERN_DICTIONARY   (32 * 1024)
+
+/* the most responses of a knowledge file that the dictionary is trained on */
+#define INTERN_SAMPLES      8192
+
+/* functions defined in intern.c */
+const char *intern_put(const char *text);
+const char *intern_retain(const char *stored);
+void intern_release(const char *stored);
+const char *intern_read(const char *stored, char *buffer);
+size_t intern_length(const char *stored);
+size_t intern_share(const char *stored);
+int intern_train(const char *const *samples, int n);
+void intern_set_compression(bool on);
+bool intern_compression();
+size_t intern_memory(int *count, int *compressed);
+
+/* FULL-TEXT INDEX
+–––––––––––––––––––––––––––––––––––––––––––––––––– */
+/* the most characters of a word that are indexed (including the terminating null) */
+#define FULLTEXT_WORD       32
+
+/* the index is compacted once this many of its answers, and most of them, are stale */
+#define FULLTEXT_COMPACT    1024
+
+/* the most answers the chatbot lists for a search */
+#define FULLTEXT_SHOWN      10
+
+/* the answers that mention a word, in increasing order of document number */
+typedef struct posting_list
+{
+    unsigned char *data;                    // the gaps between the document numbers, as varints
+    int size;                               // the number of bytes used
+    int capacity;                           // the number of bytes allocated
+    int last;                               // the last document number in the list, or -1
+} POSTING_LIST;
+
+/* an answer in the full-text index */
+typedef struct fulltext_doc
+{
+    char *entity;                           // the entity (NULL once it is stale)
+    int intent;                             // the index of its intent
+} FULLTEXT_DOC;
+
+/* an index from the words of the responses to the answers that mention them */
+typedef struct fulltext_index
+{
+    HASH_TABLE *words;                      // the POSTING_LIST of each word
+    HASH_TABLE *ids;                        // the document number (plus one) of each "<intent> <entity>"
+    FULLTEXT_DOC *docs;                     // the answers, by document number
+    int n_docs;                             // the number of document numbers used
+    int capacity;                           // the allocated size of docs
+    int stale;                              // the number of answers forgotten or replaced since
+    size_t bytes;                           // about the size of the index
+} FULLTEXT_INDEX;
+
+/* an answer found by knowledge_search() */
+typedef struct fulltext_hit
+{
+    int intent;                             // the index of its intent
+    char entity[MAX_ENTITY];                // the entity
+} FULLTEXT_HIT;
+
+/* functions defined in fulltext.c */
+FULLTEXT_INDEX *fulltext_create();
+void fulltext_free(FULLTEXT_INDEX *index);
+int fulltext_put(FULLTEXT_INDEX *index, int intent, const char *entity, const char *response);
+void fulltext_remove(FULLTEXT_INDEX *index, int intent, const char *entity);
+int fulltext_search(FULLTEXT_INDEX *index, int inc, char *inv[], int **docs);
+
+/* PHONETIC INDEX
+–––––––––––––––––––––––––––––––––––––––––––––––––– */
+/* the most characters of the phonetic key of a word (including the terminating null) */
+#define PHONETIC_KEY        8
+
+/* the most names that sound alike that are tried, best first */
+#define PHONETIC_CANDIDATES 4
+
+/* the names with a word of one phonetic key */
+typedef struct phonetic_names
+{
+    char **entities;                        // the names
+    int count;                              // the number of names
+    int capacity;                           // the allocated size of entities
+} PHONETIC_NAMES;
+
+/* an index from the phonetic keys of words to the names with those words */
+typedef struct phonetic_index
+{
+    HASH_TABLE *keys;                       // the PHONETIC_NAMES of each key
+    size_t bytes;                           // about the size of the index
+} PHONETIC_INDEX;
+
+/* functions defined in phonetic.c */
+void phonetic_key(const char *word, int length, char *key);
+PHONETIC_INDEX *phonetic_create();
+void phonetic_free(PHONETIC_INDEX *index);
+int phonetic_put(PHONETIC_INDEX *index, const char *entity);
+void phonetic_remove(PHONETIC_INDEX *index, const char *entity);
+int phonetic_lookup(PHONETIC_INDEX *index, const char *entity, const char **found, int max);
+int phonetic_tests();
+
+/* SHARED KNOWLEDGE BASE
+–––––––––––––––––––––––––––––––––––––––––––––––––– */
+/* identifies a shared knowledge base segment ("MRCK") */
+#define SHARED_MAGIC    0x4B43524D
+
+/* the start of a shared knowledge base segment; nodes and strings follow */
+typedef struct shared_header
+{
+    uint32_t magic;                         // SHARED_MAGIC
+    uint32_t generation;                    // the version of the knowledge base
+    uint64_t size;                          // the size of the segment, in bytes
+    uint32_t root[NUM_INTENTS];             // the offset of the root of each BST (0 if empty)
+    uint32_t count[NUM_INTENTS];            // the number of nodes in each BST
+} SHARED_HEADER;
+
+/* a BST node in a shared segment (all fields are offsets from the start of the segment; 0 is none) */
+typedef struct shared_node
+{
+    uint32_t left_child;
+    uint32_t right_child;
+    uint32_t entity;
+    uint32_t response;
+} SHARED_NODE;
+
+/* the segment through which the current generation is published */
+typedef struct shared_control
+{
+    atomic_uint generation;                 // the generation workers should attach (0 if none yet)
+} SHARED_CONTROL;
+
+/* a worker's read-only view of a shared knowledge base */
+typedef struct shared_kb
+{
+    char name[MAX_TENANT];                  // the name it was published under
+    SHARED_CONTROL *control;                // the mapped control segment
+    const char *base;                       // the mapped segment of the current generation
+    size_t size;                            // its size, in bytes
+    unsigned generation;                    // its generation
+} SHARED_KB;
+
+/* functions defined in shared.c */
+int shared_publish(const char *name, KNOWLEDGE_BASE *kb);
+int shared_unpublish(const char *name);
+SHARED_KB *shared_attach(const char *name, int *status);
+int shared_get(SHARED_KB *shared, const char *intent, const char *entity, char *match, char *response, int n);
+void shared_detach(SHARED_KB *shared);
+
+/* SMALLTALK
+–––––––––––––––––––––––––––––––––––––––––––––––––– */
+/* the file from which smalltalk content is loaded at start-up */
+#define SMALLTALK_FILE  "smalltalk.ini"
+
+/* a growable array of strings */
+typedef struct string_list
+{
+    char **items;                   // the strings
+    int count;                      // number of strings
+    int capacity;                   // allocated size of items
+} STRING_LIST;
+
+/* a smalltalk pattern, selected by the first word of the input */
+typedef struct smalltalk_pattern
+{
+    STRING_LIST responses;          // response templates (one is chosen at random)
+    bool exit;                      // end the conversation after responding
+    bool tell;                      // dispatch on the last word to a topic
+} SMALLTALK_PATTERN;
+
+/* something the chatbot can tell (jokes, facts, riddles) */
+typedef struct smalltalk_topic
+{
+    STRING_LIST responses;          // things to tell
+    STRING_LIST questions;          // riddle questions
+    STRING_LIST answers;            // riddle answers (same index as questions)
+    char *correct;                  // template for a correct riddle answer
+    char *wrong;                    // template for a wrong riddle answer
+} SMALLTALK_TOPIC;
+
 #endif
\ No newline at end of file
@@ -45,6 +45,78 @@
 #include <stdlib.h>
 #include "chat1002.h"
 
+/* the chatbot's own knowledge base, used when no tenant is selected */
+static KNOWLEDGE_BASE *own_kb = NULL;
+
+/* the knowledge base the chatbot is currently using */
+static KNOWLEDGE_BASE *kb = NULL;
+
+/* the shared knowledge base questions are answered from instead, if attached */
+static SHARED_KB *shared = NULL;
+
+
+/*
+ * Get the knowledge base the chatbot is currently using, creating the
+ * chatbot's own knowledge base the first time.
+ *
+ * Returns: the current knowledge base, or NULL if it could not be created
+ */
+static KNOWLEDGE_BASE *chatbot_kb() {
+
+	if (own_kb == NULL)
+		own_kb = knowledge_create("");
+	if (kb == NULL)
+		kb = own_kb;
+
+	return kb;
+
+}
+
+
+/*
+ * Add to a response that a tenant could not be written back when evicting
+ * the tenants that no longer fit in the memory budget (see
+ * tenant_check_budget()); the tenant is kept.
+ *
+ * Input:
+ *   status   - the result of evicting the tenants
+ *   response - the response so far, to append to
+ *   n        - the size of the response buffer
+ */
+static void report_budget(int status, char *response, int n) {
+
+	int used = strlen(response);
+
+	if (status == KB_NOMEM && used < n)
+		snprintf(response + used, n - used, " (Memory allocation failure writing back a tenant.)");
+	else if (status != KB_OK && used < n)
+		snprintf(response + used, n - used, " (I could not write back a tenant's knowledge, so I am keeping it.)");
+
+}
+
+
+/*
+ * Add to a response that a background save of a knowledge base has failed
+ * since the last response (see knowledge_save_status()).
+ *
+ * Input:
+ *   from     - the knowledge base that was being saved (may be NULL)
+ *   wait     - whether to wait for a save that is still running
+ *   response - the response so far, to append to
+ *   n        - the size of the response buffer
+ */
+static void report_save(KNOWLEDGE_BASE *from, bool wait, char *response, int n) {
+
+	int status = from != NULL ? knowledge_save_status(from, wait) : KB_OK;
+	int used = strlen(response);
+
+	if (status == KB_NOMEM && used < n)
+		snprintf(response + used, n - used, " (Memory allocation failure while saving my knowledge; the file was not changed.)");
+	else if (status != KB_OK && used < n)
+		snprintf(response + used, n - used, " (My last save failed; the file was not changed.)");
+
+}
+
 
 /*
  * Get the name of the chatbot.
@@ -71,16 +143,31 @@ const char *chatbot_username() {
 
 
 /*
- * Get a response to user input.
- *
- * See the comment at the top of the file for a description of how this
- * function is used.
+ * Release the chatbot's knowledge, waiting for any background saves to
+ * finish and writing back any tenants that have changed.
+ */
+void chatbot_close() {
+
+	if ((kb != NULL && knowledge_save_status(kb, true) != KB_OK) || (own_kb != NULL && own_kb != kb && knowledge_save_status(own_kb, true) != KB_OK))
+		printf("%s: (my last save failed; the file was not changed)\n", chatbot_botname());
+	if (tenant_close_all() != KB_OK)
+		printf("%s: (could not write back the knowledge of every tenant)\n", chatbot_botname());
+	knowledge_free(own_kb);
+	own_kb = kb = NULL;
+	shared_detach(shared);
+	shared = NULL;
+
+}
+
+
+/*
+ * Get a response to user input by invoking the do_* function of its intent.
  *
  * Returns:
  *   0, if the chatbot should continue chatting
  *   1, if the chatbot should stop (i.e. it detected the EXIT intent)
  */
-int chatbot_main(int inc, char *inv[], char *response, int n) {
+static int chatbot_respond(int inc, char *inv[], char *response, int n) {
 
 	/* check for empty input */
 	if (inc < 1) {
@@ -107,6 +194,12 @@ int chatbot_main(int inc, char *inv[], char *response, int n) {
 		return 0;
 	}
 
+	/* make sure there is a knowledge base to work with */
+	if (chatbot_kb() == NULL) {
+		snprintf(response, n, "Memory allocation failure.");
+		return 0;
+	}
+
 	/* look for an intent and invoke the corresponding do_* function */
 	if (chatbot_is_exit(inv[0]))
 		return chatbot_do_exit(inc, inv, response, n);
@@ -116,10 +209,32 @@ int chatbot_main(int inc, char *inv[], char *response, int n) {
 		return chatbot_do_load(inc, inv, response, n);
 	else if (chatbot_is_question(inv[0]))
 		return chatbot_do_question(inc, inv, response, n);
+	else if (chatbot_is_forget(inv[0]))
+		return chatbot_do_forget(inc, inv, response, n);
 	else if (chatbot_is_reset(inv[0]))
 		return chatbot_do_reset(inc, inv, response, n);
 	else if (chatbot_is_save(inv[0]))
 		return chatbot_do_save(inc, inv, response, n);
+	else if (chatbot_is_set(inv[0]))
+		return chatbot_do_set(inc, inv, response, n);
+	else if (chatbot_is_tenant(inv[0]))
+		return chatbot_do_tenant(inc, inv, response, n);
+	else if (chatbot_is_cache(inv[0]))
+		return chatbot_do_cache(inc, inv, response, n);
+	else if (chatbot_is_export(inv[0]))
+		return chatbot_do_export(inc, inv, response, n);
+	else if (chatbot_is_diagnostics(inv[0]))
+		return chatbot_do_diagnostics(inc, inv, response, n);
+	else if (chatbot_is_publish(inv[0]))
+		return chatbot_do_publish(inc, inv, response, n);
+	else if (chatbot_is_attach(inv[0]))
+		return chatbot_do_attach(inc, inv, response, n);
+	else if (chatbot_is_alias(inv[0]))
+		return chatbot_do_alias(inc, inv, response, n);
+	else if (chatbot_is_search(inv[0]))
+		return chatbot_do_search(inc, inv, response, n);
+	else if (chatbot_is_trace(inv[0]))
+		return chatbot_do_trace(inc, inv, response, n);
 	else {
 		snprintf(response, n, "I don't understand \"%s\".", inv[0]);
 		return 0;
@@ -128,6 +243,29 @@ int chatbot_main(int inc, char *inv[], char *response, int n) {
 }
 
 
+/*
+ * Get a response to user input, mentioning any background save that has
+ * failed meanwhile.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0, if the chatbot should continue chatting
+ *   1, if the chatbot should stop (i.e. it detected the EXIT intent)
+ */
+int chatbot_main(int inc, char *inv[], char *response, int n) {
+
+	int done = chatbot_respond(inc, inv, response, n);
+
+	if (!done)
+		report_save(kb, false, response, n);
+
+	return done;
+
+}
+
+
 /*
  * Determine whether an intent is EXIT.
  *
@@ -217,7 +355,7 @@ int chatbot_do_load(int inc, char *inv[], char *response, int n) {
 	}
 	else
 	{
-		int num_responses = knowledge_read(in_file);
+		int num_responses = knowledge_read(chatbot_kb(), in_file);
 
 		// Note that error codes are -ve, so this will not conflict with normal return values which are +ve
 		if (num_responses == KB_NOMEM)
@@ -229,6 +367,8 @@ int chatbot_do_load(int inc, char *inv[], char *response, int n) {
 		else
 		{
 			snprintf(response, MAX_RESPONSE, "Read %d responses from %s.", num_responses, filename);
+			if (kb != own_kb)
+				report_budget(tenant_check_budget(), response, MAX_RESPONSE);
 		}
 	}
 
@@ -334,17 +474,58 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n) {
 	strcat(question, entity);
 	strcat(question, "?");
 
-	int status = knowledge_get(inv[0], entity, response, MAX_RESPONSE);
+	// Answer from the shared knowledge base, if attached
+	char match[MAX_ENTITY];
+	int status;
+	TRACE_BEGIN(span, "answer");
+	if (shared != NULL)
+		status = shared_get(shared, inv[0], entity, match, response, MAX_RESPONSE);
+	else
+		status = knowledge_get(chatbot_kb(), inv[0], entity, match, response, MAX_RESPONSE);
+	TRACE_END(span);
+
+	// Closest match found (offer it)
+	if (status == KB_CLOSESTMATCH)
+	{
+		char answer[MAX_INPUT];
+		prompt_user(answer, MAX_INPUT, "Sorry, I don't know about %s. Did you mean %s? (yes/no)", entity, match);
+
+		// User accepts closest match
+		if (compare_token(answer, "yes") == 0 || compare_token(answer, "y") == 0)
+		{
+			// (shared_get() has already given the match's response)
+			if (shared == NULL)
+				status = knowledge_accept(chatbot_kb(), inv[0], match, response, MAX_RESPONSE);
+			else
+				status = KB_OK;
+		}
+		// User does not accept closest match (ask for the knowledge below)
+		else if (compare_token(answer, "no") == 0 || compare_token(answer, "n") == 0)
+		{
+			status = KB_NOTFOUND;
+		}
+		// Invalid input (ends the current transaction)
+		else
+		{
+			snprintf(response, MAX_RESPONSE, "I dont understand '%s'", answer);
+		}
+	}
+
 	if (status == KB_INVALID)
 	{
 		snprintf(response, MAX_RESPONSE, "%s", "Invalid question.");
 	}
+	else if (status == KB_NOTFOUND && shared != NULL)
+	{
+		// Shared knowledge is read-only
+		snprintf(response, MAX_RESPONSE, "I don't know about %s.", entity);
+	}
 	else if (status == KB_NOTFOUND)
 	{
 		char input[MAX_INPUT];
 		prompt_user(input, MAX_INPUT, "%s", question);
 		
-		status = knowledge_put(inv[0], entity, input);
+		status = knowledge_put(chatbot_kb(), inv[0], entity, input);
 
 		if (status == KB_NOMEM)
 		{
@@ -353,12 +534,72 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n) {
 		else
 		{
 			snprintf(response, MAX_RESPONSE, "%s", "Thank you.");
+			if (kb != own_kb)
+				report_budget(tenant_check_budget(), response, MAX_RESPONSE);
 		}
 	}
 	return 0;
 }
 
 
+/*
+ * Determine whether an intent is FORGET.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "forget"
+ *  0, otherwise
+ */
+int chatbot_is_forget(const char *intent) {
+
+	return compare_token(intent, "forget") == 0;
+
+}
+
+
+/*
+ * Forget the answer to a question.
+ *
+ * inv[1] contains the question word, and the rest of the input is the
+ * question, as for chatbot_do_question() (e.g. "forget what is SIT").
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after forgetting)
+ */
+int chatbot_do_forget(int inc, char *inv[], char *response, int n) {
+
+	if (inc < 2 || !chatbot_is_question(inv[1]))
+	{
+		snprintf(response, n, "Usage: forget what|where|who <entity>.");
+		return 0;
+	}
+
+	char *entity = get_entity(inc - 1, inv + 1);
+	if (entity == NULL)
+	{
+		snprintf(response, n, "Please provide an entity.");
+		return 0;
+	}
+
+	if (knowledge_forget(chatbot_kb(), inv[1], entity) == KB_OK)
+	{
+		snprintf(response, n, "I have forgotten about %s.", entity);
+	}
+	else
+	{
+		snprintf(response, n, "I didn't know about %s anyway.", entity);
+	}
+
+	return 0;
+
+}
+
+
 /*
  * Determine whether an intent is RESET.
  *
@@ -387,7 +628,7 @@ int chatbot_is_reset(const char *intent) {
  */
 int chatbot_do_reset(int inc, char *inv[], char *response, int n) {
 
-	knowledge_reset();
+	knowledge_reset(chatbot_kb());
 	snprintf(response, MAX_RESPONSE, "%s", "Reset successful.");
 
 	return 0;
@@ -423,18 +664,15 @@ int chatbot_is_save(const char *intent) {
  */
 int chatbot_do_save(int inc, char *inv[], char *response, int n) {
 
-	FILE *out_file;
 	char *filename;
 
 	if (inc >= 3 && (compare_token(inv[1], "to") == 0 || compare_token(inv[1], "as") == 0))
 	{
 		filename = inv[2];
-		out_file = fopen(inv[2], "w");
 	}
 	else if (inc >= 2)
 	{
 		filename = inv[1];
-		out_file = fopen(inv[1], "w");
 	}
 	else
 	{
@@ -442,9 +680,20 @@ int chatbot_do_save(int inc, char *inv[], char *response, int n) {
 		return 0;
 	}
 
-	knowledge_write(out_file);
+	// Written in the background, so that learning can continue meanwhile
+	int status = knowledge_write_async(chatbot_kb(), filename);
+	if (status == KB_NOMEM)
+	{
+		snprintf(response, MAX_RESPONSE, "Memory allocation failure.");
+		return 0;
+	}
+	if (status != KB_OK)
+	{
+		snprintf(response, MAX_RESPONSE, "I could not open %s for writing.", filename);
+		return 0;
+	}
 
-	snprintf(response, MAX_RESPONSE, "My knowledge has been saved to %s.", filename);
+	snprintf(response, MAX_RESPONSE, "Saving my knowledge to %s...", filename);
 
 	return 0;
 
@@ -452,286 +701,755 @@ int chatbot_do_save(int inc, char *inv[], char *response, int n) {
 
 
 /*
- * Determine which an intent is smalltalk.
- *
+ * Determine whether an intent is SET.
  *
  * Input:
  *  intent - the intent
  *
  * Returns:
- *  1, if the intent is the first word of one of the smalltalk phrases
+ *  1, if the intent is "set"
  *  0, otherwise
  */
-int chatbot_is_smalltalk(const char *intent) {
+int chatbot_is_set(const char *intent) {
+
+	return compare_token(intent, "set") == 0;
 
-	return compare_token("Hello", intent) == 0 ||
-	    compare_token("Hi", intent) == 0 ||
-	    compare_token("Hey", intent) == 0 ||
-		compare_token("It's", intent) == 0 ||
-		compare_token("I'm", intent) == 0 ||
-		compare_token("You're", intent) == 0 ||
-		compare_token("Yes", intent) == 0 ||
-		compare_token("No", intent) == 0 ||
-		compare_token("Good", intent) == 0 ||
-		compare_token("Goodbye", intent) == 0 ||
-		compare_token("Tell", intent) == 0;
 }
 
+
 /*
- * Reflects the user's message back at them. 
+ * Get the steps of normalize_entity() named by the words of a SET NORMALIZE
+ * ("on", "off", or any of "whitespace", "punctuation" and "articles").
+ *
+ * Returns: the steps, or -1 if a word does not name any
  */
+static int normalize_steps(int inc, char *inv[]) {
+
+	int steps = 0;
+
+	for (int i = 0; i < inc; i++) {
+		if (compare_token(inv[i], "on") == 0)
+			steps |= NORMALIZE_ALL;
+		else if (compare_token(inv[i], "whitespace") == 0)
+			steps |= NORMALIZE_WHITESPACE;
+		else if (compare_token(inv[i], "punctuation") == 0)
+			steps |= NORMALIZE_PUNCTUATION;
+		else if (compare_token(inv[i], "articles") == 0)
+			steps |= NORMALIZE_ARTICLES;
+		else if (compare_token(inv[i], "off") != 0)
+			return -1;
+	}
 
-int get_reflection(char *reflection, char *inv[], int inc)
-{
-	strcpy(reflection, "");
-
-	for (int i = 1; i < inc; i++)
-	{
-		if (strlen(reflection) > 0)
-		{
-			strcat(reflection, " ");
-		}
+	return steps;
 
-		// Speak from perspective of the chatbot
-		if (compare_token(inv[i], "am") == 0) { strcat(reflection, "are"); } 
-		else if (compare_token(inv[i], "was") == 0) { strcat(reflection, "were"); } 
-		else if (compare_token(inv[i], "i") == 0) { strcat(reflection, "you"); } 
-		else if (compare_token(inv[i], "i'd") == 0) { strcat(reflection, "you'd"); } 
-		else if (compare_token(inv[i], "i've") == 0) { strcat(reflection, "you've"); } 
-		else if (compare_token(inv[i], "i'll") == 0) { strcat(reflection, "you'll"); } 
-		else if (compare_token(inv[i], "my") == 0) { strcat(reflection, "your"); } 
-		else if (compare_token(inv[i], "are") == 0) { strcat(reflection, "am"); } 
-		else if (compare_token(inv[i], "you've") == 0) { strcat(reflection, "I've"); } 
-		else if (compare_token(inv[i], "you'll") == 0) { strcat(reflection, "I'll"); } 
-		else if (compare_token(inv[i], "your") == 0) { strcat(reflection, "my"); } 
-		else if (compare_token(inv[i], "yours") == 0) { strcat(reflection, "mine"); } 
-		else if (compare_token(inv[i], "you") == 0) { strcat(reflection, "me"); } 
-		else if (compare_token(inv[i], "me") == 0) { strcat(reflection, "you"); } 
-		else
-		{
-			strcat(reflection, inv[i]);
-		}
-		
-	}
-	return 0;
 }
 
+
 /*
- * Respond to smalltalk.
+ * Change one of the chatbot's options.
+ *
+ * inv[1] contains the name of the option and inv[2] its new value:
+ *    - merge replace|keep: which definition wins when loading an entity
+ *      that is already known (see knowledge_set_merge_policy()).
+ *    - fuzzy on|off: whether to suggest the closest match for an unknown
+ *      entity (see knowledge_set_fuzzy()).
+ *    - layout static|weighted|splay: how the knowledge is rearranged as
+ *      questions are asked (see knowledge_set_layout()).
+ *    - rebalance <factor>|off: how much deeper than balanced a BST may grow
+ *      through learning before it is rebalanced (see knowledge_set_rebalance()).
+ *    - compression on|off: whether responses are stored compressed, with a
+ *      dictionary trained on the next file loaded (see intern.c).
+ *    - normalize on|off|<steps>: what to overlook in an entity that is not
+ *      known as asked, as any of whitespace, punctuation and articles (see
+ *      knowledge_set_normalize()).
+ *    - search on|off: whether the words of the responses are indexed for
+ *      SEARCH (see knowledge_set_fulltext()).
+ *    - phonetic on|off [what|where|who]: whether names that sound like an
+ *      unknown entity of the intent (WHO, if none is given) are offered before
+ *      its closest match (see knowledge_set_phonetic()).
+ *    - budget <bytes>: the memory budget for resident tenants (see tenant.c).
  *
  * See the comment at the top of the file for a description of how this
  * function is used.
  *
  * Returns:
- *   0, if the chatbot should continue chatting
- *   1, if the chatbot should stop chatting (e.g. the smalltalk was "goodbye" etc.)
+ *   0 (the chatbot always continues chatting after setting an option)
  */
-int chatbot_do_smalltalk(int inc, char *inv[], char *response, int n) {
+int chatbot_do_set(int inc, char *inv[], char *response, int n) {
 
-	if (compare_token("Hello", inv[0]) == 0 || compare_token("Hi", inv[0]) == 0 || compare_token("Hey", inv[0]) == 0) {
-		snprintf(response, n, "Hellooooooooo :)");
+	int steps = 0;
 
-	} else if (compare_token("It's", inv[0]) == 0){
-		int chosen_resp = rand() % 4;
-		char reflection[MAX_ENTITY];
-		
-		get_reflection(reflection, inv, inc);
+	if (inc < 3)
+	{
+		snprintf(response, n, "Usage: set <option> <value>.");
+	}
+	else if (compare_token(inv[1], "merge") == 0 && compare_token(inv[2], "replace") == 0)
+	{
+		knowledge_set_merge_policy(chatbot_kb(), KB_MERGE_REPLACE);
+		snprintf(response, n, "Loaded knowledge will now replace what I know.");
+	}
+	else if (compare_token(inv[1], "merge") == 0 && compare_token(inv[2], "keep") == 0)
+	{
+		knowledge_set_merge_policy(chatbot_kb(), KB_MERGE_KEEP);
+		snprintf(response, n, "Loaded knowledge will no longer replace what I know.");
+	}
+	else if (compare_token(inv[1], "fuzzy") == 0 && compare_token(inv[2], "on") == 0)
+	{
+		knowledge_set_fuzzy(chatbot_kb(), true);
+		snprintf(response, n, "I will suggest what you might have meant.");
+	}
+	else if (compare_token(inv[1], "fuzzy") == 0 && compare_token(inv[2], "off") == 0)
+	{
+		knowledge_set_fuzzy(chatbot_kb(), false);
+		snprintf(response, n, "I will only answer about things I know exactly.");
+	}
+	else if (compare_token(inv[1], "layout") == 0 && compare_token(inv[2], "static") == 0)
+	{
+		knowledge_set_layout(chatbot_kb(), LAYOUT_STATIC);
+		snprintf(response, n, "I will keep my knowledge as it is loaded.");
+	}
+	else if (compare_token(inv[1], "layout") == 0 && compare_token(inv[2], "weighted") == 0)
+	{
+		knowledge_set_layout(chatbot_kb(), LAYOUT_WEIGHTED);
+		snprintf(response, n, "I will rearrange my knowledge around what is asked most often.");
+	}
+	else if (compare_token(inv[1], "layout") == 0 && compare_token(inv[2], "splay") == 0)
+	{
+		knowledge_set_layout(chatbot_kb(), LAYOUT_SPLAY);
+		snprintf(response, n, "I will keep what was asked last closest to hand.");
+	}
+	else if (compare_token(inv[1], "rebalance") == 0 && atof(inv[2]) >= 1)
+	{
+		knowledge_set_rebalance(chatbot_kb(), atof(inv[2]));
+		snprintf(response, n, "I will rebalance my knowledge when it is %g times deeper than it needs to be.", atof(inv[2]));
+	}
+	else if (compare_token(inv[1], "rebalance") == 0 && compare_token(inv[2], "off") == 0)
+	{
+		knowledge_set_rebalance(chatbot_kb(), 0);
+		snprintf(response, n, "I will no longer rebalance my knowledge as I learn.");
+	}
+	else if (compare_token(inv[1], "compression") == 0 && compare_token(inv[2], "on") == 0)
+	{
+		intern_set_compression(true);
+		snprintf(response, n, "I will compress the responses I learn from now on.");
+	}
+	else if (compare_token(inv[1], "compression") == 0 && compare_token(inv[2], "off") == 0)
+	{
+		intern_set_compression(false);
+		snprintf(response, n, "I will no longer compress the responses I learn.");
+	}
+	else if (compare_token(inv[1], "normalize") == 0 && (steps = normalize_steps(inc - 2, inv + 2)) == 0)
+	{
+		knowledge_set_normalize(chatbot_kb(), 0);
+		snprintf(response, n, "I will only answer about things as they are written.");
+	}
+	else if (compare_token(inv[1], "normalize") == 0 && steps > 0)
+	{
+		static const struct { int step; const char *name; } names[] = {
+			{ NORMALIZE_WHITESPACE, "whitespace" }, { NORMALIZE_PUNCTUATION, "punctuation" }, { NORMALIZE_ARTICLES, "articles" }
+		};
+		int used = snprintf(response, n, "I will overlook differences in");
+		for (int k = 0, listed = 0; k < 3 && used < n; k++)
+			if (steps & names[k].step)
+				used += snprintf(response + used, n - used, "%s %s", listed++ > 0 ? "," : "", names[k].name);
+		if (used < n)
+			snprintf(response + used, n - used, ".");
+		knowledge_set_normalize(chatbot_kb(), steps);
+	}
+	else if (compare_token(inv[1], "search") == 0 && compare_token(inv[2], "on") == 0)
+	{
+		if (knowledge_set_fulltext(chatbot_kb(), true) == KB_OK)
+			snprintf(response, n, "I will remember which answers mention which words.");
+		else
+			snprintf(response, n, "Memory allocation failure.");
+	}
+	else if (compare_token(inv[1], "search") == 0 && compare_token(inv[2], "off") == 0)
+	{
+		knowledge_set_fulltext(chatbot_kb(), false);
+		snprintf(response, n, "I will no longer remember which answers mention which words.");
+	}
+	else if (compare_token(inv[1], "phonetic") == 0 && (compare_token(inv[2], "on") == 0 || compare_token(inv[2], "off") == 0))
+	{
+		const char *intent = inc > 3 ? inv[3] : "who";
+		bool on = compare_token(inv[2], "on") == 0;
+		int status = knowledge_set_phonetic(chatbot_kb(), intent, on);
+		if (status == KB_INVALID)
+			snprintf(response, n, "Sorry, I only know about what, where and who.");
+		else if (status == KB_NOMEM)
+			snprintf(response, n, "Memory allocation failure.");
+		else if (on)
+			snprintf(response, n, "I will suggest names that sound like the ones you ask %s about.", intent);
+		else
+			snprintf(response, n, "I will no longer suggest names that sound like the ones you ask %s about.", intent);
+	}
+	else if (compare_token(inv[1], "budget") == 0 && atol(inv[2]) > 0)
+	{
+		int status = tenant_set_budget((size_t) atol(inv[2]));
+		snprintf(response, n, "Tenants may now use up to %ld bytes.", atol(inv[2]));
+		report_budget(status, response, n);
+	}
+	else
+	{
+		snprintf(response, n, "I don't know how to set %s to %s.", inv[1], inv[2]);
+	}
 
-		switch(chosen_resp) {
-			case 0:
-				snprintf(response, n, "%s indeed!", reflection);
-				break;
-			case 1:
-				snprintf(response, n, "If I told you that it probably isn't %s, what would you feel?", reflection);
-				break;
-			case 2:
-				snprintf(response, n, "It could well be that it's %s.", reflection);
-				break;
-			case 3:
-				snprintf(response, n, "You seem very certain.");
-				break;
-		}
+	return 0;
 
-	} else if (compare_token("I'm", inv[0]) == 0){
-		int chosen_resp = rand() % 4;
-		char reflection[MAX_ENTITY];
-		
-		get_reflection(reflection, inv, inc);
+}
 
-		switch(chosen_resp) {
-			case 0:
-				snprintf(response, n, "How does being %s make you feel?", reflection);
-				break;
-			case 1:
-				snprintf(response, n, "Do you enjoy being %s?", reflection);
-				break;
-			case 2:
-				snprintf(response, n, "Why do you tell me you're %s?", reflection);
-				break;
-			case 3:
-				snprintf(response, n, "Why do you think you're %s?", reflection);
-				break;
-		}
 
-	} else if (compare_token("You're", inv[0]) == 0){
-		int chosen_resp = rand() % 4;
-		char reflection[MAX_ENTITY];
-		
-		get_reflection(reflection, inv, inc);
+/*
+ * Determine whether an intent is TENANT.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "tenant"
+ *  0, otherwise
+ */
+int chatbot_is_tenant(const char *intent) {
 
-		switch(chosen_resp) {
-			case 0:
-				snprintf(response, n, "Why do you think I am %s?", reflection);
-				break;
-			case 1:
-				snprintf(response, n, "Does it please you to think that I'm %s?", reflection);
-				break;
-			case 2:
-				snprintf(response, n, "Perhaps you would like me to be %s.", reflection);
-				break;
-			case 3:
-				snprintf(response, n, "Are we talking about you, or me?");
-				break;
-		}
+	return compare_token(intent, "tenant") == 0;
 
-	} else if (compare_token("Yes", inv[0]) == 0){
+}
 
-		int chosen_resp = rand() % 4;
 
-		switch(chosen_resp) {
-			case 0:
-				snprintf(response, n, "You seem quite sure.");
-				break;
-			case 1:
-				snprintf(response, n, "I think so too!");
-				break;
-			case 2:
-				snprintf(response, n, "Indeed.");
-				break;
-			case 3:
-				snprintf(response, n, "I see.");
-				break;
-		}
+/*
+ * Switch to a tenant's knowledge base, loading it if it is not resident.
+ * Without a tenant name, switch back to the chatbot's own knowledge base.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after switching tenants)
+ */
+int chatbot_do_tenant(int inc, char *inv[], char *response, int n) {
 
-	} else if (compare_token("No", inv[0]) == 0){
+	// The next responses only report on the current knowledge base, so a save
+	// of the one being left is waited for
+	KNOWLEDGE_BASE *left = kb;
 
-		int chosen_resp = rand() % 4;
+	if (inc < 2)
+	{
+		kb = own_kb;
+		snprintf(response, n, "I am using my own knowledge again.");
+		if (left != kb)
+			report_save(left, true, response, n);
+		return 0;
+	}
 
-		switch(chosen_resp) {
-			case 0:
-				snprintf(response, n, "You seem quite sure.");
-				break;
-			case 1:
-				snprintf(response, n, "Oh.");
-				break;
-			case 2:
-				snprintf(response, n, "I thought so too.");
-				break;
-			case 3:
-				snprintf(response, n, "I see.");
-				break;
-		}
+	int status;
+	KNOWLEDGE_BASE *tenant_kb = tenant_open(inv[1], &status);
+
+	if (status == KB_INVALID)
+	{
+		snprintf(response, n, "'%s' is not a valid tenant name.", inv[1]);
+	}
+	else if (status == KB_NOMEM)
+	{
+		snprintf(response, n, "Memory allocation failure.");
+	}
+	else
+	{
+		kb = tenant_kb;
+		int evicted = tenant_check_budget();
+		snprintf(response, n, "I am now using the knowledge of %s (%d tenants, %ld bytes resident).",
+			inv[1], tenant_count(), (long) tenant_memory());
+		report_budget(evicted, response, n);
+		if (left != kb)
+			report_save(left, true, response, n);
+	}
 
-	} else if (compare_token("Good", inv[0]) == 0){
+	return 0;
 
-		char reflection[MAX_ENTITY];
-		get_reflection(reflection, inv, inc);
+}
 
-		snprintf(response, n, "Excellent %s", reflection);
 
-	} else if (compare_token("Goodbye", inv[0]) == 0){
+/*
+ * Determine whether an intent is CACHE.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "cache"
+ *  0, otherwise
+ */
+int chatbot_is_cache(const char *intent) {
 
-	    int chosen_resp = rand() % 3;
+	return compare_token(intent, "cache") == 0;
 
-        switch(chosen_resp) {
-            case 0:
-                snprintf(response, n, "Have an excellent day!");
-                break;
-            case 1:
-                snprintf(response, n, "Goodbye!");
-                break;
-            case 2:
-                snprintf(response, n, "Catch ya later!");
-                break;
-        }
+}
 
-		return 1;
 
-	} else if (compare_token("Tell", inv[0]) == 0){
-		int chosen_resp = rand() % 4;
-		char answer[MAX_INPUT];
-		memset(answer, 0, MAX_INPUT);
-		if (compare_token("riddle", inv[inc-1]) == 0) {
-			switch(chosen_resp) {
-				case 0:
-					prompt_user(answer, MAX_INPUT, "When is a door not a door?");
-					if (compare_token("When it is a jar", answer) != 0) {
-						snprintf(response, n, "Actually... the answer was 'when it is a jar'. HAHA!!!!!");
-					} else {
-						snprintf(response, n, "You are right! Excellent job!");
-					}
-					break;
-				case 1:
-					prompt_user(answer, MAX_INPUT, "Not chest or box is now discussed. Money can be held in it, but just as we test its metal, within it there is rust?");
-					if (compare_token("Trust", answer) != 0) {
-						snprintf(response, n, "Actually... the answer was 'trust'. HAHA!!!!!");
-					} else {
-						snprintf(response, n, "You are right! Excellent job!");
-					}
-					break;
-				case 2:
-					prompt_user(answer, MAX_INPUT, "The more you take, the more you leave behind. What am I?");
-					if (compare_token("Footsteps", answer) != 0) {
-						snprintf(response, n, "Actually... the answer was 'Footsteps'. HAHA!!!!!");
-					} else
-					{
-						snprintf(response, n, "You are right! Excellent job!");
-					}
-					break;
-				case 3:
-					prompt_user(answer, MAX_INPUT, "What belongs to you, but other people use it more than you?");
-					if (compare_token("Your name", answer) != 0) {
-						snprintf(response, n, "Actually... the answer was 'Your name'. HAHA!!!!!");
-					} else
-					{
-						snprintf(response, n, "You are right! Excellent job!");
-					}
-					break;
-										
-			}
-		} else if (compare_token("joke", inv[inc-1]) == 0) {
-			switch(chosen_resp) {
-				case 0:
-					snprintf(response, n, "I don't like comic books, they have too many issues.");
-					break;
-				case 1:
-					snprintf(response, n, "I was once asked what drove me to be a programmer. I replied, Grab.");
-					break;
-				case 2:
-					snprintf(response, n, "What is the best thing about Switzerland? I don't know, but the flag is a big plus.");
-					break;
-				case 3:
-					snprintf(response, n, "Why do we tell actors to break a leg? Because every play has a cast.");
-			}
-		} else if (compare_token("fact", inv[inc-1]) == 0) {
-			switch(chosen_resp) {
-				case 0:
-					snprintf(response, n, "Do you know that in 1986, Apple launched a clothing line?");
-					break;
-				case 1:
-					snprintf(response, n, "Do you know that Google rents out goats?");
-					break;
-				case 2:
-					snprintf(response, n, "Do you know that we breathe about 20000 times a day?");
-					break;
-				case 3:
-					snprintf(response, n, "Do you know that the first fast food restaurant is A&W?");
-					break;
-			}
-		} else {
-			snprintf(response, n, "Sorry, I can only tell you jokes, riddles or facts!");
-		}
+/*
+ * Report how well the response cache of the current knowledge base is doing.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after reporting)
+ */
+int chatbot_do_cache(int inc, char *inv[], char *response, int n) {
+
+	RESPONSE_CACHE *cache = chatbot_kb()->cache;
+	long asked = cache->hits + cache->misses;
+
+	snprintf(response, n, "I remember %d of my answers; %ld of %ld questions (%ld%%) were answered from memory.",
+		cache->count, cache->hits, asked, asked > 0 ? cache->hits * 100 / asked : 0L);
+
+	return 0;
+
+}
+
+
+/*
+ * Determine whether an intent is EXPORT.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "export"
+ *  0, otherwise
+ */
+int chatbot_is_export(const char *intent) {
+
+	return compare_token(intent, "export") == 0;
+
+}
+
+
+/*
+ * Export how often each entity has been asked about to a file.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after exporting)
+ */
+int chatbot_do_export(int inc, char *inv[], char *response, int n) {
+
+	char *filename;
+
+	if (inc >= 3 && (compare_token(inv[1], "to") == 0 || compare_token(inv[1], "as") == 0))
+	{
+		filename = inv[2];
+	}
+	else if (inc >= 2)
+	{
+		filename = inv[1];
+	}
+	else
+	{
+		snprintf(response, n, "Missing filename to export to.");
+		return 0;
+	}
+
+	int status = knowledge_write_counters(chatbot_kb(), filename);
+	if (status == KB_NOMEM)
+	{
+		snprintf(response, n, "Memory allocation failure.");
+	}
+	else if (status != KB_OK)
+	{
+		snprintf(response, n, "I could not open %s for writing.", filename);
+	}
+	else
+	{
+		snprintf(response, n, "I have written how often I was asked about each thing to %s.", filename);
+	}
+
+	return 0;
+
+}
+
+
+/*
+ * Determine whether an intent is DIAGNOSTICS.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "diagnostics"
+ *  0, otherwise
+ */
+int chatbot_is_diagnostics(const char *intent) {
+
+	return compare_token(intent, "diagnostics") == 0;
+
+}
+
+
+/*
+ * Report the shape of the current knowledge base's BSTs: for each intent,
+ * the number of nodes, the height (and that of a balanced BST with as many
+ * nodes), and how many times it has been rebalanced; and how many distinct
+ * responses are stored for all the knowledge bases, in how much memory.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after reporting)
+ */
+int chatbot_do_diagnostics(int inc, char *inv[], char *response, int n) {
+
+	static const char *intents[NUM_INTENTS] = { "what", "where", "who" };
+	KNOWLEDGE_BASE *kb = chatbot_kb();
+	int used = 0;
+
+	for (int i = 0; i < NUM_INTENTS && used < n; i++)
+	{
+		used += snprintf(response + used, n - used, "%s%s: %d nodes, height %d (balanced %d), %d rebalances",
+			i > 0 ? "; " : "", intents[i], kb->count[i], tree_height(kb->root[i]),
+			balanced_height(kb->count[i]), kb->rebalances[i]);
+	}
+
+	int stored, compressed;
+	size_t bytes = intern_memory(&stored, &compressed);
+	if (used < n)
+	{
+		snprintf(response + used, n - used, "; %d responses (%d compressed) in %ld bytes", stored, compressed, (long) bytes);
+	}
+
+	return 0;
+
+}
+
+
+/*
+ * Determine whether an intent is PUBLISH.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "publish" or "unpublish"
+ *  0, otherwise
+ */
+int chatbot_is_publish(const char *intent) {
+
+	return compare_token(intent, "publish") == 0 || compare_token(intent, "unpublish") == 0;
+
+}
+
+
+/*
+ * Publish the current knowledge base for other chatbot processes to attach
+ * to ("publish [as] <name>"), replacing what was published under the name
+ * before; or withdraw it ("unpublish <name>"). See shared.c.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after publishing)
+ */
+int chatbot_do_publish(int inc, char *inv[], char *response, int n) {
+
+	bool publish = compare_token(inv[0], "publish") == 0;
+	char *name;
+
+	if (inc >= 3 && compare_token(inv[1], "as") == 0)
+		name = inv[2];
+	else if (inc >= 2)
+		name = inv[1];
+	else
+	{
+		snprintf(response, n, "Usage: %s [as] <name>.", inv[0]);
+		return 0;
+	}
+
+	int status = publish ? shared_publish(name, chatbot_kb()) : shared_unpublish(name);
+	if (status == KB_OK)
+		snprintf(response, n, publish ? "My knowledge is now shared as %s." : "My knowledge is no longer shared as %s.", name);
+	else if (status == KB_NOTFOUND)
+		snprintf(response, n, "Nothing is shared as %s.", name);
+	else if (status == KB_NOMEM)
+		snprintf(response, n, "Memory allocation failure.");
+	else
+		snprintf(response, n, "I could not share knowledge as '%s'.", name);
+
+	return 0;
+
+}
+
+
+/*
+ * Determine whether an intent is ATTACH.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "attach"
+ *  0, otherwise
+ */
+int chatbot_is_attach(const char *intent) {
+
+	return compare_token(intent, "attach") == 0;
+
+}
+
+
+/*
+ * Answer questions from a knowledge base published by another chatbot
+ * process ("attach [to] <name>"), rather than the current one. Shared
+ * knowledge is read-only, so nothing is learned while attached. Without a
+ * name, detach and use the current knowledge base again.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after attaching)
+ */
+int chatbot_do_attach(int inc, char *inv[], char *response, int n) {
+
+	shared_detach(shared);
+	shared = NULL;
+
+	if (inc < 2)
+	{
+		snprintf(response, n, "I am using my own knowledge again.");
+		return 0;
+	}
+
+	char *name = inc >= 3 && compare_token(inv[1], "to") == 0 ? inv[2] : inv[1];
+	int status;
+	shared = shared_attach(name, &status);
+
+	if (status == KB_OK)
+		snprintf(response, n, "I am now answering from the knowledge shared as %s (version %u).", name, shared->generation);
+	else if (status == KB_NOTFOUND)
+		snprintf(response, n, "Nothing is shared as %s.", name);
+	else if (status == KB_NOMEM)
+		snprintf(response, n, "Memory allocation failure.");
+	else
+		snprintf(response, n, "I could not attach to '%s'.", name);
+
+	return 0;
+
+}
+
+
+/*
+ * Determine whether an intent is ALIAS.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "alias"
+ *  0, otherwise
+ */
+int chatbot_is_alias(const char *intent) {
+
+	return compare_token(intent, "alias") == 0;
+
+}
+
+
+/*
+ * Join words into one entity, separated by spaces and truncated to fit.
+ */
+static void join_words(int inc, char *inv[], char *entity) {
+
+	int used = 0;
+
+	entity[0] = '\0';
+	for (int i = 0; i < inc && used < MAX_ENTITY; i++)
+		used += snprintf(entity + used, MAX_ENTITY - used, i == 0 ? "%s" : " %s", inv[i]);
+
+}
+
+
+/*
+ * Make one name of an entity stand for another, so that both get the same
+ * answer ("alias what [is] SIT means Singapore Institute of Technology"; see
+ * knowledge_alias()).
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after adding an alias)
+ */
+int chatbot_do_alias(int inc, char *inv[], char *response, int n) {
+
+	int first = inc >= 3 && (compare_token(inv[2], "is") == 0 || compare_token(inv[2], "are") == 0) ? 3 : 2;
+	int means = first + 1;
+	while (means < inc && compare_token(inv[means], "means") != 0)
+		means++;
+
+	if (inc < 2 || !chatbot_is_question(inv[1]) || means >= inc - 1)
+	{
+		snprintf(response, n, "Usage: alias what|where|who <alias> means <entity>.");
+		return 0;
+	}
+
+	char alias[MAX_ENTITY];
+	char entity[MAX_ENTITY];
+	join_words(means - first, inv + first, alias);
+	join_words(inc - means - 1, inv + means + 1, entity);
+
+	int status = knowledge_alias(chatbot_kb(), inv[1], alias, entity);
+	if (status == KB_OK)
+		snprintf(response, n, "%s %s now means %s.", inv[1], alias, entity);
+	else if (status == KB_NOMEM)
+		snprintf(response, n, "Memory allocation failure.");
+	else
+		snprintf(response, n, "%s cannot mean itself.", alias);
+
+	return 0;
+
+}
+
+
+/*
+ * Determine whether an intent is SEARCH.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "search"
+ *  0, otherwise
+ */
+int chatbot_is_search(const char *intent) {
+
+	return compare_token(intent, "search") == 0;
+
+}
+
+
+/*
+ * List the answers whose responses mention some words ("search ICT1002 or
+ * Python"; see knowledge_search()). Up to FULLTEXT_SHOWN of them are listed.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after a search)
+ */
+int chatbot_do_search(int inc, char *inv[], char *response, int n) {
+
+	static const char *intents[NUM_INTENTS] = { "what", "where", "who" };
+	FULLTEXT_HIT hits[FULLTEXT_SHOWN];
+
+	if (inc < 2)
+	{
+		snprintf(response, n, "Usage: search <words> [or <words>].");
+		return 0;
+	}
+
+	int found = knowledge_search(chatbot_kb(), inc - 1, inv + 1, hits, FULLTEXT_SHOWN);
+	if (found == KB_INVALID)
+		snprintf(response, n, "I am not indexing my answers (set search on).");
+	else if (found == KB_NOMEM)
+		snprintf(response, n, "Memory allocation failure.");
+	else if (found == 0)
+		snprintf(response, n, "None of my answers mention that.");
+	else
+	{
+		int used = snprintf(response, n, "%d answer%s mention%s that:", found, found == 1 ? "" : "s", found == 1 ? "s" : "");
+		for (int k = 0; k < found && k < FULLTEXT_SHOWN && used < n; k++)
+			used += snprintf(response + used, n - used, "%s %s %s", k == 0 ? "" : ";", intents[hits[k].intent], hits[k].entity);
+		if (used < n)
+			snprintf(response + used, n - used, found > FULLTEXT_SHOWN ? "; ..." : ".");
 	}
+
+	return 0;
+
+}
+
+
+/*
+ * Determine whether an intent is TRACE.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "trace"
+ *  0, otherwise
+ */
+int chatbot_is_trace(const char *intent) {
+
+	return compare_token(intent, "trace") == 0;
+
+}
+
+
+/*
+ * Write the spans traced so far to a file ("trace [<file>]"; see trace_dump()),
+ * TRACE_FILE by default. Tracing is only compiled in with -DKB_TRACING.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after writing a trace)
+ */
+int chatbot_do_trace(int inc, char *inv[], char *response, int n) {
+
+#ifdef KB_TRACING
+	const char *filename = inc >= 2 ? inv[1] : TRACE_FILE;
+
+	int status = trace_dump(filename);
+	if (status == KB_NOMEM)
+		snprintf(response, n, "Memory allocation failure.");
+	else if (status != KB_OK)
+		snprintf(response, n, "I could not open %s for writing.", filename);
+	else
+		snprintf(response, n, "Wrote the trace to %s.", filename);
+#else
+	snprintf(response, n, "I was not compiled with tracing (-DKB_TRACING).");
+#endif
+
 	return 0;
 
 }
+
+
+/*
+ * Determine which an intent is smalltalk.
+ *
+ * The smalltalk phrases are loaded from SMALLTALK_FILE (see smalltalk.c).
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is the first word of one of the smalltalk phrases
+ *  0, otherwise
+ */
+int chatbot_is_smalltalk(const char *intent) {
+
+	return smalltalk_is_keyword(intent);
+
+}
+
+
+/*
+ * Respond to smalltalk.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0, if the chatbot should continue chatting
+ *   1, if the chatbot should stop chatting (e.g. the smalltalk was "goodbye" etc.)
+ */
+int chatbot_do_smalltalk(int inc, char *inv[], char *response, int n) {
+
+	return smalltalk_respond(inc, inv, response, n);
+
+}
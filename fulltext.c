@@ -0,0 +1,556 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the full-text index, which finds the answers whose
+ * responses mention some words (see knowledge_search()) without reading every
+ * response. Each answer is given a document number when it is indexed, and
+ * each word of its response lists the numbers of the answers that mention it.
+ *
+ * The numbers only ever grow, so each posting list is kept as the gaps
+ * between them, as varints: a word mentioned by every answer costs about a
+ * byte per answer. A query decodes only the lists of its own words, and
+ * intersects or unites them in one pass, so it takes time proportional to
+ * the lists rather than to the knowledge base.
+ *
+ * An answer that is forgotten, or given a new response, keeps its old number
+ * in the lists until the index is compacted, but is marked stale, so that it
+ * is not found. The index is compacted once most of its answers are stale.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include "chat1002.h"
+
+/* the initial number of buckets of the tables of words and answers */
+#define FULLTEXT_BUCKETS    1024
+
+/*
+ * Build the key of an answer in the table of document numbers.
+ */
+static void doc_key(int intent, const char *entity, char *key)
+{
+    snprintf(key, CACHE_KEY, "%d %s", intent, entity);
+}
+
+/*
+ * Find the next word of a text: a run of letters and digits, truncated to
+ * FULLTEXT_WORD - 1 characters.
+ *
+ * Input:
+ *   text       - the text
+ *   word       - a buffer of FULLTEXT_WORD characters to receive the word
+ *
+ * Returns:
+ *   the rest of the text after the word
+ *   NULL, if there are no more words
+ */
+static const char *next_word(const char *text, char *word)
+{
+    int length = 0;
+
+    while (*text != '\0' && !isalnum((unsigned char) *text))
+    {
+        text++;
+    }
+    if (*text == '\0')
+    {
+        return NULL;
+    }
+
+    while (isalnum((unsigned char) *text))
+    {
+        if (length < FULLTEXT_WORD - 1)
+        {
+            word[length++] = *text;
+        }
+        text++;
+    }
+    word[length] = '\0';
+    return text;
+}
+
+/*
+ * Write a gap between document numbers as a varint: 7 bits per byte, least
+ * significant first, with the top bit set on every byte but the last.
+ */
+static void put_varint(unsigned char *data, int *size, unsigned gap)
+{
+    while (gap >= 0x80)
+    {
+        data[(*size)++] = (unsigned char) (gap | 0x80);
+        gap >>= 7;
+    }
+    data[(*size)++] = (unsigned char) gap;
+}
+
+/*
+ * Read a gap written by put_varint().
+ */
+static unsigned get_varint(const unsigned char *data, int *pos)
+{
+    unsigned gap = 0;
+    int shift = 0;
+
+    while (data[*pos] & 0x80)
+    {
+        gap |= (unsigned) (data[(*pos)++] & 0x7F) << shift;
+        shift += 7;
+    }
+    return gap | (unsigned) data[(*pos)++] << shift;
+}
+
+/*
+ * Append a document number, greater than any in the list, to a posting list.
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int append_posting(FULLTEXT_INDEX *index, POSTING_LIST *list, int doc)
+{
+    // A varint of a 32-bit gap is at most 5 bytes
+    if (list->size + 5 > list->capacity)
+    {
+        int capacity = list->capacity == 0 ? 8 : list->capacity * 2;
+        unsigned char *data = realloc(list->data, capacity);
+
+        if (data == NULL)
+        {
+            return KB_NOMEM;
+        }
+        index->bytes += capacity - list->capacity;
+        list->data = data;
+        list->capacity = capacity;
+    }
+
+    put_varint(list->data, &list->size, (unsigned) (doc - list->last));
+    list->last = doc;
+    return KB_OK;
+}
+
+/*
+ * Decode the document numbers of a posting list.
+ *
+ * Input:
+ *   list       - the posting list (may be NULL, for none)
+ *   n          - receives the number of document numbers
+ *
+ * Returns:
+ *   the document numbers, in increasing order, to be freed by the caller
+ *   NULL, if there was a memory allocation failure
+ */
+static int *decode_postings(const POSTING_LIST *list, int *n)
+{
+    // Each number takes at least a byte
+    int *docs = malloc(((list == NULL ? 0 : list->size) + 1) * sizeof(int));
+
+    *n = 0;
+    if (docs == NULL || list == NULL)
+    {
+        return docs;
+    }
+
+    int doc = -1;
+    for (int pos = 0; pos < list->size; )
+    {
+        doc += (int) get_varint(list->data, &pos);
+        docs[(*n)++] = doc;
+    }
+    return docs;
+}
+
+/*
+ * Creates an empty full-text index.
+ *
+ * Returns:
+ *   the pointer to the new index, if successful
+ *   NULL, if there was a memory allocation failure
+ */
+FULLTEXT_INDEX *fulltext_create()
+{
+    FULLTEXT_INDEX *index = calloc(1, sizeof(FULLTEXT_INDEX));
+
+    if (index == NULL)
+    {
+        return NULL;
+    }
+
+    index->words = hash_create(FULLTEXT_BUCKETS);
+    index->ids = hash_create(FULLTEXT_BUCKETS);
+    if (index->words == NULL || index->ids == NULL)
+    {
+        fulltext_free(index);
+        return NULL;
+    }
+
+    index->bytes = sizeof(FULLTEXT_INDEX) + 2 * FULLTEXT_BUCKETS * sizeof(HASH_ENTRY *);
+    return index;
+}
+
+/*
+ * Free a posting list (see hash_destroy()).
+ */
+static void free_postings(void *list)
+{
+    if (list != NULL)
+    {
+        free(((POSTING_LIST *) list)->data);
+        free(list);
+    }
+}
+
+/*
+ * Free a full-text index.
+ *
+ * Input:
+ *   index      - the index (may be NULL)
+ */
+void fulltext_free(FULLTEXT_INDEX *index)
+{
+    if (index == NULL)
+    {
+        return;
+    }
+
+    hash_destroy(index->words, free_postings);
+    hash_destroy(index->ids, NULL);
+    for (int i = 0; i < index->n_docs; i++)
+    {
+        free(index->docs[i].entity);
+    }
+    free(index->docs);
+    free(index);
+}
+
+/*
+ * Renumber the answers that are not stale, and drop the stale ones from
+ * every posting list. A gap never grows by renumbering, so each list is
+ * rewritten in place. Failing to compact the index is not an error.
+ */
+static void compact(FULLTEXT_INDEX *index)
+{
+    int *renumber = malloc((index->n_docs + 1) * sizeof(int));
+
+    if (renumber == NULL)
+    {
+        return;
+    }
+
+    int n = 0;
+    for (int i = 0; i < index->n_docs; i++)
+    {
+        renumber[i] = index->docs[i].entity == NULL ? -1 : n++;
+    }
+
+    // Rewrite each posting list (a word that is no longer mentioned keeps an
+    // empty one, in case it is mentioned again)
+    for (int b = 0; b < index->words->n_buckets; b++)
+    {
+        for (HASH_ENTRY *entry = index->words->buckets[b]; entry != NULL; entry = entry->next_ptr)
+        {
+            POSTING_LIST *list = entry->value;
+            int size = list->size;
+            int doc = -1;
+
+            list->size = 0;
+            list->last = -1;
+            for (int pos = 0; pos < size; )
+            {
+                doc += (int) get_varint(list->data, &pos);
+                if (renumber[doc] >= 0)
+                {
+                    put_varint(list->data, &list->size, (unsigned) (renumber[doc] - list->last));
+                    list->last = renumber[doc];
+                }
+            }
+        }
+    }
+
+    // Renumber the answers themselves
+    char key[CACHE_KEY];
+    for (int i = 0; i < index->n_docs; i++)
+    {
+        if (renumber[i] >= 0)
+        {
+            index->docs[renumber[i]] = index->docs[i];
+            doc_key(index->docs[i].intent, index->docs[i].entity, key);
+            hash_put(index->ids, key, (void *) (intptr_t) (renumber[i] + 1));
+        }
+    }
+    index->n_docs = n;
+    index->stale = 0;
+
+    free(renumber);
+}
+
+/*
+ * Stop finding an answer, if it is in the index (e.g. once it is forgotten).
+ *
+ * Input:
+ *   index      - the index
+ *   intent     - the index of the intent
+ *   entity     - the entity
+ */
+void fulltext_remove(FULLTEXT_INDEX *index, int intent, const char *entity)
+{
+    char key[CACHE_KEY];
+
+    doc_key(intent, entity, key);
+    intptr_t id = (intptr_t) hash_remove(index->ids, key);
+    if (id == 0)
+    {
+        return;
+    }
+
+    FULLTEXT_DOC *doc = &index->docs[id - 1];
+    size_t bytes = sizeof(HASH_ENTRY) + strlen(key) + strlen(doc->entity) + 2;
+    index->bytes -= bytes < index->bytes ? bytes : index->bytes;
+    free(doc->entity);
+    doc->entity = NULL;
+
+    // Most of the answers are stale: drop them
+    if (++index->stale >= FULLTEXT_COMPACT && index->stale > index->n_docs / 2)
+    {
+        compact(index);
+    }
+}
+
+/*
+ * Index the response of an answer, in place of any response it had before.
+ *
+ * Input:
+ *   index      - the index
+ *   intent     - the index of the intent
+ *   entity     - the entity
+ *   response   - the response
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure (the answer is then
+ *     not found at all)
+ */
+int fulltext_put(FULLTEXT_INDEX *index, int intent, const char *entity, const char *response)
+{
+    char key[CACHE_KEY];
+    char word[FULLTEXT_WORD];
+
+    fulltext_remove(index, intent, entity);
+
+    if (index->n_docs == index->capacity)
+    {
+        int capacity = index->capacity == 0 ? 64 : index->capacity * 2;
+        FULLTEXT_DOC *docs = realloc(index->docs, capacity * sizeof(FULLTEXT_DOC));
+
+        if (docs == NULL)
+        {
+            return KB_NOMEM;
+        }
+        index->bytes += (capacity - index->capacity) * sizeof(FULLTEXT_DOC);
+        index->docs = docs;
+        index->capacity = capacity;
+    }
+
+    // A new document number
+    int id = index->n_docs;
+    char *copy = malloc(strlen(entity) + 1);
+    doc_key(intent, entity, key);
+    if (copy == NULL || hash_put(index->ids, key, (void *) (intptr_t) (id + 1)) != KB_OK)
+    {
+        free(copy);
+        return KB_NOMEM;
+    }
+    strcpy(copy, entity);
+    index->docs[id].entity = copy;
+    index->docs[id].intent = intent;
+    index->n_docs++;
+    index->bytes += sizeof(HASH_ENTRY) + strlen(key) + strlen(copy) + 2;
+
+    // Add it to the list of each word (once, however often it is mentioned)
+    while ((response = next_word(response, word)) != NULL)
+    {
+        POSTING_LIST *list = hash_get(index->words, word);
+        if (list == NULL)
+        {
+            list = calloc(1, sizeof(POSTING_LIST));
+            if (list == NULL || hash_put(index->words, word, list) != KB_OK)
+            {
+                free(list);
+                fulltext_remove(index, intent, entity);
+                return KB_NOMEM;
+            }
+            list->last = -1;
+            index->bytes += sizeof(POSTING_LIST) + sizeof(HASH_ENTRY) + strlen(word) + 1;
+        }
+
+        if (list->last != id && append_posting(index, list, id) != KB_OK)
+        {
+            fulltext_remove(index, intent, entity);
+            return KB_NOMEM;
+        }
+    }
+
+    return KB_OK;
+}
+
+/*
+ * Keep the numbers in <a> that are also in <b> (both in increasing order).
+ *
+ * Returns:
+ *   the number of numbers kept, at the start of <a>
+ */
+static int intersect(int *a, int na, const int *b, int nb)
+{
+    int n = 0;
+
+    for (int i = 0, j = 0; i < na && j < nb; )
+    {
+        if (a[i] < b[j])
+        {
+            i++;
+        }
+        else if (a[i] > b[j])
+        {
+            j++;
+        }
+        else
+        {
+            a[n++] = a[i++];
+            j++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Merge the numbers in <a> and <b> (both in increasing order) into <out>,
+ * without repeating those in both.
+ *
+ * Returns:
+ *   the number of numbers in <out>
+ */
+static int unite(const int *a, int na, const int *b, int nb, int *out)
+{
+    int n = 0;
+    int i = 0;
+    int j = 0;
+
+    while (i < na || j < nb)
+    {
+        if (j == nb || (i < na && a[i] < b[j]))
+        {
+            out[n++] = a[i++];
+        }
+        else
+        {
+            if (i < na && a[i] == b[j])
+            {
+                i++;
+            }
+            out[n++] = b[j++];
+        }
+    }
+    return n;
+}
+
+/*
+ * Find the answers whose responses mention some words. The words are
+ * matched case-insensitively, and the query is a list of alternatives
+ * separated by "or", each of which is a list of words that must all be
+ * mentioned (optionally separated by "and"); e.g. "ICT1002 or C and Python".
+ *
+ * Input:
+ *   index      - the index
+ *   inc        - the number of words in the query
+ *   inv        - the words of the query
+ *   docs       - receives the document numbers of the answers found, in
+ *                increasing order (see FULLTEXT_INDEX), to be freed by the
+ *                caller
+ *
+ * Returns:
+ *   the number of answers found
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int fulltext_search(FULLTEXT_INDEX *index, int inc, char *inv[], int **docs)
+{
+    int *found = malloc(sizeof(int));
+    int n_found = 0;
+    int *all = NULL;                // the answers of the current alternative
+    int n_all = -1;                 // (-1 until it has a word)
+    char word[FULLTEXT_WORD];
+
+    if (found == NULL)
+    {
+        return KB_NOMEM;
+    }
+
+    for (int k = 0; k <= inc; k++)
+    {
+        // The end of an alternative: add its answers to those found
+        if (k == inc || compare_token(inv[k], "or") == 0)
+        {
+            if (n_all > 0)
+            {
+                int *united = malloc((n_found + n_all) * sizeof(int));
+                if (united == NULL)
+                {
+                    free(all);
+                    free(found);
+                    return KB_NOMEM;
+                }
+                n_found = unite(found, n_found, all, n_all, united);
+                free(found);
+                found = united;
+            }
+            free(all);
+            all = NULL;
+            n_all = -1;
+            continue;
+        }
+        if (compare_token(inv[k], "and") == 0)
+        {
+            continue;
+        }
+
+        // Each word of the query must be mentioned
+        const char *rest = inv[k];
+        while ((rest = next_word(rest, word)) != NULL)
+        {
+            int n;
+            int *mentions = decode_postings(hash_get(index->words, word), &n);
+            if (mentions == NULL)
+            {
+                free(all);
+                free(found);
+                return KB_NOMEM;
+            }
+
+            if (n_all < 0)
+            {
+                all = mentions;
+                n_all = n;
+            }
+            else
+            {
+                n_all = intersect(all, n_all, mentions, n);
+                free(mentions);
+            }
+        }
+    }
+
+    // Stale answers are not found
+    int n = 0;
+    for (int i = 0; i < n_found; i++)
+    {
+        if (index->docs[found[i]].entity != NULL)
+        {
+            found[n++] = found[i];
+        }
+    }
+
+    *docs = found;
+    return n;
+}
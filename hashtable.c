@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "chat1002.h"
+
+/*
+ * Hash a string case-insensitively (FNV-1a over the upper-cased characters),
+ * so that keys which compare equal under compare_token() hash equally.
+ *
+ * Input:
+ *   key        - the string to hash
+ *
+ * Returns:
+ *   the hash value of the string
+ */
+unsigned long hash_string(const char *key)
+{
+    unsigned long hash = 2166136261UL;
+
+    while (*key != '\0')
+    {
+        hash ^= (unsigned long) toupper((unsigned char) *key);
+        hash *= 16777619UL;
+        key++;
+    }
+    return hash;
+}
+
+/*
+ * Creates an empty hash table.
+ *
+ * Input:
+ *   n_buckets  - the initial number of buckets (grows as entries are added)
+ *
+ * Returns:
+ *   the pointer to the new table, if successful
+ *   NULL, if there was a memory allocation failure
+ */
+HASH_TABLE *hash_create(int n_buckets)
+{
+    HASH_TABLE *table = malloc(sizeof(HASH_TABLE));
+
+    if (table == NULL)
+    {
+        return NULL;
+    }
+
+    if (n_buckets < 1)
+    {
+        n_buckets = 1;
+    }
+
+    table->buckets = calloc(n_buckets, sizeof(HASH_ENTRY *));
+    if (table->buckets == NULL)
+    {
+        free(table);
+        return NULL;
+    }
+
+    table->n_buckets = n_buckets;
+    table->count = 0;
+
+    return table;
+}
+
+/*
+ * Find the entry for <key>.
+ *
+ * Input:
+ *   table      - the hash table
+ *   key        - the key to search for (case-insensitive)
+ *
+ * Returns:
+ *   the pointer to the entry, if found
+ *   NULL, if not found
+ */
+static HASH_ENTRY *hash_find(HASH_TABLE *table, const char *key)
+{
+    HASH_ENTRY *curr_entry = table->buckets[hash_string(key) % table->n_buckets];
+
+    while (curr_entry != NULL && compare_token(key, curr_entry->key) != 0)
+    {
+        curr_entry = curr_entry->next_ptr;
+    }
+    return curr_entry;
+}
+
+/*
+ * Double the number of buckets once the load factor exceeds 1, so that
+ * chains stay short as the table grows. Failing to grow is not an error;
+ * the table simply keeps its current size.
+ *
+ * Input:
+ *   table      - the hash table
+ */
+static void hash_grow(HASH_TABLE *table)
+{
+    int n_buckets = table->n_buckets * 2;
+    HASH_ENTRY **buckets = calloc(n_buckets, sizeof(HASH_ENTRY *));
+
+    if (buckets == NULL)
+    {
+        return;
+    }
+
+    // Re-link every entry into its new bucket
+    for (int i = 0; i < table->n_buckets; i++)
+    {
+        HASH_ENTRY *curr_entry = table->buckets[i];
+        while (curr_entry != NULL)
+        {
+            HASH_ENTRY *next_entry = curr_entry->next_ptr;
+            unsigned long bucket = hash_string(curr_entry->key) % n_buckets;
+
+            curr_entry->next_ptr = buckets[bucket];
+            buckets[bucket] = curr_entry;
+            curr_entry = next_entry;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->n_buckets = n_buckets;
+}
+
+/*
+ * Get the value stored for <key>.
+ *
+ * Input:
+ *   table      - the hash table
+ *   key        - the key to search for (case-insensitive)
+ *
+ * Returns:
+ *   the value, if found
+ *   NULL, if not found
+ */
+void *hash_get(HASH_TABLE *table, const char *key)
+{
+    HASH_ENTRY *entry = hash_find(table, key);
+
+    return entry == NULL ? NULL : entry->value;
+}
+
+/*
+ * Store <value> for <key>. If the key already exists, its value is replaced
+ * (the caller is responsible for the old value).
+ *
+ * Input:
+ *   table      - the hash table
+ *   key        - the key (copied into the table)
+ *   value      - the value
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int hash_put(HASH_TABLE *table, const char *key, void *value)
+{
+    HASH_ENTRY *entry = hash_find(table, key);
+
+    // Existing key (update the value)
+    if (entry != NULL)
+    {
+        entry->value = value;
+        return KB_OK;
+    }
+
+    entry = malloc(sizeof(HASH_ENTRY));
+    if (entry == NULL)
+    {
+        return KB_NOMEM;
+    }
+
+    entry->key = malloc(strlen(key) + 1);
+    if (entry->key == NULL)
+    {
+        free(entry);
+        return KB_NOMEM;
+    }
+    strcpy(entry->key, key);
+    entry->value = value;
+
+    if (table->count >= table->n_buckets)
+    {
+        hash_grow(table);
+    }
+
+    // Insert at the head of the chain
+    unsigned long bucket = hash_string(key) % table->n_buckets;
+    entry->next_ptr = table->buckets[bucket];
+    table->buckets[bucket] = entry;
+    table->count++;
+
+    return KB_OK;
+}
+
+/*
+ * Remove the entry for <key>.
+ *
+ * Input:
+ *   table      - the hash table
+ *   key        - the key to remove (case-insensitive)
+ *
+ * Returns:
+ *   the value that was stored, if found
+ *   NULL, if not found
+ */
+void *hash_remove(HASH_TABLE *table, const char *key)
+{
+    HASH_ENTRY **link = &table->buckets[hash_string(key) % table->n_buckets];
+
+    while (*link != NULL)
+    {
+        HASH_ENTRY *entry = *link;
+        if (compare_token(key, entry->key) == 0)
+        {
+            void *value = entry->value;
+
+            *link = entry->next_ptr;
+            free(entry->key);
+            free(entry);
+            table->count--;
+
+            return value;
+        }
+        link = &entry->next_ptr;
+    }
+    return NULL;
+}
+
+/*
+ * Free the hash table and all of its entries.
+ *
+ * Input:
+ *   table      - the hash table (may be NULL)
+ *   free_value - called on each value, or NULL to leave the values alone
+ */
+void hash_destroy(HASH_TABLE *table, void (*free_value)(void *))
+{
+    if (table == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < table->n_buckets; i++)
+    {
+        HASH_ENTRY *curr_entry = table->buckets[i];
+        while (curr_entry != NULL)
+        {
+            HASH_ENTRY *next_entry = curr_entry->next_ptr;
+            if (free_value != NULL)
+            {
+                free_value(curr_entry->value);
+            }
+            free(curr_entry->key);
+            free(curr_entry);
+            curr_entry = next_entry;
+        }
+    }
+
+    free(table->buckets);
+    free(table);
+}
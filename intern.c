@@ -0,0 +1,738 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the response store, which keeps one copy of each
+ * distinct response for every knowledge base in the process: large generated
+ * knowledge bases give the same long answer to many entities, so each BST
+ * node points to a shared, reference-counted copy (see create_new_node())
+ * rather than holding its own. intern_put() finds or adds a response by the
+ * hash of its text, and intern_release() frees it with its last node.
+ *
+ * The store is split into INTERN_SHARDS independent hash tables, each with its
+ * own lock, so that the threads building a knowledge base (see loader.c), and
+ * those freeing one in the background, rarely wait for each other.
+ *
+ * Responses can also be stored compressed (see intern_set_compression()),
+ * with a small LZ77 codec whose matches may refer back into a dictionary of
+ * text common to many responses. The dictionary is trained once, from the
+ * first knowledge loaded with compression on (see intern_train()), and never
+ * changes afterwards, so a compressed response can be decoded on any thread
+ * at any time. A stored response is only decoded when it is read through
+ * intern_read(), i.e. when a question is actually answered with it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "chat1002.h"
+
+/* the codec: matches are 4 to 131 bytes, found by hashing 4 bytes */
+#define MIN_MATCH       4
+#define MAX_MATCH       (MIN_MATCH + 127)
+#define DICT_HASH_BITS  14              // for the dictionary
+#define TEXT_HASH_BITS  8               // for the response being compressed
+#define MATCH_TRIES     16              // candidates tried for each match
+
+/* training: segments of 64 bytes are scored by their common 8-byte grams */
+#define SEGMENT_SIZE    64
+#define GRAM_SIZE       8
+#define GRAM_HASH_BITS  16
+
+/* a response in the store */
+typedef struct interned
+{
+    struct interned *next;              // the next response in the same bucket
+    uint32_t hash;                      // the hash of the (uncompressed) text
+    uint32_t length;                    // the length of the text
+    uint32_t size;                      // the number of bytes in data (no more than length if compressed)
+    int refs;                           // the nodes using it (guarded by the shard's lock)
+    char data[];                        // the text (NUL-terminated) or its compressed form (see compress())
+} INTERNED;
+
+/* the size of an entry holding <size> bytes of data */
+#define ENTRY_SIZE(size)    (offsetof(INTERNED, data) + (size))
+
+/* whether an entry's data is compressed (it would otherwise need a NUL) */
+#define IS_COMPRESSED(entry)    ((entry)->size <= (entry)->length)
+
+/* one of the independent hash tables of the store */
+typedef struct intern_shard
+{
+    pthread_mutex_t lock;
+    INTERNED **buckets;
+    size_t n_buckets;                   // a power of two
+    size_t count;                       // the number of responses
+} INTERN_SHARD;
+
+/* the dictionary of text common to many responses, and an index of it */
+typedef struct dictionary
+{
+    char text[INTERN_DICTIONARY];
+    int size;                           // the number of bytes of text
+    int head[1 << DICT_HASH_BITS];      // the last position of each hash of 4 bytes (-1 if none)
+    int prev[INTERN_DICTIONARY];        // the previous position with the same hash (-1 if none)
+} DICTIONARY;
+
+static INTERN_SHARD shards[INTERN_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static DICTIONARY *_Atomic dictionary;          // NULL until trained
+static pthread_mutex_t train_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool compressing;
+
+static atomic_size_t stored_bytes;
+static atomic_int stored_count;
+static atomic_int compressed_count;
+
+/*
+ * Initialise the shards (once, on first use).
+ */
+static void init_shards(void)
+{
+    for (int i = 0; i < INTERN_SHARDS; i++)
+    {
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+}
+
+/*
+ * Hash the text of a response (32-bit FNV-1a; unlike the other tables,
+ * responses are case-sensitive).
+ */
+static uint32_t intern_hash(const char *text, size_t length)
+{
+    uint32_t hash = 2166136261U;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char) text[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*
+ * Hash the 4 bytes at <p> to <bits> bits, for finding matches.
+ */
+static unsigned match_hash(const char *p, int bits)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - bits);
+}
+
+/*
+ * Get the entry that holds a stored response.
+ */
+static INTERNED *entry_of(const char *stored)
+{
+    return (INTERNED *) (stored - offsetof(INTERNED, data));
+}
+
+/*
+ * Find the length of the match between <a> and <b>, up to <max> bytes.
+ */
+static int match_length(const char *a, const char *b, int max)
+{
+    int n = 0;
+
+    while (n < max && a[n] == b[n])
+    {
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Add literal bytes to compressed output, in runs of up to 128.
+ *
+ * Returns:
+ *   true, if they fit in <limit> bytes of output
+ *   false, otherwise
+ */
+static bool put_literals(char *out, size_t *used, size_t limit, const char *text, int n)
+{
+    while (n > 0)
+    {
+        int run = n < 128 ? n : 128;
+        if (*used + 1 + run >= limit)
+        {
+            return false;
+        }
+        out[(*used)++] = (char) (run - 1);
+        memcpy(out + *used, text, run);
+        *used += run;
+        text += run;
+        n -= run;
+    }
+    return true;
+}
+
+/*
+ * Compress a response against the dictionary. The output is a sequence of
+ * literal runs (a byte 0-127 giving the length less one, then the bytes) and
+ * matches (a byte 128-255 giving the length less MIN_MATCH, then the
+ * distance back to the match as two bytes, little-endian). The distance is
+ * counted in the dictionary followed by the response, so a match may come
+ * from either.
+ *
+ * Input:
+ *   dict       - the dictionary
+ *   text       - the response (shorter than MAX_RESPONSE)
+ *   length     - the length of the response
+ *   out        - a buffer of at least <length> bytes for the compressed form
+ *
+ * Returns:
+ *   the size of the compressed form, if it is smaller than the response
+ *   0, otherwise
+ */
+static size_t compress(const DICTIONARY *dict, const char *text, int length, char *out)
+{
+    short head[1 << TEXT_HASH_BITS];
+    short prev[MAX_RESPONSE];
+    size_t used = 0;
+    int start = 0;
+    int i = 0;
+
+    memset(head, -1, sizeof(head));
+
+    while (i < length)
+    {
+        int best_length = 0;
+        int best_distance = 0;
+
+        if (i + MIN_MATCH <= length)
+        {
+            int max = length - i < MAX_MATCH ? length - i : MAX_MATCH;
+
+            // Earlier in the response
+            unsigned h = match_hash(text + i, TEXT_HASH_BITS);
+            for (int pos = head[h], tries = 0; pos >= 0 && tries < MATCH_TRIES; pos = prev[pos], tries++)
+            {
+                int n = match_length(text + pos, text + i, max);
+                if (n > best_length)
+                {
+                    best_length = n;
+                    best_distance = i - pos;
+                }
+            }
+
+            // In the dictionary
+            h = match_hash(text + i, DICT_HASH_BITS);
+            for (int pos = dict->head[h], tries = 0; pos >= 0 && tries < MATCH_TRIES; pos = dict->prev[pos], tries++)
+            {
+                int room = dict->size - pos;
+                int n = match_length(dict->text + pos, text + i, max < room ? max : room);
+                if (n > best_length)
+                {
+                    best_length = n;
+                    best_distance = dict->size - pos + i;
+                }
+            }
+        }
+
+        if (best_length < MIN_MATCH)
+        {
+            best_length = 1;
+        }
+        else
+        {
+            // The literals before the match, then the match
+            if (!put_literals(out, &used, length, text + start, i - start) || used + 3 >= (size_t) length)
+            {
+                return 0;
+            }
+            out[used++] = (char) (0x80 | (best_length - MIN_MATCH));
+            out[used++] = (char) (best_distance & 0xFF);
+            out[used++] = (char) (best_distance >> 8);
+            start = i + best_length;
+        }
+
+        // Index the positions covered, for later matches
+        for (int end = i + best_length; i < end; i++)
+        {
+            if (i + MIN_MATCH <= length)
+            {
+                unsigned h = match_hash(text + i, TEXT_HASH_BITS);
+                prev[i] = head[h];
+                head[h] = (short) i;
+            }
+        }
+    }
+
+    if (!put_literals(out, &used, length, text + start, length - start))
+    {
+        return 0;
+    }
+    return used;
+}
+
+/*
+ * Decompress a response (see compress()).
+ */
+static void decompress(const DICTIONARY *dict, const unsigned char *in, size_t size, char *text)
+{
+    size_t i = 0;
+    int used = 0;
+
+    while (i < size)
+    {
+        int token = in[i++];
+
+        if (token < 0x80)
+        {
+            memcpy(text + used, in + i, token + 1);
+            used += token + 1;
+            i += token + 1;
+        }
+        else
+        {
+            int n = (token & 0x7F) + MIN_MATCH;
+            int from = dict->size + used - (in[i] | in[i + 1] << 8);
+            i += 2;
+
+            // One byte at a time, as a match may overlap what it produces
+            for (int k = 0; k < n; k++, from++)
+            {
+                text[used++] = from < dict->size ? dict->text[from] : text[from - dict->size];
+            }
+        }
+    }
+
+    text[used] = '\0';
+}
+
+/*
+ * Get the text of a stored response.
+ *
+ * Input:
+ *   stored     - the stored response (see intern_put())
+ *   buffer     - a buffer of MAX_RESPONSE characters, used if the response
+ *                has to be decompressed
+ *
+ * Returns:
+ *   the text of the response (in the buffer, or in the store)
+ */
+const char *intern_read(const char *stored, char *buffer)
+{
+    INTERNED *entry = entry_of(stored);
+
+    if (!IS_COMPRESSED(entry))
+    {
+        return stored;
+    }
+
+    decompress(atomic_load(&dictionary), (const unsigned char *) entry->data, entry->size, buffer);
+    return buffer;
+}
+
+/*
+ * Get the length of the text of a stored response, without decompressing it.
+ */
+size_t intern_length(const char *stored)
+{
+    return entry_of(stored)->length;
+}
+
+/*
+ * Get the share of a stored response's memory that one of its references
+ * accounts for: the bytes of its entry divided by the references to it, so
+ * that a response shared by many knowledge bases is charged to each in part.
+ *
+ * Input:
+ *   stored     - the stored response
+ *
+ * Returns:
+ *   the number of bytes
+ */
+size_t intern_share(const char *stored)
+{
+    INTERNED *entry = entry_of(stored);
+    INTERN_SHARD *shard = &shards[entry->hash % INTERN_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    size_t share = ENTRY_SIZE(entry->size) / entry->refs;
+    pthread_mutex_unlock(&shard->lock);
+
+    return share;
+}
+
+/*
+ * Double the buckets of a shard (if there is the memory), rehashing its
+ * responses. Called with the shard locked.
+ */
+static void grow_shard(INTERN_SHARD *shard)
+{
+    size_t n_buckets = shard->n_buckets == 0 ? 64 : shard->n_buckets * 2;
+    INTERNED **buckets = calloc(n_buckets, sizeof(INTERNED *));
+
+    if (buckets == NULL)
+    {
+        return;
+    }
+
+    for (size_t b = 0; b < shard->n_buckets; b++)
+    {
+        INTERNED *entry = shard->buckets[b];
+        while (entry != NULL)
+        {
+            INTERNED *next = entry->next;
+            size_t to = (entry->hash / INTERN_SHARDS) & (n_buckets - 1);
+            entry->next = buckets[to];
+            buckets[to] = entry;
+            entry = next;
+        }
+    }
+
+    free(shard->buckets);
+    atomic_fetch_add(&stored_bytes, (n_buckets - shard->n_buckets) * sizeof(INTERNED *));
+    shard->buckets = buckets;
+    shard->n_buckets = n_buckets;
+}
+
+/*
+ * Store a response, or find the copy already stored, and take a reference to
+ * it. Give the reference back with intern_release().
+ *
+ * Input:
+ *   text       - the response
+ *
+ * Returns:
+ *   the stored response (read it with intern_read()), if successful
+ *   NULL, if there was a memory allocation failure
+ */
+const char *intern_put(const char *text)
+{
+    size_t length = strlen(text);
+    uint32_t hash = intern_hash(text, length);
+    INTERN_SHARD *shard = &shards[hash % INTERN_SHARDS];
+    char plain[MAX_RESPONSE];
+
+    pthread_once(&shards_once, init_shards);
+    pthread_mutex_lock(&shard->lock);
+
+    // Already stored
+    if (shard->n_buckets > 0)
+    {
+        for (INTERNED *entry = shard->buckets[(hash / INTERN_SHARDS) & (shard->n_buckets - 1)];
+            entry != NULL; entry = entry->next)
+        {
+            if (entry->hash == hash && entry->length == length &&
+                strcmp(intern_read(entry->data, plain), text) == 0)
+            {
+                entry->refs++;
+                pthread_mutex_unlock(&shard->lock);
+                return entry->data;
+            }
+        }
+    }
+
+    if (shard->count >= shard->n_buckets)
+    {
+        grow_shard(shard);
+    }
+    if (shard->n_buckets == 0)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+
+    // Compressed, if it is short enough and compresses at all
+    DICTIONARY *dict = atomic_load(&compressing) ? atomic_load(&dictionary) : NULL;
+    char packed[MAX_RESPONSE];
+    size_t size = dict != NULL && length < MAX_RESPONSE ? compress(dict, text, (int) length, packed) : 0;
+
+    INTERNED *entry = malloc(ENTRY_SIZE(size > 0 ? size : length + 1));
+    if (entry == NULL)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->length = (uint32_t) length;
+    entry->refs = 1;
+    entry->size = (uint32_t) (size > 0 ? size : length + 1);
+    memcpy(entry->data, size > 0 ? packed : text, entry->size);
+
+    size_t b = (hash / INTERN_SHARDS) & (shard->n_buckets - 1);
+    entry->next = shard->buckets[b];
+    shard->buckets[b] = entry;
+    shard->count++;
+    pthread_mutex_unlock(&shard->lock);
+
+    atomic_fetch_add(&stored_bytes, ENTRY_SIZE(entry->size));
+    atomic_fetch_add(&stored_count, 1);
+    if (IS_COMPRESSED(entry))
+    {
+        atomic_fetch_add(&compressed_count, 1);
+    }
+    return entry->data;
+}
+
+/*
+ * Take another reference to a stored response, e.g. for a copy of a node.
+ *
+ * Input:
+ *   stored     - the stored response
+ *
+ * Returns:
+ *   the stored response
+ */
+const char *intern_retain(const char *stored)
+{
+    INTERNED *entry = entry_of(stored);
+    INTERN_SHARD *shard = &shards[entry->hash % INTERN_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    entry->refs++;
+    pthread_mutex_unlock(&shard->lock);
+
+    return stored;
+}
+
+/*
+ * Give back a reference to a stored response, freeing it if it was the last.
+ *
+ * Input:
+ *   stored     - the stored response (may be NULL)
+ */
+void intern_release(const char *stored)
+{
+    if (stored == NULL)
+    {
+        return;
+    }
+
+    INTERNED *entry = entry_of(stored);
+    INTERN_SHARD *shard = &shards[entry->hash % INTERN_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    if (--entry->refs > 0)
+    {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    INTERNED **link = &shard->buckets[(entry->hash / INTERN_SHARDS) & (shard->n_buckets - 1)];
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    shard->count--;
+    pthread_mutex_unlock(&shard->lock);
+
+    atomic_fetch_sub(&stored_bytes, ENTRY_SIZE(entry->size));
+    atomic_fetch_sub(&stored_count, 1);
+    if (IS_COMPRESSED(entry))
+    {
+        atomic_fetch_sub(&compressed_count, 1);
+    }
+    free(entry);
+}
+
+/*
+ * Hash the GRAM_SIZE bytes at <p>, for counting how common they are.
+ */
+static unsigned gram_hash(const char *p)
+{
+    return intern_hash(p, GRAM_SIZE) >> (32 - GRAM_HASH_BITS);
+}
+
+/*
+ * Score a segment of a sample by how common its grams are.
+ */
+static long segment_score(const unsigned *counts, const char *p, int length)
+{
+    long score = 0;
+
+    for (int k = 0; k + GRAM_SIZE <= length; k++)
+    {
+        score += counts[gram_hash(p + k)];
+    }
+    return score;
+}
+
+/* a segment of a sample that might go into the dictionary */
+typedef struct segment
+{
+    const char *text;
+    int length;
+    long score;
+} SEGMENT;
+
+/*
+ * Order segments by descending score.
+ */
+static int compare_segments(const void *a, const void *b)
+{
+    long sa = ((const SEGMENT *) a)->score;
+    long sb = ((const SEGMENT *) b)->score;
+
+    return (sa < sb) - (sa > sb);
+}
+
+/*
+ * Train the dictionary from sample responses, if it has not been trained:
+ * the grams of GRAM_SIZE bytes that the samples have in common are
+ * counted, and the segments of the samples richest in common grams are put
+ * into the dictionary (the richest last, where matches are nearest). A gram
+ * only counts towards the first segment that is chosen with it, so that the
+ * dictionary does not repeat itself.
+ *
+ * Input:
+ *   samples    - the sample responses
+ *   n          - the number of samples
+ *
+ * Returns:
+ *   KB_OK, if the dictionary has been trained (now or before)
+ *   KB_NOTFOUND, if the samples have too little text to train it
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int intern_train(const char *const *samples, int n)
+{
+    pthread_mutex_lock(&train_lock);
+    if (atomic_load(&dictionary) != NULL)
+    {
+        pthread_mutex_unlock(&train_lock);
+        return KB_OK;
+    }
+
+    // Segments of SEGMENT_SIZE bytes, overlapping by half
+    size_t n_segments = 0;
+    for (int s = 0; s < n; s++)
+    {
+        int length = (int) strlen(samples[s]);
+        for (int start = 0; start == 0 || start + SEGMENT_SIZE / 2 < length; start += SEGMENT_SIZE / 2)
+        {
+            n_segments++;
+        }
+    }
+
+    unsigned *counts = calloc((size_t) 1 << GRAM_HASH_BITS, sizeof(unsigned));
+    SEGMENT *segments = malloc(n_segments * sizeof(SEGMENT));
+    DICTIONARY *dict = malloc(sizeof(DICTIONARY));
+    if (counts == NULL || segments == NULL || dict == NULL)
+    {
+        free(counts);
+        free(segments);
+        free(dict);
+        pthread_mutex_unlock(&train_lock);
+        return KB_NOMEM;
+    }
+
+    for (int s = 0; s < n; s++)
+    {
+        int length = (int) strlen(samples[s]);
+        for (int k = 0; k + GRAM_SIZE <= length; k++)
+        {
+            counts[gram_hash(samples[s] + k)]++;
+        }
+    }
+
+    n_segments = 0;
+    for (int s = 0; s < n; s++)
+    {
+        int length = (int) strlen(samples[s]);
+        for (int start = 0; start == 0 || start + SEGMENT_SIZE / 2 < length; start += SEGMENT_SIZE / 2)
+        {
+            SEGMENT *segment = &segments[n_segments++];
+            segment->text = samples[s] + start;
+            segment->length = length - start < SEGMENT_SIZE ? length - start : SEGMENT_SIZE;
+            segment->score = segment_score(counts, segment->text, segment->length);
+        }
+    }
+    qsort(segments, n_segments, sizeof(SEGMENT), compare_segments);
+
+    // Fill the dictionary from the end, best first
+    int room = INTERN_DICTIONARY;
+    for (size_t k = 0; k < n_segments && room > 0; k++)
+    {
+        const SEGMENT *segment = &segments[k];
+
+        // Mostly made of grams already in the dictionary
+        if (segment->score <= 1 || segment_score(counts, segment->text, segment->length) * 2 < segment->score)
+        {
+            continue;
+        }
+
+        int length = segment->length < room ? segment->length : room;
+        room -= length;
+        memcpy(dict->text + room, segment->text, length);
+        for (int g = 0; g + GRAM_SIZE <= segment->length; g++)
+        {
+            counts[gram_hash(segment->text + g)] = 0;
+        }
+    }
+
+    free(counts);
+    free(segments);
+
+    if (INTERN_DICTIONARY - room < MIN_MATCH)
+    {
+        free(dict);
+        pthread_mutex_unlock(&train_lock);
+        return KB_NOTFOUND;
+    }
+
+    // Move the text to the start, and index it
+    dict->size = INTERN_DICTIONARY - room;
+    memmove(dict->text, dict->text + room, dict->size);
+    memset(dict->head, -1, sizeof(dict->head));
+    for (int pos = 0; pos + MIN_MATCH <= dict->size; pos++)
+    {
+        unsigned h = match_hash(dict->text + pos, DICT_HASH_BITS);
+        dict->prev[pos] = dict->head[h];
+        dict->head[h] = pos;
+    }
+
+    atomic_store(&dictionary, dict);
+    pthread_mutex_unlock(&train_lock);
+    return KB_OK;
+}
+
+/*
+ * Set whether responses are compressed when they are stored. Responses that
+ * are already stored are left as they are. Until the dictionary is trained
+ * (see intern_train()), responses are stored uncompressed.
+ *
+ * Input:
+ *   on         - whether to compress responses
+ */
+void intern_set_compression(bool on)
+{
+    atomic_store(&compressing, on);
+}
+
+/*
+ * Check whether responses are compressed when they are stored, and so whether
+ * the dictionary should be trained on the next knowledge loaded.
+ */
+bool intern_compression()
+{
+    return atomic_load(&compressing);
+}
+
+/*
+ * Report how many responses are stored, and in how much memory.
+ *
+ * Input:
+ *   count      - receives the number of distinct responses stored
+ *   compressed - receives the number of them that are compressed
+ *
+ * Returns:
+ *   the bytes used by the stored responses, their index and the dictionary
+ */
+size_t intern_memory(int *count, int *compressed)
+{
+    *count = atomic_load(&stored_count);
+    *compressed = atomic_load(&compressed_count);
+
+    return atomic_load(&stored_bytes) + (atomic_load(&dictionary) != NULL ? sizeof(DICTIONARY) : 0);
+}
@@ -5,10 +5,25 @@
  *
  * knowledge_get() retrieves the response to a question.
  * knowledge_put() inserts a new response to a question.
+ * knowledge_forget() removes the response to a question.
+ * knowledge_alias() makes one name of an entity stand for another.
+ * knowledge_search() finds the answers whose responses mention some words.
+ * knowledge_set_phonetic() offers names that sound like an unknown one.
  * knowledge_read() reads the knowledge base from a file.
  * knowledge_reset() erases all of the knowledge.
  * knowledge_write() saves the knowledge base in a file.
  *
+ * Each of these operates on a KNOWLEDGE_BASE handle, which carries its own BST
+ * for each intent, so that many knowledge bases can live in one process (see
+ * tenant.c). knowledge_create() and knowledge_free() create and destroy them.
+ *
+ * A knowledge base can also overlay another (see knowledge_create_overlay()),
+ * which can overlay another in turn: e.g. a session's overlay on a tenant's
+ * layer on a base shared by every tenant. Questions are answered from the top
+ * layer down, but only the top layer learns or forgets anything, so the
+ * layers below can be shared; forgetting an entity known below leaves a
+ * tombstone to hide it. knowledge_write() flattens the whole stack.
+ *
  * You may add helper functions as necessary.
  */
 
@@ -16,343 +31,2313 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include "chat1002.h"
 
+#ifdef _WIN32
+#define sync_file(f)            _commit(_fileno(f))
+#define process_id()            _getpid()
+#define replace_file(from, to)  (MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1)
+#else
+#define sync_file(f)            fsync(fileno(f))
+#define process_id()            getpid()
+#define replace_file(from, to)  rename(from, to)
+#endif
+
 /*
- * Get the root of the relevant BST, given the intent.
+ * Get the index of an intent within a knowledge base.
  * 
  * Input:
  * 	 intent		- the question word
  * 
  * Returns:
- * 	 the root of the BST corresponding to the intent, if valid
- *   NULL, if 'intent' is not a recognised question word
+ * 	 INTENT_WHAT, INTENT_WHERE or INTENT_WHO, if valid
+ *   -1, if 'intent' is not a recognised question word
  */
-KB_NODE **get_root(const char *intent)
+int get_intent(const char *intent)
 {
-	KB_NODE **root;
-
 	if (compare_token(intent, "WHERE") == 0)
 	{	
-		root = &WHERE_root;
+		return INTENT_WHERE;
 	}
 	else if (compare_token(intent, "WHAT") == 0)
 	{
-		root = &WHAT_root;
+		return INTENT_WHAT;
 	}
 	else if (compare_token(intent, "WHO") == 0)
 	{
-		root = &WHO_root;
-	}
-	else
-	{
-		// Not a valid question word
-		root = NULL;
+		return INTENT_WHO;
 	}
-	return root;
+
+	// Not a valid question word
+	return -1;
 }
 
 /*
- * Get the head of the relevant linked list, given the intent.
+ * Get the root of the relevant BST, given the intent.
  * 
  * Input:
+ * 	 kb			- the knowledge base
  * 	 intent		- the question word
  * 
  * Returns:
  * 	 the root of the BST corresponding to the intent, if valid
  *   NULL, if 'intent' is not a recognised question word
  */
-LIST_NODE **get_head(const char *intent)
+KB_NODE **get_root(KNOWLEDGE_BASE *kb, const char *intent)
 {
-	LIST_NODE **head;
+	int i = get_intent(intent);
 
-	if (compare_token(intent, "WHERE") == 0)
-	{	
-		head = &WHERE_head;
+	return i < 0 ? NULL : &kb->root[i];
+}
+
+/*
+ * Create an empty knowledge base.
+ *
+ * Input:
+ *   name     - the name of the knowledge base (e.g. the tenant it belongs to)
+ *
+ * Returns:
+ *   the new knowledge base, if successful
+ *   NULL, if there was a memory allocation failure
+ */
+KNOWLEDGE_BASE *knowledge_create(const char *name) {
+
+	KNOWLEDGE_BASE *kb = knowledge_create_overlay(name, NULL);
+
+	if (kb == NULL)
+	{
+		return NULL;
 	}
-	else if (compare_token(intent, "WHAT") == 0)
+
+	kb->cache = cache_create();
+	if (kb->cache == NULL)
 	{
-		head = &WHAT_head;
+		free(kb);
+		return NULL;
 	}
-	else if (compare_token(intent, "WHO") == 0)
+
+	return kb;
+}
+
+
+/*
+ * Create an empty knowledge base that overlays another: it answers what it
+ * has learned itself, and otherwise what the layer below would answer (see
+ * knowledge_get()). It has no response cache, so that it costs only what it
+ * learns.
+ *
+ * The layer below (and the layers below it) must outlive the overlay, and
+ * must not change while the overlay is being used.
+ *
+ * Input:
+ *   name     - the name of the knowledge base (e.g. the session it belongs to)
+ *   below    - the knowledge base to overlay (NULL for none)
+ *
+ * Returns:
+ *   the new knowledge base, if successful
+ *   NULL, if there was a memory allocation failure
+ */
+KNOWLEDGE_BASE *knowledge_create_overlay(const char *name, KNOWLEDGE_BASE *below) {
+
+	KNOWLEDGE_BASE *kb = calloc(1, sizeof(KNOWLEDGE_BASE));
+
+	if (kb == NULL)
 	{
-		head = &WHO_head;
+		return NULL;
 	}
-	else
+
+	snprintf(kb->name, MAX_TENANT, "%s", name);
+	kb->merge_policy = KB_MERGE_REPLACE;
+	kb->fuzzy = true;
+	kb->rebalance_factor = REBALANCE_FACTOR;
+	kb->normalize = NORMALIZE_ALL;
+	kb->below = below;
+
+	return kb;
+}
+
+
+/*
+ * Free a knowledge base and everything it knows.
+ *
+ * Input:
+ *   kb       - the knowledge base (may be NULL)
+ */
+void knowledge_free(KNOWLEDGE_BASE *kb) {
+
+	if (kb != NULL)
 	{
-		// Not a valid question word
-		head = NULL;
+		knowledge_wait_save(kb);
+		knowledge_reset(kb);
+		knowledge_wait_teardown(kb);
+		fulltext_free(kb->fulltext);
+		cache_free(kb->cache);
+		for (int i = 0; i < NUM_INTENTS; i++)
+		{
+			bloom_clear(&kb->filter[i]);
+			phonetic_free(kb->phonetic[i]);
+		}
+		free(kb);
 	}
-	return head;
 }
 
+
 /*
- * Get the response to a question.
+ * Estimate the memory used by a knowledge base. The responses are kept in the
+ * store shared by every knowledge base (see intern.c), so each one is charged
+ * in proportion to the references to it (see intern_share()); this takes a
+ * walk of every BST.
  *
  * Input:
- *   intent   - the question word
- *   entity   - the entity
- *   response - a buffer to receive the response
- *   n        - the maximum number of characters to write to the response buffer
+ *   kb       - the knowledge base
  *
  * Returns:
- *   KB_OK, if a response was found for the intent and entity (the response is copied to the response buffer)
- *   KB_CLOSESTMATCH, if the entity is not found, but a closest match is found
- *   KB_NOTFOUND, if no suitable response could be found
- *   KB_INVALID, if 'intent' is not a recognised question word
+ *   the number of bytes used by the knowledge base, its BSTs and its share of
+ *   their responses
  */
-int knowledge_get(const char *intent, const char *entity, char *response, int n) {
+size_t knowledge_memory(KNOWLEDGE_BASE *kb) {
 
-	/* Identify the intent */
-	KB_NODE **root = get_root(intent);
+	TREE_CURSOR cursor;
+	size_t bytes = sizeof(KNOWLEDGE_BASE) + (kb->cache != NULL ? sizeof(RESPONSE_CACHE) : 0) + kb->tombstone_bytes + kb->alias_bytes;
 
-	// Not a valid question word
-	if (root == NULL)
+	for (int i = 0; i < NUM_INTENTS; i++)
 	{
-		return KB_INVALID;
+		bytes += (size_t) (kb->count[i] + kb->tombstones[i]) * sizeof(KB_NODE) + kb->text_bytes[i];
+		bytes += kb->filter[i].n_bits / 8 + kb->normal_bytes[i];
+		bytes += kb->phonetic[i] != NULL ? kb->phonetic[i]->bytes : 0;
+
+		if (cursor_open(&cursor, kb->root[i]))
+		{
+			for (KB_NODE *node = cursor_next(&cursor); node != NULL; node = cursor_next(&cursor))
+			{
+				bytes += intern_share(node->response);
+			}
+			cursor_close(&cursor);
+		}
 	}
+	if (kb->fulltext != NULL)
+	{
+		bytes += kb->fulltext->bytes;
+	}
+	return bytes;
+}
 
-	KB_NODE *node = search(*root, entity);
 
-	// Not found
-	if (node == NULL)
+/*
+ * Count a question answered by a node, and adapt the layout of its BST to the
+ * questions being asked (see knowledge_set_layout()). Restructuring relinks
+ * nodes in place, so it waits for a background save to finish first.
+ *
+ * Input:
+ *   kb       - the knowledge base
+ *   i        - the index of the intent
+ *   node     - the node that answered the question
+ */
+static void count_answer(KNOWLEDGE_BASE *kb, int i, KB_NODE *node) {
+
+	node->hits++;
+
+	if (kb->layout == LAYOUT_SPLAY && kb->root[i] != node)
 	{
-		return KB_NOTFOUND;
+		knowledge_wait_save(kb);
+		kb->root[i] = splay(kb->root[i], node->entity);
 	}
+	else if (kb->layout == LAYOUT_WEIGHTED && ++kb->asked[i] >= LAYOUT_PERIOD)
+	{
+		int n;
+
+		knowledge_wait_save(kb);
+		KB_NODE *vine = tree_to_vine(kb->root[i], &n);
+		vine_to_weighted_bst(&kb->root[i], vine, n);
+		kb->asked[i] = 0;
+	}
+}
+
+
+/*
+ * Find an entity in a stack of layers: in the top layer or, if it is not
+ * there and has not been forgotten from it, in the layers below.
+ *
+ * Input:
+ *   kb       - the top layer
+ *   i        - the index of the intent
+ *   entity   - the entity
+ *   layer    - receives the layer it was found in (may be NULL)
+ *
+ * Returns:
+ *   the node of the entity, if it is known
+ *   NULL, otherwise
+ */
+static KB_NODE *layer_find(KNOWLEDGE_BASE *kb, int i, const char *entity, KNOWLEDGE_BASE **layer) {
 
-	// Closest match found
-	else if (get_ascii_difference(entity, node->entity) > 0)
+	for (; kb != NULL; kb = kb->below)
 	{
-		char answer[MAX_INPUT];
-		prompt_user(answer, MAX_INPUT, "Sorry, I don't know about %s. Did you mean %s? (yes/no)", entity, node->entity);
-		
-		// User accepts closest match
-		if (compare_token(answer, "yes") == 0 || compare_token(answer, "y") == 0)
-		{
-			snprintf(response, MAX_RESPONSE, "%s", node->response);
-			return KB_CLOSESTMATCH;
-		}
-		// User does not accept closest match
-		else if (compare_token(answer, "no") == 0 || compare_token(answer, "n") == 0)
+		KB_NODE *node = bloom_maybe(&kb->filter[i], entity) ? search_exact(kb->root[i], entity) : NULL;
+		if (node != NULL)
 		{
-			// Calling function will prompt the user to provide knowledge
-			return KB_NOTFOUND;
+			if (layer != NULL)
+			{
+				*layer = kb;
+			}
+			return node;
 		}
-		// Invalid input
-		else 
-		{
-			snprintf(response, MAX_RESPONSE, "I dont understand '%s'", answer);
 
-			// Ends the current transaction
-			return KB_CLOSESTMATCH;
+		// Forgotten here, so hidden in the layers below
+		if (search_exact(kb->forgotten[i], entity) != NULL)
+		{
+			return NULL;
 		}
 	}
-	// Found
-	else
-	{
-		snprintf(response, MAX_RESPONSE, "%s", node->response);
-		return KB_OK;
-	}
+
+	return NULL;
 }
 
 
 /*
- * Insert a new response to a question. If a response already exists for the
- * given intent and entity, it will be overwritten. Otherwise, it will be added
- * to the knowledge base.
+ * Map a name (an alias, or a normalized key) to an entity in a table of
+ * names, replacing the entity it was mapped to before. The table is created
+ * on first use, and the entity is truncated to fit in a node, as it would be
+ * when read from a file.
  *
  * Input:
- *   intent    - the question word
- *   entity    - the entity
- *   response  - the response for this question and entity
+ *   table    - the table (may point to NULL)
+ *   bytes    - the size of the table, to update
+ *   name     - the name
+ *   entity   - the entity
  *
  * Returns:
  *   KB_OK, if successful
  *   KB_NOMEM, if there was a memory allocation failure
- *   KB_INVALID, if the intent is not a valid question word
  */
-int knowledge_put(const char *intent, const char *entity, const char *response) {
+static int put_name(HASH_TABLE **table, size_t *bytes, const char *name, const char *entity) {
 
-	/* Identify the intent */
-	KB_NODE **root = get_root(intent);
-
-	// Not a valid question word
-	if (root == NULL)
+	if (*table == NULL && (*table = hash_create(ALIAS_BUCKETS)) == NULL)
 	{
-		return KB_INVALID;
+		return KB_NOMEM;
 	}
 
-	// Empty tree (set root to new node)
-	if (*root == NULL)
+	size_t length = strlen(entity) < MAX_ENTITY ? strlen(entity) : MAX_ENTITY - 1;
+	char *copy = malloc(length + 1);
+	if (copy == NULL)
 	{
-		*root = create_new_node(entity, response);
+		return KB_NOMEM;
+	}
+	memcpy(copy, entity, length);
+	copy[length] = '\0';
 
-		// Memory allocation failure
-		if (*root == NULL)
-		{
-			return KB_NOMEM;
-		}
+	char *old = hash_get(*table, name);
+	if (hash_put(*table, name, copy) != KB_OK)
+	{
+		free(copy);
+		return KB_NOMEM;
 	}
 
-	// Non-empty tree (insert new node into BST)
+	if (old != NULL)
+	{
+		*bytes -= strlen(old) + 1;
+		free(old);
+	}
 	else
 	{
-		int status = insert(*root, entity, response);	
-		return status;
+		*bytes += sizeof(HASH_ENTRY) + strlen(name) + 1;
 	}
+	*bytes += length + 1;
 	return KB_OK;
 }
 
 
 /*
- * Read a knowledge base from a file. Note that if the file is sorted,
- * creating a sorted linked list takes only O(n) time. Otherwise,
- * an insertion sort is performed, increasing the time complexity.
- *
- * Input:
- *   f 				- the file
- *	 response 		- the response buffer for error reporting
- *
- * Returns: 
- * 	 the number of entity/response pairs successful read from the file,
- * 	 or KB_NOMEM if there was a memory allocation failure
+ * Remove a name from a table of names (see put_name()), if it has it.
  */
-int knowledge_read(FILE *f) {
-	
-	// Assume that no line of the file is longer than 
-	// MAX_ENTITY + 1 + MAX_RESPONSE + 1 characters
+static void remove_name(HASH_TABLE *table, size_t *bytes, const char *name) {
 
-	int buff_size = MAX_ENTITY + 1 + MAX_RESPONSE + 1;
+	char *old = table == NULL ? NULL : hash_remove(table, name);
 
-	char line[buff_size];
-	int line_length;
+	if (old != NULL)
+	{
+		size_t size = sizeof(HASH_ENTRY) + strlen(name) + strlen(old) + 2;
+		*bytes -= size < *bytes ? size : *bytes;
+		free(old);
+	}
+}
 
-	int count = 0;
 
-	char entity[MAX_ENTITY];
-	char response[MAX_RESPONSE];
-	int status;
+/*
+ * Index an entity by its normalized key (see knowledge_set_normalize()), if
+ * the key differs from the entity; otherwise it is found as itself. A key
+ * shared by several entities finds the one indexed last. Failing to index
+ * an entity is not an error: it can still be found as it is.
+ */
+static void index_entity(KNOWLEDGE_BASE *kb, int i, const char *entity) {
 
-	// The longest intent is WHERE, which is 5 characters long
-	char section_name[6] = "";
-	bool valid_section = false;
+	char key[MAX_ENTITY];
 
-	// Read from file
-	while (fgets(line, buff_size, f) != NULL) 
-	{ 
-		// Account for "\r\n" at end of line
-		line[strcspn(line, "\r\n")] = 0;
-		line_length = strlen(line);
+	if (kb->normalize != 0)
+	{
+		normalize_entity(entity, kb->normalize, key);
+		if (key[0] != '\0' && compare_token(key, entity) != 0)
+		{
+			put_name(&kb->normal[i], &kb->normal_bytes[i], key, entity);
+		}
+	}
+}
+
+
+/*
+ * Remove an entity from the index of normalized keys, if its key finds it.
+ */
+static void unindex_entity(KNOWLEDGE_BASE *kb, int i, const char *entity) {
 
-		// Empty line
-		if (line_length == '\0' && line[0] == '\n') {
-			// Ignore
-        	continue;
-    	}
+	char key[MAX_ENTITY];
 
-		// Get section heading
-		if (line[0] == '[' && line[line_length - 1] == ']')
+	if (kb->normal[i] != NULL)
+	{
+		normalize_entity(entity, kb->normalize, key);
+		const char *indexed = hash_get(kb->normal[i], key);
+		if (indexed != NULL && compare_token(indexed, entity) == 0)
 		{
-			snprintf(section_name, 6, "%s", strtok(line + 1, "]"));
-			if (chatbot_is_question(section_name))
-			{
-				valid_section = true;
-			}
-			// Ignore anything after ']'
-			continue;
+			remove_name(kb->normal[i], &kb->normal_bytes[i], key);
 		}
+	}
+}
+
 
-		// If the file contains a section heading that does not correspond 
-		// to an intent understood by the chatbot, the whole section should 
-		// be ignored
-		if (valid_section)
+/*
+ * Rebuild the index of normalized keys of an intent from its BST, in one
+ * walk of the BST.
+ */
+static void index_tree(KNOWLEDGE_BASE *kb, int i) {
+
+	TREE_CURSOR cursor;
+
+	hash_destroy(kb->normal[i], free);
+	kb->normal[i] = NULL;
+	kb->normal_bytes[i] = 0;
+
+	if (kb->normalize != 0 && cursor_open(&cursor, kb->root[i]))
+	{
+		for (KB_NODE *node = cursor_next(&cursor); node != NULL; node = cursor_next(&cursor))
 		{
-			// Lines that do not contain either '=' or square brackets should be ignored
-			if (strchr(line, '=') == NULL)
-			{
-				continue;
-			}
+			index_entity(kb, i, node->entity);
+		}
+		cursor_close(&cursor);
+	}
+}
 
-			// Extract entity from '=' delimiter
-			snprintf(entity, MAX_ENTITY, "%s", strtok(line, "="));
-			// Extract response after '=' and before "\r\n"
-			snprintf(response, MAX_RESPONSE, "%s", strtok(NULL, "\r\n"));
 
-			// Insert entity-response pair into linked list
-			LIST_NODE **head = get_head(section_name);
-			status = insert_to_list(head, entity, response);
+/*
+ * Find an entity that is not known as asked by its normalized key, in a
+ * stack of layers (see layer_find()): the entity that is its own key, or
+ * else the entity that the highest layer with the key indexed it for.
+ *
+ * Input:
+ *   kb       - the top layer
+ *   i        - the index of the intent
+ *   entity   - the entity asked about
+ *   layer    - receives the layer it was found in (may be NULL)
+ *
+ * Returns:
+ *   the node of the entity, if it is known
+ *   NULL, otherwise
+ */
+static KB_NODE *find_normalized(KNOWLEDGE_BASE *kb, int i, const char *entity, KNOWLEDGE_BASE **layer) {
+
+	char key[MAX_ENTITY];
 
-			if (status != KB_OK)
-			{
-				fclose(f);
-				return status;
-			}
+	if (kb->normalize == 0)
+	{
+		return NULL;
+	}
+	normalize_entity(entity, kb->normalize, key);
+	if (key[0] == '\0')
+	{
+		return NULL;
+	}
 
-			// Count number of entity-response pairs
-			count++;
+	KB_NODE *node = compare_token(key, entity) != 0 ? layer_find(kb, i, key, layer) : NULL;
+	for (KNOWLEDGE_BASE *below = kb; below != NULL && node == NULL; below = below->below)
+	{
+		const char *indexed = below->normal[i] == NULL ? NULL : hash_get(below->normal[i], key);
+		if (indexed != NULL)
+		{
+			node = layer_find(kb, i, indexed, layer);
 		}
-	} 
+	}
 
-	fclose(f);
+	return node;
+}
 
-	// Convert linked list to balanced BST
-	bool mem_error = false;
-	WHAT_root = balanced_bst(WHAT_head, &mem_error);
-	WHO_root = balanced_bst(WHO_head, &mem_error);
-	WHERE_root = balanced_bst(WHERE_head, &mem_error);
 
-	if (mem_error)
+/*
+ * Rebuild the phonetic index of an intent (see knowledge_set_phonetic()) from
+ * its BST, in one walk of the BST.
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure (the index then lacks
+ *     some of the names, which are only offered by their closest match)
+ */
+static int index_sounds(KNOWLEDGE_BASE *kb, int i) {
+
+	TREE_CURSOR cursor;
+	int status = KB_OK;
+
+	TRACE_BEGIN(span, "index_sounds");
+
+	phonetic_free(kb->phonetic[i]);
+	if ((kb->phonetic[i] = phonetic_create()) == NULL || !cursor_open(&cursor, kb->root[i]))
 	{
+		TRACE_END(span);
 		return KB_NOMEM;
 	}
 
-	// Linked list is no longer needed after conversion
-	reset_list(WHAT_head);
-	reset_list(WHO_head);
-	reset_list(WHERE_head);
+	for (KB_NODE *node = cursor_next(&cursor); node != NULL && status == KB_OK; node = cursor_next(&cursor))
+	{
+		status = phonetic_put(kb->phonetic[i], node->entity);
+	}
+	if (cursor.failed)
+	{
+		status = KB_NOMEM;
+	}
+	cursor_close(&cursor);
+	TRACE_END(span);
+	return status;
+}
 
-	WHAT_head = WHO_head = WHERE_head = NULL;
 
-	return count;
+/*
+ * Find a known name that sounds like an entity that is not known, in a stack
+ * of layers (see layer_find()). Each layer with a phonetic index offers its
+ * best PHONETIC_CANDIDATES names (see phonetic_lookup()), the highest layer
+ * first; the first of them that the stack still knows (perhaps as a layer
+ * above has changed it) is the one found.
+ *
+ * Input:
+ *   kb       - the top layer
+ *   i        - the index of the intent
+ *   entity   - the entity asked about
+ *   layer    - receives the layer it was found in (may be NULL)
+ *
+ * Returns:
+ *   the node of the name, if one sounds like the entity
+ *   NULL, otherwise
+ */
+static KB_NODE *find_phonetic(KNOWLEDGE_BASE *kb, int i, const char *entity, KNOWLEDGE_BASE **layer) {
+
+	const char *found[PHONETIC_CANDIDATES];
+
+	for (KNOWLEDGE_BASE *below = kb; below != NULL; below = below->below)
+	{
+		int n = below->phonetic[i] == NULL ? 0 : phonetic_lookup(below->phonetic[i], entity, found, PHONETIC_CANDIDATES);
+
+		for (int k = 0; k < n; k++)
+		{
+			KB_NODE *node = layer_find(kb, i, found[k], layer);
+			if (node != NULL)
+			{
+				return node;
+			}
+		}
+	}
+
+	return NULL;
 }
 
 
 /*
- * Reset the knowledge base, removing all known entities from all intents.
+ * Answer a question from a stack of layers: the entity if any layer knows it
+ * as asked (see layer_find()) or normalized (see find_normalized()),
+ * otherwise a name that sounds like it (see find_phonetic()) or the closest
+ * match of all the layers. A match is answered as the stack knows it, so one
+ * that a layer above has forgotten or changed is not offered as the layer
+ * below has it (a forgotten match is not replaced by the next closest one in
+ * its layer, though).
+ *
+ * Input:
+ *   kb       - the top layer
+ *   i        - the index of the intent
+ *   entity   - the entity
+ *   node     - receives the node of the entity or closest match
+ *   layer    - receives the layer the node is in
+ *
+ * Returns:
+ *   KB_OK, KB_CLOSESTMATCH or KB_NOTFOUND (see knowledge_get())
  */
-void knowledge_reset() {
-	if (WHAT_root != NULL)
+static int layer_search(KNOWLEDGE_BASE *kb, int i, const char *entity, KB_NODE **node, KNOWLEDGE_BASE **layer) {
+
+	*node = layer_find(kb, i, entity, layer);
+	if (*node == NULL)
+	{
+		*node = find_normalized(kb, i, entity, layer);
+	}
+	if (*node != NULL)
+	{
+		return KB_OK;
+	}
+	if (!kb->fuzzy)
 	{
-		reset(WHAT_root);
+		return KB_NOTFOUND;
 	}
-	if (WHERE_root != NULL)
+	if ((*node = find_phonetic(kb, i, entity, layer)) != NULL)
 	{
-		reset(WHERE_root);
+		return KB_CLOSESTMATCH;
 	}
-	if (WHO_root != NULL)
+
+	int best = 0;
+	for (KNOWLEDGE_BASE *below = kb; below != NULL; below = below->below)
 	{
-		reset(WHO_root);
+		KB_NODE *closest = search(below->root[i], entity);
+		KNOWLEDGE_BASE *owner;
+		KB_NODE *visible = closest == NULL ? NULL : layer_find(kb, i, closest->entity, &owner);
+
+		if (visible != NULL)
+		{
+			int difference = get_ascii_difference(entity, visible->entity);
+			if (*node == NULL || difference < best)
+			{
+				best = difference;
+				*node = visible;
+				*layer = owner;
+			}
+		}
 	}
-	WHAT_root = WHERE_root = WHO_root = NULL;
+
+	return *node == NULL ? KB_NOTFOUND : KB_CLOSESTMATCH;
 }
 
 
 /*
- * Write the knowledge base to a file.
+ * Hide an entity that the layers below know, by adding a tombstone for it.
  *
- * Input:
- *   f - the file
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
  */
-void knowledge_write(FILE *f) {
+static int bury(KNOWLEDGE_BASE *kb, int i, const char *entity) {
+
+	int depth;
+	int status = insert(&kb->forgotten[i], entity, "", &depth);
+
+	if (depth > 0)
+	{
+		kb->tombstones[i]++;
+		kb->tombstone_bytes += strlen(entity) + 2;
+	}
+	return status;
+}
 
-	fprintf(f, "[what]\n");
-	reverse_in_order_write(WHAT_root, f);
 
-	fprintf(f, "\n[where]\n");
-	reverse_in_order_write(WHERE_root, f);
+/*
+ * Remove the tombstone of an entity, if it has one, once it is learned again.
+ */
+static void unbury(KNOWLEDGE_BASE *kb, int i, const char *entity) {
+
+	KB_NODE *node = search_exact(kb->forgotten[i], entity);
 
-	fprintf(f, "\n[who]\n");
-	reverse_in_order_write(WHO_root, f);
+	if (node != NULL)
+	{
+		size_t text = strlen(node->entity) + 2;
+		kb->tombstone_bytes -= text < kb->tombstone_bytes ? text : kb->tombstone_bytes;
+		delete_node(&kb->forgotten[i], entity);
+		kb->tombstones[i]--;
+	}
+}
 
-	fclose(f);
+
+/*
+ * Find the entity an alias stands for (see knowledge_alias()), in the table
+ * of the highest layer that has the alias. An alias that stands for another
+ * alias is followed, up to ALIAS_HOPS times.
+ *
+ * Input:
+ *   kb       - the top layer
+ *   i        - the index of the intent
+ *   entity   - the entity asked about
+ *
+ * Returns:
+ *   the entity the alias stands for, or <entity> if it is not an alias
+ */
+static const char *resolve_alias(KNOWLEDGE_BASE *kb, int i, const char *entity) {
+
+	for (int hops = 0; hops < ALIAS_HOPS; hops++)
+	{
+		const char *canonical = NULL;
+		for (KNOWLEDGE_BASE *layer = kb; layer != NULL && canonical == NULL; layer = layer->below)
+		{
+			canonical = layer->aliases[i] == NULL ? NULL : hash_get(layer->aliases[i], entity);
+		}
+
+		// Not an alias (an empty entity hides the alias in the layers below)
+		if (canonical == NULL || canonical[0] == '\0')
+		{
+			break;
+		}
+		entity = canonical;
+	}
+
+	return entity;
+}
+
+
+/*
+ * Make an alias stand for an entity in the top layer (see knowledge_alias()).
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the alias is empty or would stand for itself
+ */
+static int add_alias(KNOWLEDGE_BASE *kb, int i, const char *alias, const char *entity) {
+
+	// Always stand for an entity, so that a chain of aliases cannot loop
+	char canonical[MAX_ENTITY];
+	snprintf(canonical, MAX_ENTITY, "%s", resolve_alias(kb, i, entity));
+
+	if (alias[0] == '\0' || canonical[0] == '\0' || compare_token(alias, canonical) == 0)
+	{
+		return KB_INVALID;
+	}
+	return put_name(&kb->aliases[i], &kb->alias_bytes, alias, canonical);
+}
+
+
+/*
+ * Get the response to a question. No one is asked anything: if the entity is
+ * not known but a closest match is, the match is returned for the caller to
+ * offer, and knowledge_accept() records that it was accepted.
+ *
+ * An alias (see knowledge_alias()) is answered as the entity it stands for,
+ * which is found in O(1) time before the BST is searched. An entity that is
+ * not known as asked is then looked for normalized (see
+ * knowledge_set_normalize()), and then a name that sounds like it (see
+ * knowledge_set_phonetic()) is offered before its closest match.
+ *
+ * An overlay (see knowledge_create_overlay()) answers from the layers below
+ * what it does not know itself; its own answers are the only ones counted
+ * (see count_answer()), as the layers below may be shared.
+ *
+ * Input:
+ *   kb       - the knowledge base
+ *   intent   - the question word
+ *   entity   - the entity
+ *   match    - a buffer of MAX_ENTITY characters to receive the entity of the
+ *              closest match (may be NULL)
+ *   response - a buffer to receive the response
+ *   n        - the maximum number of characters to write to the response buffer
+ *
+ * Returns:
+ *   KB_OK, if a response was found for the intent and entity (the response is copied to the response buffer)
+ *   KB_CLOSESTMATCH, if the entity is not found, but a closest match is found
+ *     (its entity and response are copied to the match and response buffers)
+ *   KB_NOTFOUND, if no suitable response could be found
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ */
+int knowledge_get(KNOWLEDGE_BASE *kb, const char *intent, const char *entity, char *match, char *response, int n) {
+
+	/* Identify the intent */
+	int i = get_intent(intent);
+
+	// Not a valid question word
+	if (i < 0)
+	{
+		return KB_INVALID;
+	}
+
+	const char *match_entity;
+	const char *match_response;
+	char text[MAX_RESPONSE];
+	KNOWLEDGE_BASE *layer = kb;
+	CACHE_ENTRY *cached;
+	KB_NODE *node;
+	int status;
+
+	entity = resolve_alias(kb, i, entity);
+
+	// Search the layers (there is no cache: a layer below may have changed)
+	if (kb->below != NULL)
+	{
+		status = layer_search(kb, i, entity, &node, &layer);
+		match_entity = node == NULL ? NULL : node->entity;
+		match_response = node == NULL ? NULL : intern_read(node->response, text);
+	}
+	// Answer repeated questions from the cache; otherwise search the BST
+	// (for the entity, or the closest match) and cache the answer
+	else if ((cached = cache_get(kb->cache, i, entity)) != NULL)
+	{
+		status = cached->status;
+		match_entity = cached->entity;
+		match_response = cached->response;
+		node = cached->node;
+	}
+	else
+	{
+		// An entity the Bloom filter rules out can only have a closest match;
+		// otherwise the plain search comes first, and the closest match (which
+		// measures the difference at every node on the way) only on a miss
+		node = bloom_maybe(&kb->filter[i], entity) ? search_exact(kb->root[i], entity) : NULL;
+
+		if (node != NULL)
+		{
+			status = KB_OK;
+		}
+		else if (kb->fuzzy && (node = search(kb->root[i], entity)) != NULL)
+		{
+			status = KB_CLOSESTMATCH;
+		}
+		else
+		{
+			status = KB_NOTFOUND;
+		}
+
+		// Not known as asked, but perhaps normalized
+		KB_NODE *normal = status == KB_OK ? NULL : find_normalized(kb, i, entity, NULL);
+		if (normal != NULL)
+		{
+			node = normal;
+			status = KB_OK;
+		}
+		// Not known at all, but a name that sounds like it is a better match
+		else if (status != KB_OK && kb->fuzzy && (normal = find_phonetic(kb, i, entity, NULL)) != NULL)
+		{
+			node = normal;
+			status = KB_CLOSESTMATCH;
+		}
+
+		match_entity = node == NULL ? NULL : node->entity;
+		match_response = node == NULL ? NULL : intern_read(node->response, text);
+		cache_put(kb->cache, i, entity, status, node, match_response);
+	}
+
+	// Not found
+	if (status == KB_NOTFOUND)
+	{
+		return KB_NOTFOUND;
+	}
+
+	// Closest match found (the caller may offer it)
+	if (status == KB_CLOSESTMATCH && match != NULL)
+	{
+		snprintf(match, MAX_ENTITY, "%s", match_entity);
+	}
+	snprintf(response, n, "%s", match_response);
+
+	// Found
+	if (status == KB_OK && layer == kb)
+	{
+		count_answer(kb, i, node);
+	}
+	return status;
+}
+
+
+/*
+ * Record that the closest match offered by knowledge_get() was accepted, and
+ * get its response again (the knowledge may have changed since it was offered).
+ *
+ * Input:
+ *   kb       - the knowledge base
+ *   intent   - the question word
+ *   match    - the entity of the closest match
+ *   response - a buffer to receive the response
+ *   n        - the maximum number of characters to write to the response buffer
+ *
+ * Returns:
+ *   KB_OK, if the match is still known (its response is copied to the response buffer)
+ *   KB_NOTFOUND, if it has been forgotten meanwhile
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ */
+int knowledge_accept(KNOWLEDGE_BASE *kb, const char *intent, const char *match, char *response, int n) {
+
+	/* Identify the intent */
+	int i = get_intent(intent);
+
+	// Not a valid question word
+	if (i < 0)
+	{
+		return KB_INVALID;
+	}
+
+	char text[MAX_RESPONSE];
+	KNOWLEDGE_BASE *layer;
+	KB_NODE *node = layer_find(kb, i, match, &layer);
+	if (node == NULL)
+	{
+		return KB_NOTFOUND;
+	}
+
+	snprintf(response, n, "%s", intern_read(node->response, text));
+	if (layer == kb)
+	{
+		count_answer(kb, i, node);
+	}
+	return KB_OK;
+}
+
+
+/*
+ * Insert a new response to a question. If a response already exists for the
+ * given intent and entity, it will be overwritten. Otherwise, it will be added
+ * to the knowledge base. The response to an alias is the response to the
+ * entity it stands for.
+ *
+ * Input:
+ *   kb        - the knowledge base
+ *   intent    - the question word
+ *   entity    - the entity
+ *   response  - the response for this question and entity
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the intent is not a valid question word
+ */
+int knowledge_put(KNOWLEDGE_BASE *kb, const char *intent, const char *entity, const char *response) {
+
+	/* Identify the intent */
+	int i = get_intent(intent);
+
+	// Not a valid question word
+	if (i < 0)
+	{
+		return KB_INVALID;
+	}
+
+	entity = resolve_alias(kb, i, entity);
+
+	// Insert new node into BST (or update the existing node)
+	int depth;
+	int status = insert(&kb->root[i], entity, response, &depth);
+	cache_invalidate(kb->cache, i);
+
+	if (depth > 0)
+	{
+		kb->count[i]++;
+		if (kb->count[i] > kb->peak[i])
+		{
+			kb->peak[i] = kb->count[i];
+		}
+		kb->text_bytes[i] += strlen(entity) + 1;
+		bloom_add(&kb->filter[i], entity, kb->root[i], kb->count[i]);
+	}
+	if (status != KB_OK)
+	{
+		return status;
+	}
+
+	// Learned again after being forgotten from the layers below
+	unbury(kb, i, entity);
+	if (depth > 0)
+	{
+		index_entity(kb, i, entity);
+		if (kb->phonetic[i] != NULL)
+		{
+			phonetic_put(kb->phonetic[i], entity);
+		}
+	}
+
+	// Failing to index the response only means it is not found by a search
+	if (kb->fulltext != NULL)
+	{
+		fulltext_put(kb->fulltext, i, entity, response);
+	}
+
+	// Only a new node can make a BST deeper: if it is too deep, rebalance
+	// (a splayed BST looks after itself, and a weighted one is meant to be
+	// uneven)
+	if (kb->layout == LAYOUT_STATIC && kb->rebalance_factor > 0 &&
+		depth > kb->rebalance_factor * balanced_height(kb->count[i]))
+	{
+		// Relinks nodes in place, so it must not race a background save
+		knowledge_wait_save(kb);
+		if (rebalance_path(&kb->root[i], entity, depth, kb->count[i], kb->rebalance_factor) == KB_OK)
+		{
+			kb->rebalances[i]++;
+		}
+	}
+
+	kb->dirty = true;
+	return KB_OK;
+}
+
+
+/*
+ * Remove the response to a question, so that the entity is no longer known.
+ * An overlay cannot change the layers below it, so it hides an entity they
+ * know behind a tombstone instead. Forgetting an alias forgets only the alias
+ * (the aliases of a forgotten entity stand for it again once it is relearned).
+ *
+ * Input:
+ *   kb        - the knowledge base
+ *   intent    - the question word
+ *   entity    - the entity
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOTFOUND, if the entity is not known for this intent
+ *   KB_INVALID, if the intent is not a valid question word
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int knowledge_forget(KNOWLEDGE_BASE *kb, const char *intent, const char *entity) {
+
+	/* Identify the intent */
+	int i = get_intent(intent);
+
+	// Not a valid question word
+	if (i < 0)
+	{
+		return KB_INVALID;
+	}
+
+	// An alias (hidden behind an empty one if it is known below)
+	if (resolve_alias(kb, i, entity) != entity)
+	{
+		remove_name(kb->aliases[i], &kb->alias_bytes, entity);
+		if (kb->below != NULL && resolve_alias(kb->below, i, entity) != entity &&
+			put_name(&kb->aliases[i], &kb->alias_bytes, entity, "") != KB_OK)
+		{
+			return KB_NOMEM;
+		}
+		kb->dirty = true;
+		return KB_OK;
+	}
+
+	// Deletion relinks nodes in place, so it must not race a background save
+	knowledge_wait_save(kb);
+
+	if (layer_find(kb, i, entity, NULL) == NULL)
+	{
+		return KB_NOTFOUND;
+	}
+
+	// Known below (whether or not this layer knows it too): hide it there
+	if (kb->below != NULL && layer_find(kb->below, i, entity, NULL) != NULL && bury(kb, i, entity) != KB_OK)
+	{
+		return KB_NOMEM;
+	}
+
+	KB_NODE *node = search_exact(kb->root[i], entity);
+	if (node != NULL)
+	{
+		size_t text = strlen(node->entity) + 1;
+		kb->text_bytes[i] -= text < kb->text_bytes[i] ? text : kb->text_bytes[i];
+		unindex_entity(kb, i, node->entity);
+		if (kb->phonetic[i] != NULL)
+		{
+			phonetic_remove(kb->phonetic[i], node->entity);
+		}
+		if (kb->fulltext != NULL)
+		{
+			fulltext_remove(kb->fulltext, i, node->entity);
+		}
+		delete_node(&kb->root[i], entity);
+		kb->count[i]--;
+
+		// Deleting never makes a BST shallower, so once it holds under half
+		// the nodes it once did it may be far deeper than it need be: rebuild
+		// it balanced, as a scapegoat tree does (a splayed BST looks after
+		// itself, and a weighted one is meant to be uneven)
+		if (kb->layout == LAYOUT_STATIC && kb->rebalance_factor > 0 && kb->count[i] < kb->peak[i] / 2)
+		{
+			int n;
+			KB_NODE *vine = tree_to_vine(kb->root[i], &n);
+			kb->root[i] = vine_to_balanced_bst(&vine, n);
+			kb->peak[i] = kb->count[i];
+			kb->rebalances[i]++;
+		}
+	}
+
+	kb->dirty = true;
+	cache_invalidate(kb->cache, i);
+	return KB_OK;
+}
+
+
+/*
+ * Make an alias (e.g. "SIT") stand for an entity (e.g. "Singapore Institute
+ * of Technology"), so that questions about the alias are answered, learned
+ * and cached as questions about the entity, without a node of its own. An
+ * alias that stands for another alias stands for the entity that one does.
+ * Aliases are found before the BST is searched, so an alias hides an entity
+ * of the same name.
+ *
+ * Input:
+ *   kb        - the knowledge base
+ *   intent    - the question word
+ *   alias     - the alias
+ *   entity    - the entity it stands for
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the intent is not a valid question word, or the alias is
+ *     empty or would stand for itself
+ */
+int knowledge_alias(KNOWLEDGE_BASE *kb, const char *intent, const char *alias, const char *entity) {
+
+	/* Identify the intent */
+	int i = get_intent(intent);
+
+	// Not a valid question word
+	if (i < 0)
+	{
+		return KB_INVALID;
+	}
+
+	int status = add_alias(kb, i, alias, entity);
+	if (status == KB_OK)
+	{
+		kb->dirty = true;
+	}
+	return status;
+}
+
+
+/*
+ * Find the answers whose responses mention some words, e.g. "ICT1002 or
+ * Python" (see fulltext_search()), in each layer that indexes its responses
+ * (see knowledge_set_fulltext()). In a stack of layers, an answer is only
+ * found in the layer that answers for it, so one that a layer above has
+ * forgotten or changed is not found below.
+ *
+ * Input:
+ *   kb        - the knowledge base
+ *   inc       - the number of words in the query
+ *   inv       - the words of the query
+ *   hits      - a buffer to receive the answers found
+ *   max       - the most answers to copy to the buffer
+ *
+ * Returns:
+ *   the number of answers found (the first <max> are copied to the buffer)
+ *   KB_INVALID, if the responses are not indexed
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int knowledge_search(KNOWLEDGE_BASE *kb, int inc, char *inv[], FULLTEXT_HIT *hits, int max) {
+
+	int found = 0;
+	bool indexed = false;
+
+	for (KNOWLEDGE_BASE *layer = kb; layer != NULL; layer = layer->below)
+	{
+		if (layer->fulltext == NULL)
+		{
+			continue;
+		}
+		indexed = true;
+
+		int *docs;
+		int n = fulltext_search(layer->fulltext, inc, inv, &docs);
+		if (n < 0)
+		{
+			return n;
+		}
+
+		for (int k = 0; k < n; k++)
+		{
+			FULLTEXT_DOC *doc = &layer->fulltext->docs[docs[k]];
+			KNOWLEDGE_BASE *owner = layer;
+
+			if (kb->below != NULL && layer_find(kb, doc->intent, doc->entity, &owner) == NULL)
+			{
+				continue;
+			}
+			if (owner == layer && found++ < max)
+			{
+				hits[found - 1].intent = doc->intent;
+				snprintf(hits[found - 1].entity, MAX_ENTITY, "%s", doc->entity);
+			}
+		}
+		free(docs);
+	}
+
+	return indexed ? found : KB_INVALID;
+}
+
+
+/*
+ * Index every response, as it now is.
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int index_responses(KNOWLEDGE_BASE *kb) {
+
+	char text[MAX_RESPONSE];
+	int status = KB_OK;
+
+	TRACE_BEGIN(span, "index_responses");
+
+	for (int i = 0; i < NUM_INTENTS && status == KB_OK; i++)
+	{
+		TREE_CURSOR cursor;
+		if (!cursor_open(&cursor, kb->root[i]))
+		{
+			TRACE_END(span);
+			return KB_NOMEM;
+		}
+
+		for (KB_NODE *node = cursor_next(&cursor); node != NULL && status == KB_OK; node = cursor_next(&cursor))
+		{
+			status = fulltext_put(kb->fulltext, i, node->entity, intern_read(node->response, text));
+		}
+		if (cursor.failed)
+		{
+			status = KB_NOMEM;
+		}
+		cursor_close(&cursor);
+	}
+
+	TRACE_END(span);
+	return status;
+}
+
+
+/* the work of merging one intent's entries into its BST */
+typedef struct merge_job
+{
+	KNOWLEDGE_BASE *kb;
+	int intent;
+	KB_LOAD *load;
+	int threads;
+	bool mem_error;
+} MERGE_JOB;
+
+
+/*
+ * Merge sorted entries into a BST. The BST is flattened into a vine, merged
+ * with the entries in one linear pass and rebuilt as a balanced BST, so
+ * existing nodes are reused rather than reallocated.
+ *
+ * Input:
+ * 	 arg			- the MERGE_JOB
+ */
+static void *merge_into_tree(void *arg)
+{
+	MERGE_JOB *job = arg;
+	KNOWLEDGE_BASE *kb = job->kb;
+	int i = job->intent;
+	int n;
+
+	TRACE_BEGIN(span, "merge_into_tree");
+
+	KB_NODE *vine = tree_to_vine(kb->root[i], &n);
+	BUILD_ITEM *items = malloc(((size_t) n + job->load->count[i] + 1) * sizeof(BUILD_ITEM));
+
+	// Memory allocation failure (rebuild the tree as it was)
+	if (items == NULL)
+	{
+		kb->root[i] = vine_to_balanced_bst(&vine, n);
+		job->mem_error = true;
+		TRACE_END(span);
+		return NULL;
+	}
+
+	n = merge_entries(vine, job->load->sorted[i], job->load->count[i], kb->merge_policy, items);
+
+	// The entities the BST will hold (its responses are in the store)
+	kb->text_bytes[i] = 0;
+	for (int k = 0; k < n; k++)
+	{
+		const char *entity = items[k].node != NULL ? items[k].node->entity : items[k].entry->entity;
+		kb->text_bytes[i] += strlen(entity) + 1;
+	}
+
+	kb->root[i] = build_balanced_bst(items, n, job->threads, &kb->count[i], &job->mem_error);
+	kb->peak[i] = kb->count[i];
+	bloom_build(&kb->filter[i], kb->root[i], kb->count[i]);
+	index_tree(kb, i);
+	if (kb->phonetic[i] != NULL)
+	{
+		index_sounds(kb, i);
+	}
+
+	free(items);
+	TRACE_END(span);
+	return NULL;
+}
+
+
+/*
+ * Train the dictionary of compressed responses (see intern_train()) on a
+ * sample of the responses of a file, evenly spread over its entries. Failing
+ * to train it is not an error: responses are then stored uncompressed.
+ */
+static void train_dictionary(const KB_LOAD *load) {
+
+	int total = 0;
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		total += load->count[i];
+	}
+
+	TRACE_BEGIN(span, "train_dictionary");
+
+	int step = total / INTERN_SAMPLES + 1;
+	const char **samples = malloc(((size_t) total / step + NUM_INTENTS) * sizeof(const char *));
+	if (samples == NULL)
+	{
+		TRACE_END(span);
+		return;
+	}
+
+	int n = 0;
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		for (int k = 0; k < load->count[i]; k += step)
+		{
+			samples[n++] = load->sorted[i][k]->response;
+		}
+	}
+	intern_train(samples, n);
+
+	free(samples);
+	TRACE_END(span);
+}
+
+
+/*
+ * Read a knowledge base from a file, merging it into the existing knowledge.
+ * The file is parsed and sorted in parallel by load_entries() (see loader.c),
+ * then merged into each BST in O(n + m) time, with the BSTs of the intents
+ * (and large subtrees within them) built in parallel.
+ *
+ * Entities already known, or repeated in the file, are resolved according to
+ * the merge policy (see knowledge_set_merge_policy()), as are aliases (which
+ * are read from the "[<intent> aliases]" sections of the file as
+ * <alias>=<entity>).
+ *
+ * Input:
+ *   kb 			- the knowledge base
+ *   f 				- the file
+ *
+ * Returns: 
+ * 	 the number of entity/response pairs successful read from the file,
+ * 	 or KB_NOMEM if there was a memory allocation failure
+ */
+int knowledge_read(KNOWLEDGE_BASE *kb, FILE *f) {
+
+	TRACE_BEGIN(span, "knowledge_read");
+
+	KB_LOAD load;
+	int count = load_entries(f, &load);
+
+	if (count < 0)
+	{
+		TRACE_END(span);
+		return count;
+	}
+
+	// The first knowledge loaded with compression on trains its dictionary
+	if (intern_compression())
+	{
+		train_dictionary(&load);
+	}
+
+	// Merging relinks nodes in place, so it must not race a background save
+	knowledge_wait_save(kb);
+
+	// Merge the entries of each intent into the existing BST and rebalance
+	// it, building the intents at the same time
+	MERGE_JOB jobs[NUM_INTENTS];
+	int threads = loader_threads() / NUM_INTENTS;
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		jobs[i].kb = kb;
+		jobs[i].intent = i;
+		jobs[i].load = &load;
+		jobs[i].threads = threads > 1 ? threads : 1;
+		jobs[i].mem_error = false;
+	}
+	run_parallel(merge_into_tree, jobs, sizeof(MERGE_JOB), NUM_INTENTS);
+	kb->dirty = true;
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		cache_invalidate(kb->cache, i);
+	}
+
+	bool mem_error = false;
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		mem_error = mem_error || jobs[i].mem_error;
+	}
+
+	// Add the aliases, from the first read to the last (see merge_entries());
+	// aliases that are empty or stand for themselves are ignored
+	TRACE_BEGIN(aliases_span, "add_aliases");
+	for (int i = 0; i < NUM_INTENTS && !mem_error; i++)
+	{
+		KB_ENTRY **aliases = load.sorted[ALIAS_SECTION(i)];
+		for (int k = load.count[ALIAS_SECTION(i)] - 1; k >= 0 && !mem_error; k--)
+		{
+			bool known = kb->aliases[i] != NULL && hash_get(kb->aliases[i], aliases[k]->entity) != NULL;
+			if (kb->merge_policy == KB_MERGE_REPLACE || !known)
+			{
+				mem_error = add_alias(kb, i, aliases[k]->entity, aliases[k]->response) == KB_NOMEM;
+			}
+		}
+	}
+	TRACE_END(aliases_span);
+
+	// The responses are indexed again as they now are
+	if (kb->fulltext != NULL && !mem_error)
+	{
+		mem_error = knowledge_set_fulltext(kb, true) != KB_OK;
+	}
+
+	// The entries are no longer needed after merging
+	free_entries(&load);
+	TRACE_END(span);
+
+	if (mem_error)
+	{
+		return KB_NOMEM;
+	}
+
+	return count;
+}
+
+
+/* the trees of a knowledge base being freed by a background teardown */
+typedef struct teardown
+{
+	KB_NODE *root[NUM_INTENTS];
+} TEARDOWN;
+
+
+/*
+ * Background teardown thread: free the trees, then the teardown itself.
+ */
+static void *teardown_trees(void *arg) {
+
+	TEARDOWN *teardown = arg;
+
+	TRACE_BEGIN(span, "teardown_trees");
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		reset(teardown->root[i]);
+	}
+	free(teardown);
+	TRACE_END(span);
+
+	return NULL;
+}
+
+
+/*
+ * Reset the knowledge base, removing all known entities from all intents.
+ *
+ * The knowledge base is empty and usable as soon as this returns; the old
+ * trees are freed on a background thread, since freeing millions of nodes
+ * takes a while. If the thread cannot be started, they are freed before
+ * returning.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+void knowledge_reset(KNOWLEDGE_BASE *kb) {
+
+	TRACE_BEGIN(span, "knowledge_reset");
+
+	// Only one teardown at a time
+	knowledge_wait_teardown(kb);
+
+	TEARDOWN *teardown = malloc(sizeof(TEARDOWN));
+	bool empty = true;
+
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		if (kb->root[i] != NULL)
+		{
+			empty = false;
+			kb->dirty = true;
+		}
+		if (teardown != NULL)
+		{
+			teardown->root[i] = kb->root[i];
+		}
+		else
+		{
+			reset(kb->root[i]);
+		}
+		kb->root[i] = NULL;
+		kb->count[i] = 0;
+		kb->peak[i] = 0;
+		kb->text_bytes[i] = 0;
+		bloom_clear(&kb->filter[i]);
+		cache_invalidate(kb->cache, i);
+
+		// Nothing is left to hide either
+		reset(kb->forgotten[i]);
+		kb->forgotten[i] = NULL;
+		kb->tombstones[i] = 0;
+
+		// Nor to stand for
+		if (kb->aliases[i] != NULL)
+		{
+			kb->dirty = true;
+		}
+		hash_destroy(kb->aliases[i], free);
+		kb->aliases[i] = NULL;
+		hash_destroy(kb->normal[i], free);
+		kb->normal[i] = NULL;
+		kb->normal_bytes[i] = 0;
+
+		// Still indexed by sound, but with nothing in the index
+		if (kb->phonetic[i] != NULL)
+		{
+			phonetic_free(kb->phonetic[i]);
+			kb->phonetic[i] = phonetic_create();
+		}
+	}
+	kb->tombstone_bytes = 0;
+	kb->alias_bytes = 0;
+
+	// Still indexed, but with nothing in the index
+	if (kb->fulltext != NULL)
+	{
+		fulltext_free(kb->fulltext);
+		kb->fulltext = fulltext_create();
+	}
+
+	if (teardown == NULL)
+	{
+		TRACE_END(span);
+		return;
+	}
+	if (empty)
+	{
+		free(teardown);
+		TRACE_END(span);
+		return;
+	}
+
+	if (pthread_create(&kb->teardown_thread, NULL, teardown_trees, teardown) != 0)
+	{
+		teardown_trees(teardown);
+		TRACE_END(span);
+		return;
+	}
+	kb->tearing_down = true;
+	TRACE_END(span);
+}
+
+
+/*
+ * Wait for the trees dropped by knowledge_reset() to be freed, if they are
+ * still being freed.
+ *
+ * Input:
+ *   kb - the knowledge base
+ */
+void knowledge_wait_teardown(KNOWLEDGE_BASE *kb) {
+
+	if (kb->tearing_down)
+	{
+		pthread_join(kb->teardown_thread, NULL);
+		kb->tearing_down = false;
+	}
+}
+
+
+/*
+ * Write out the bytes in the output buffer of a knowledge file. The file is
+ * unbuffered, so each call is one large write.
+ *
+ * Input:
+ *   out  - the output buffer
+ */
+static void flush_bytes(WRITE_BUFFER *out) {
+
+	if (out->used > 0 && out->status == KB_OK && fwrite(out->data, 1, out->used, out->f) != out->used)
+	{
+		out->status = KB_INVALID;
+	}
+	out->used = 0;
+}
+
+
+/*
+ * Append bytes to a knowledge file being written, writing them out in blocks
+ * of WRITE_BLOCK bytes.
+ *
+ * Input:
+ *   out  - the output buffer
+ *   data - the bytes to append
+ *   n    - the number of bytes
+ */
+void write_bytes(WRITE_BUFFER *out, const char *data, size_t n) {
+
+	while (n > 0 && out->status == KB_OK)
+	{
+		size_t room = WRITE_BLOCK - out->used;
+		size_t take = n < room ? n : room;
+
+		memcpy(out->data + out->used, data, take);
+		out->used += take;
+		data += take;
+		n -= take;
+
+		if (out->used == WRITE_BLOCK)
+		{
+			flush_bytes(out);
+		}
+	}
+}
+
+
+/* numbers the temporary files of this process, so that no two writers share one */
+static atomic_uint temp_serial;
+
+
+/*
+ * Create the temporary file that a knowledge base is written to before it
+ * replaces <filename>. Each writer gets a temporary file of its own
+ * (<filename>.<pid>.<n>.tmp), so that two knowledge bases saved to the same
+ * file at once cannot write into, or rename, each other's.
+ *
+ * Input:
+ *   filename - the file being saved
+ *   f        - set to the temporary file
+ *   tmp      - set to the name of the temporary file
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if the file could not be created
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int open_temp(const char *filename, FILE **f, char **tmp) {
+
+	*tmp = malloc(strlen(filename) + 48);
+	if (*tmp == NULL)
+	{
+		return KB_NOMEM;
+	}
+	sprintf(*tmp, "%s.%ld.%u.tmp", filename, (long) process_id(), atomic_fetch_add(&temp_serial, 1));
+
+	*f = fopen(*tmp, "w");
+	if (*f == NULL)
+	{
+		free(*tmp);
+		return KB_INVALID;
+	}
+
+	// write_bytes() already writes in large blocks
+	setvbuf(*f, NULL, _IONBF, 0);
+	return KB_OK;
+}
+
+
+/*
+ * Finish writing the temporary file: flush it to disk, then rename it over
+ * <filename>, so that a crash part-way through a save leaves the previous
+ * version intact. If the write failed, the temporary file is removed instead.
+ *
+ * Input:
+ *   f        - the temporary file (closed afterwards)
+ *   tmp      - the name of the temporary file (freed afterwards)
+ *   filename - the file being saved
+ *   status   - the result of writing the temporary file
+ *
+ * Returns:
+ *   KB_OK, if <filename> was replaced
+ *   KB_INVALID, if the file could not be written or renamed
+ *   KB_NOMEM, if there was a memory allocation failure while writing
+ */
+static int commit_temp(FILE *f, char *tmp, const char *filename, int status) {
+
+	if (status == KB_OK && (fflush(f) != 0 || sync_file(f) != 0))
+	{
+		status = KB_INVALID;
+	}
+	if (fclose(f) != 0 && status == KB_OK)
+	{
+		status = KB_INVALID;
+	}
+
+	if (status == KB_OK && replace_file(tmp, filename) != 0)
+	{
+		status = KB_INVALID;
+	}
+	if (status != KB_OK)
+	{
+		remove(tmp);
+	}
+
+	free(tmp);
+	return status;
+}
+
+
+/* the heading of each intent's section of a knowledge file */
+static const char *const headings[NUM_INTENTS] = { "[what]\n", "\n[where]\n", "\n[who]\n" };
+static const char *const alias_headings[NUM_INTENTS] = { "\n[what aliases]\n", "\n[where aliases]\n", "\n[who aliases]\n" };
+
+
+/*
+ * Write the aliases of a stack of layers (see knowledge_alias()) as the
+ * "[<intent> aliases]" sections of a knowledge file, in a buffer. Each alias
+ * is written as the highest layer that has it defines it, unless that layer
+ * hides it. The sections are measured first, then written.
+ *
+ * Input:
+ *   kb       - the top layer
+ *
+ * Returns:
+ *   the sections (empty if there are no aliases), to be freed by the caller
+ *   NULL, if there was a memory allocation failure
+ */
+static char *alias_sections(KNOWLEDGE_BASE *kb) {
+
+	char *text = NULL;
+	size_t size = 0;
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		size_t used = 0;
+
+		for (int i = 0; i < NUM_INTENTS; i++)
+		{
+			bool heading = false;
+			for (KNOWLEDGE_BASE *layer = kb; layer != NULL; layer = layer->below)
+			{
+				HASH_TABLE *table = layer->aliases[i];
+				for (int b = 0; table != NULL && b < table->n_buckets; b++)
+				{
+					for (HASH_ENTRY *entry = table->buckets[b]; entry != NULL; entry = entry->next_ptr)
+					{
+						const char *entity = entry->value;
+						bool hidden = entity[0] == '\0';
+						for (KNOWLEDGE_BASE *above = kb; above != layer && !hidden; above = above->below)
+						{
+							hidden = above->aliases[i] != NULL && hash_get(above->aliases[i], entry->key) != NULL;
+						}
+						if (hidden)
+						{
+							continue;
+						}
+
+						if (!heading)
+						{
+							used += snprintf(text == NULL ? NULL : text + used, text == NULL ? 0 : size - used, "%s", alias_headings[i]);
+							heading = true;
+						}
+						used += snprintf(text == NULL ? NULL : text + used, text == NULL ? 0 : size - used, "%s=%s\n", entry->key, entity);
+					}
+				}
+			}
+		}
+
+		if (text == NULL)
+		{
+			size = used + 1;
+			text = malloc(size);
+			if (text == NULL)
+			{
+				return NULL;
+			}
+			text[0] = '\0';
+		}
+	}
+
+	return text;
+}
+
+
+/*
+ * Write a version of the knowledge base to a file.
+ *
+ * Input:
+ *   root     - the root of the BST for each intent
+ *   aliases  - the alias sections to write after them (see alias_sections()),
+ *              or NULL for none
+ *   f        - the file (left open)
+ *   counters - write each entity's access counter instead of its response
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if the file could not be written
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int write_roots(KB_NODE *root[NUM_INTENTS], const char *aliases, FILE *f, bool counters) {
+
+	WRITE_BUFFER out = { f, malloc(WRITE_BLOCK), 0, KB_OK };
+
+	if (out.data == NULL)
+	{
+		return KB_NOMEM;
+	}
+
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		write_bytes(&out, headings[i], strlen(headings[i]));
+		reverse_in_order_write(root[i], &out, counters);
+	}
+	if (aliases != NULL)
+	{
+		write_bytes(&out, aliases, strlen(aliases));
+	}
+	flush_bytes(&out);
+
+	free(out.data);
+	return out.status;
+}
+
+
+/*
+ * Write a stack of layers (see knowledge_create_overlay()) as one knowledge
+ * file, in the same order as write_roots(). The BSTs of each intent, and
+ * their tombstones, are walked together in descending order; each entity is
+ * written as the highest layer that knows it has it, unless that layer has
+ * forgotten it.
+ *
+ * Input:
+ *   kb       - the top layer
+ *   aliases  - the alias sections to write after the BSTs, or NULL for none
+ *   f        - the file
+ *   counters - write each entity's access counter instead of its response
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int write_layers(KNOWLEDGE_BASE *kb, const char *aliases, FILE *f, bool counters) {
+
+	int layers = 0;
+	for (KNOWLEDGE_BASE *layer = kb; layer != NULL; layer = layer->below)
+	{
+		layers++;
+	}
+
+	// A cursor on the BST of each layer, then one on its tombstones
+	TREE_CURSOR *cursors = calloc(2 * layers, sizeof(TREE_CURSOR));
+	KB_NODE **next = calloc(2 * layers, sizeof(KB_NODE *));
+	WRITE_BUFFER out = { f, malloc(WRITE_BLOCK), 0, KB_OK };
+
+	if (cursors == NULL || next == NULL || out.data == NULL)
+	{
+		free(cursors);
+		free(next);
+		free(out.data);
+		return KB_NOMEM;
+	}
+
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		write_bytes(&out, headings[i], strlen(headings[i]));
+
+		int c = 0;
+		for (KNOWLEDGE_BASE *layer = kb; layer != NULL; layer = layer->below)
+		{
+			cursor_open(&cursors[c], layer->root[i]);
+			next[c] = cursor_next(&cursors[c]);
+			c++;
+			cursor_open(&cursors[c], layer->forgotten[i]);
+			next[c] = cursor_next(&cursors[c]);
+			c++;
+		}
+
+		while (out.status == KB_OK)
+		{
+			// The greatest entity left (the highest layer's, if it is repeated)
+			int top = -1;
+			for (c = 0; c < 2 * layers; c++)
+			{
+				if (next[c] != NULL && (top < 0 || compare_token(next[c]->entity, next[top]->entity) > 0))
+				{
+					top = c;
+				}
+			}
+			if (top < 0)
+			{
+				break;
+			}
+
+			// Written, unless it is a tombstone; either way, the layers below
+			// are not asked about it
+			KB_NODE *node = next[top];
+			if (top % 2 == 0)
+			{
+				write_node(&out, node, counters);
+			}
+			for (c = 0; c < 2 * layers; c++)
+			{
+				if (c != top && next[c] != NULL && compare_token(next[c]->entity, node->entity) == 0)
+				{
+					next[c] = cursor_next(&cursors[c]);
+				}
+			}
+			next[top] = cursor_next(&cursors[top]);
+		}
+
+		for (c = 0; c < 2 * layers; c++)
+		{
+			if (cursors[c].failed)
+			{
+				out.status = KB_NOMEM;
+			}
+			cursor_close(&cursors[c]);
+		}
+	}
+	if (aliases != NULL)
+	{
+		write_bytes(&out, aliases, strlen(aliases));
+	}
+	flush_bytes(&out);
+
+	free(cursors);
+	free(next);
+	free(out.data);
+	return out.status;
+}
+
+
+/*
+ * Write the knowledge base to a file. It is written to <filename>.tmp first,
+ * which then replaces the file, so the file is never left half-written. An
+ * overlay is written together with the layers below it (see write_layers()).
+ *
+ * Input:
+ *   kb       - the knowledge base
+ *   filename - the file
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if the file could not be written
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int knowledge_write(KNOWLEDGE_BASE *kb, const char *filename) {
+
+	FILE *f;
+	char *tmp;
+
+	// A background save may be writing the same file
+	knowledge_wait_save(kb);
+
+	TRACE_BEGIN(span, "knowledge_write");
+
+	int status = open_temp(filename, &f, &tmp);
+	if (status != KB_OK)
+	{
+		TRACE_END(span);
+		return status;
+	}
+
+	char *aliases = alias_sections(kb);
+	if (aliases == NULL)
+	{
+		status = KB_NOMEM;
+	}
+	else
+	{
+		status = kb->below == NULL ? write_roots(kb->root, aliases, f, false) : write_layers(kb, aliases, f, false);
+	}
+	free(aliases);
+	status = commit_temp(f, tmp, filename, status);
+
+	TRACE_END(span);
+	return status;
+}
+
+
+/*
+ * Write how often each entity has answered a question to a file, in the same
+ * format as a knowledge file (<entity>=<hits> under each intent's heading).
+ * Under LAYOUT_WEIGHTED the counters are halved at each rebuild, so they
+ * favour recent questions.
+ *
+ * Input:
+ *   kb       - the knowledge base
+ *   filename - the file
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if the file could not be written
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int knowledge_write_counters(KNOWLEDGE_BASE *kb, const char *filename) {
+
+	FILE *f;
+	char *tmp;
+
+	knowledge_wait_save(kb);
+
+	int status = open_temp(filename, &f, &tmp);
+	if (status != KB_OK)
+	{
+		return status;
+	}
+
+	status = kb->below == NULL ? write_roots(kb->root, NULL, f, true) : write_layers(kb, NULL, f, true);
+	return commit_temp(f, tmp, filename, status);
+}
+
+
+/* a snapshot of a knowledge base being written by a background save */
+typedef struct snapshot
+{
+	KB_NODE *root[NUM_INTENTS];
+	char *aliases;
+	FILE *f;
+	char *tmp;
+	char *filename;
+	atomic_bool *done;
+} SNAPSHOT;
+
+
+/*
+ * Background save thread: write the snapshot, then release it.
+ *
+ * Returns:
+ *   the result of the save (see knowledge_wait_save())
+ */
+static void *save_snapshot(void *arg) {
+
+	SNAPSHOT *snapshot = arg;
+
+	TRACE_BEGIN(span, "save_snapshot");
+	int status = commit_temp(snapshot->f, snapshot->tmp, snapshot->filename, write_roots(snapshot->root, snapshot->aliases, snapshot->f, false));
+
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		release_node(snapshot->root[i]);
+	}
+	atomic_bool *done = snapshot->done;
+	free(snapshot->aliases);
+	free(snapshot->filename);
+	free(snapshot);
+	TRACE_END(span);
+
+	atomic_store(done, true);
+
+	return (void *) (intptr_t) status;
+}
+
+
+/*
+ * Write the knowledge base to a file in the background. The current version
+ * of each BST is snapshotted in O(1) time by taking a reference to its root;
+ * the trees are persistent (see insert()), so knowledge_put() can carry on
+ * learning while the snapshot is written. Each node of the snapshot that has
+ * since been replaced is freed once the write finishes. The aliases are few,
+ * so they are simply written out into the snapshot.
+ *
+ * The temporary file is created before returning, so that a file that cannot
+ * be written is reported straight away; knowledge_wait_save() and
+ * knowledge_save_status() report how the rest of the save went. If the background thread cannot be started, the
+ * knowledge base is written before returning.
+ *
+ * Input:
+ *   kb       - the knowledge base
+ *   filename - the file
+ *
+ * Returns:
+ *   KB_OK, if the save was started
+ *   KB_INVALID, if the file could not be written
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int knowledge_write_async(KNOWLEDGE_BASE *kb, const char *filename) {
+
+	// Only one save at a time
+	knowledge_wait_save(kb);
+
+	// The layers below are not this knowledge base's to snapshot (and can
+	// change in place), so a stack of layers is flattened straight away
+	if (kb->below != NULL)
+	{
+		return knowledge_write(kb, filename);
+	}
+
+	SNAPSHOT *snapshot = malloc(sizeof(SNAPSHOT));
+	char *name = malloc(strlen(filename) + 1);
+	char *aliases = alias_sections(kb);
+	if (snapshot == NULL || name == NULL || aliases == NULL)
+	{
+		free(snapshot);
+		free(name);
+		free(aliases);
+		return knowledge_write(kb, filename);
+	}
+	strcpy(name, filename);
+
+	int status = open_temp(filename, &snapshot->f, &snapshot->tmp);
+	if (status != KB_OK)
+	{
+		free(snapshot);
+		free(name);
+		free(aliases);
+		return status;
+	}
+	snapshot->filename = name;
+	snapshot->aliases = aliases;
+	snapshot->done = &kb->save_done;
+	atomic_store(&kb->save_done, false);
+
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		snapshot->root[i] = kb->root[i];
+		retain_node(snapshot->root[i]);
+	}
+
+	if (pthread_create(&kb->save_thread, NULL, save_snapshot, snapshot) != 0)
+	{
+		return (int) (intptr_t) save_snapshot(snapshot);
+	}
+	kb->saving = true;
+
+	return KB_OK;
+}
+
+
+/*
+ * Wait for a background save of the knowledge base to finish, if there is one.
+ * A failed save is also kept for knowledge_save_status(), since whatever
+ * waited for it is usually about to do something else.
+ *
+ * Input:
+ *   kb - the knowledge base
+ *
+ * Returns:
+ *   the result of the background save (see knowledge_write()), or KB_OK if
+ *   there was none
+ */
+int knowledge_wait_save(KNOWLEDGE_BASE *kb) {
+
+	void *status = (void *) (intptr_t) KB_OK;
+
+	if (kb->saving)
+	{
+		pthread_join(kb->save_thread, &status);
+		kb->saving = false;
+		if (kb->save_status == KB_OK)
+		{
+			kb->save_status = (int) (intptr_t) status;
+		}
+	}
+	return (int) (intptr_t) status;
+}
+
+
+/*
+ * Find out whether a background save of the knowledge base has failed since
+ * this was last asked. A save that is still running is waited for only if
+ * 'wait' is set; otherwise it is reported once it has finished.
+ *
+ * Input:
+ *   kb   - the knowledge base
+ *   wait - whether to wait for a save that is still running
+ *
+ * Returns:
+ *   KB_OK, if no background save has failed (or one is still running)
+ *   KB_INVALID, if a save could not write or rename the file
+ *   KB_NOMEM, if a save ran out of memory
+ */
+int knowledge_save_status(KNOWLEDGE_BASE *kb, bool wait) {
+
+	if (kb->saving && (wait || atomic_load(&kb->save_done)))
+	{
+		knowledge_wait_save(kb);
+	}
+
+	int status = kb->save_status;
+	kb->save_status = KB_OK;
+	return status;
+}
+
+
+/*
+ * Set how knowledge_read() resolves an entity that is already known, or that
+ * is defined more than once in the file.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   policy - KB_MERGE_REPLACE (the last definition wins) or
+ *            KB_MERGE_KEEP (the first definition wins)
+ */
+void knowledge_set_merge_policy(KNOWLEDGE_BASE *kb, int policy) {
+	kb->merge_policy = policy;
+}
+
+
+/*
+ * Set how the BSTs are laid out as questions are asked.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   layout - LAYOUT_STATIC (left as loaded), LAYOUT_WEIGHTED (rebuilt every
+ *            LAYOUT_PERIOD questions so that often-asked entities are near
+ *            the root) or LAYOUT_SPLAY (each entity asked about is moved to
+ *            the root)
+ */
+void knowledge_set_layout(KNOWLEDGE_BASE *kb, int layout) {
+
+	kb->layout = layout;
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		kb->asked[i] = 0;
+	}
+}
+
+
+/*
+ * Set how unbalanced a BST may become through learning before knowledge_put()
+ * rebalances it. With 0, knowledge_forget() also leaves a BST that has shrunk
+ * as deep as it was.
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   factor - rebalance when a BST is more than <factor> times the height of
+ *            a balanced BST with as many nodes, or 0 to never rebalance
+ */
+void knowledge_set_rebalance(KNOWLEDGE_BASE *kb, double factor) {
+	kb->rebalance_factor = factor;
+}
+
+
+/*
+ * Set whether knowledge_get() suggests the closest match for an entity that
+ * is not known. Without it, unknown entities that the Bloom filter rules out
+ * are not searched for at all.
+ *
+ * Input:
+ *   kb    - the knowledge base
+ *   fuzzy - true to suggest closest matches, false to only answer exact ones
+ */
+void knowledge_set_fuzzy(KNOWLEDGE_BASE *kb, bool fuzzy) {
+
+	kb->fuzzy = fuzzy;
+
+	// Cached answers depend on whether closest matches were looked for
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		cache_invalidate(kb->cache, i);
+	}
+}
+
+
+/*
+ * Set how an entity that is not known as asked is normalized to look for it
+ * again (e.g. "ICT cluster" for "the ICT Cluster"). Each entity whose
+ * normalized key differs from it is indexed by the key when it is learned,
+ * so a normalized question is answered in O(1) time (or O(log n), if it is
+ * its own key) rather than by a search for its closest match.
+ *
+ * Input:
+ *   kb    - the knowledge base
+ *   steps - the steps of normalize_entity() (NORMALIZE_WHITESPACE,
+ *           NORMALIZE_PUNCTUATION and/or NORMALIZE_ARTICLES), or 0 for none
+ */
+void knowledge_set_normalize(KNOWLEDGE_BASE *kb, int steps) {
+
+	kb->normalize = steps;
+
+	// The keys have changed, and so may the answers
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		index_tree(kb, i);
+		cache_invalidate(kb->cache, i);
+	}
+}
+
+
+/*
+ * Set whether the words of the responses are indexed, so that
+ * knowledge_search() can find the answers that mention them. Turning it on
+ * indexes every response known; after that, the index is rebuilt by
+ * knowledge_read() and kept up to date by knowledge_put() and
+ * knowledge_forget().
+ *
+ * Input:
+ *   kb    - the knowledge base
+ *   on    - true to index the responses, false to drop the index
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure (the responses are
+ *     then not indexed)
+ */
+int knowledge_set_fulltext(KNOWLEDGE_BASE *kb, bool on) {
+
+	fulltext_free(kb->fulltext);
+	kb->fulltext = NULL;
+	if (!on)
+	{
+		return KB_OK;
+	}
+
+	kb->fulltext = fulltext_create();
+	int status = kb->fulltext == NULL ? KB_NOMEM : index_responses(kb);
+	if (status != KB_OK)
+	{
+		fulltext_free(kb->fulltext);
+		kb->fulltext = NULL;
+	}
+	return status;
+}
+
+
+/*
+ * Set whether the entities of an intent are indexed by how they sound (see
+ * phonetic.c), so that a misspelt name ("Frank Gwan") is offered the names
+ * that sound like it, best first, before its closest match by ASCII
+ * difference. It is meant for names, i.e. WHO. Turning it on indexes every
+ * entity of the intent; after that, the index is rebuilt by knowledge_read()
+ * and kept up to date by knowledge_put() and knowledge_forget().
+ *
+ * Input:
+ *   kb     - the knowledge base
+ *   intent - the question word
+ *   on     - true to index the entities, false to drop the index
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ *   KB_NOMEM, if there was a memory allocation failure (the entities are
+ *     then not indexed)
+ */
+int knowledge_set_phonetic(KNOWLEDGE_BASE *kb, const char *intent, bool on) {
+
+	int i = get_intent(intent);
+	if (i < 0)
+	{
+		return KB_INVALID;
+	}
+
+	// Cached answers depend on whether names that sound alike were offered
+	cache_invalidate(kb->cache, i);
+
+	int status = on ? index_sounds(kb, i) : KB_OK;
+	if (!on || status != KB_OK)
+	{
+		phonetic_free(kb->phonetic[i]);
+		kb->phonetic[i] = NULL;
+	}
+	return status;
+}
+
+
+/*
+ * Set the layer that a knowledge base overlays (see knowledge_create_overlay()).
+ * Its tombstones, if any, hide the same entities in the new layer.
+ *
+ * Input:
+ *   kb    - the knowledge base
+ *   below - the knowledge base to overlay (NULL for none)
+ */
+void knowledge_set_below(KNOWLEDGE_BASE *kb, KNOWLEDGE_BASE *below) {
+
+	kb->below = below;
+
+	// Cached answers may have come from the old layer
+	for (int i = 0; i < NUM_INTENTS; i++)
+	{
+		cache_invalidate(kb->cache, i);
+	}
 }
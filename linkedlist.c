@@ -77,7 +77,8 @@ int insert_to_list(LIST_NODE **head, const char *entity, const char *response) {
 }
 
 /*
- * Convert the linked list into a balanced BST
+ * Convert the linked list into a balanced BST. Knowledge files are no longer
+ * read into a list (see loader.c), so only linkedlist_tests() uses this.
  * 
  * Input:
  *   n              - the size of the linked list
@@ -98,14 +99,30 @@ KB_NODE *convert_to_balanced_bst(LIST_NODE **head, int n, bool *mem_error) {
     
     // Create the root node
     KB_NODE *root = create_new_node((*head)->entity, (*head)->response);
-    if (root == NULL)
-    {
-        *mem_error = true;
-    }
 
     // Move to next node in the linked list
     // Note that
     *head = (*head)->next_ptr;
+
+    // Memory allocation failure (leave the entity out, and hang the right
+    // subtree below the largest node of the left one)
+    if (root == NULL)
+    {
+        *mem_error = true;
+        KB_NODE *right_subtree = convert_to_balanced_bst(head, n - n/2 - 1, mem_error);
+        if (left_subtree == NULL)
+        {
+            return right_subtree;
+        }
+
+        KB_NODE *largest = left_subtree;
+        while (largest->right_child != NULL)
+        {
+            largest = largest->right_child;
+        }
+        largest->right_child = right_subtree;
+        return left_subtree;
+    }
     
     // Set left child
     root->left_child = left_subtree;
@@ -0,0 +1,1015 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the parallel loader used by knowledge_read(). The file
+ * is read in large blocks and split at line boundaries into one chunk per
+ * processor. Worker threads then parse and sort their chunks, and the sorted
+ * runs of each intent are merged into a single sorted array, ready to be
+ * merged into the BST. Each intent's merge is split at sampled entries into
+ * parts that are merged on separate threads, so that a file that is nearly
+ * all one intent is merged in parallel too. The aliases of each intent (see
+ * knowledge_alias()) are parsed, sorted and merged in the same way.
+ *
+ * Since a section can span several chunks, parsing takes two passes: a quick
+ * pass that finds the last section heading in each chunk, so that the section
+ * in force at the start of every chunk is known, and then the parse itself.
+ *
+ * load_entries() reads, parses and sorts the entries in a file.
+ * free_entries() frees the entries once they have been merged.
+ * merge_entries() merges sorted entries with the nodes of an existing BST.
+ * build_balanced_bst() builds a balanced BST from the merged entries, in parallel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "chat1002.h"
+
+/* the section in force is not a recognised intent, so its lines are ignored */
+#define SECTION_INVALID    -1
+
+/* no section heading has been seen in the chunk */
+#define SECTION_UNSET      -2
+
+/* a chunk of the file, parsed by one worker */
+typedef struct chunk
+{
+    char *start;                        // first character of the chunk
+    char *end;                          // one past the last character of the chunk
+    int first_section;                  // the section in force at the start of the chunk
+    int last_section;                   // the last section heading in the chunk, or SECTION_UNSET
+    KB_ENTRY *entries[NUM_SECTIONS];    // the entries of each section, sorted
+    int count[NUM_SECTIONS];            // the number of entries of each section
+    int capacity[NUM_SECTIONS];         // the allocated size of entries
+    bool mem_error;                     // set if there was a memory allocation failure
+} CHUNK;
+
+/* the work of merging part of one section's sorted runs: the entries
+   from[c]..to[c] of each chunk c, which are all greater than the entries of
+   the parts before */
+typedef struct merge_job
+{
+    KB_LOAD *load;
+    int section;
+    int from[LOADER_MAX_THREADS];       // the first entry of each run in the part
+    int to[LOADER_MAX_THREADS];         // one past the last entry of each run in the part
+    int out;                            // where the part starts in the merged array
+} MERGE_JOB;
+
+/*
+ * Get the number of worker threads to use.
+ */
+int loader_threads()
+{
+    long n = 1;
+
+#if defined(KB_ALLOC_TRACKING)
+    // One thread, so that allocations happen in the same order on every run
+    n = 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    if (n < 1)
+    {
+        n = 1;
+    }
+    if (n > LOADER_MAX_THREADS)
+    {
+        n = LOADER_MAX_THREADS;
+    }
+    return (int) n;
+}
+
+/*
+ * Run <fn> on each of <n> jobs at once, one thread per job. The first job runs
+ * on the calling thread, as does any job whose thread cannot be started.
+ *
+ * Input:
+ *   fn         - the function to run on each job
+ *   jobs       - an array of <n> jobs
+ *   size       - the size of each job
+ *   n          - the number of jobs
+ */
+void run_parallel(void *(*fn)(void *), void *jobs, size_t size, int n)
+{
+#ifdef KB_ALLOC_TRACKING
+    // Run every job on this thread, so that allocations happen in the same
+    // order on every run (see alloc_fail())
+    for (int i = 0; i < n; i++)
+    {
+        fn((char *) jobs + i * size);
+    }
+#else
+    pthread_t threads[LOADER_MAX_THREADS];
+    bool started[LOADER_MAX_THREADS];
+
+    for (int i = 1; i < n; i++)
+    {
+        started[i] = pthread_create(&threads[i], NULL, fn, (char *) jobs + i * size) == 0;
+    }
+
+    fn(jobs);
+
+    for (int i = 1; i < n; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+        else
+        {
+            fn((char *) jobs + i * size);
+        }
+    }
+#endif
+}
+
+/*
+ * Read the whole of a file into memory. The buffer is sized from the length
+ * of the file, so a file is read without copying; only if the length is not
+ * known (or the file grows meanwhile) is it read in blocks that double in
+ * size. There is always room for a '\0' after the last character.
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int read_file(FILE *f, char **buffer, size_t *size)
+{
+    size_t capacity = LOADER_BLOCK;
+    size_t length = 0;
+    size_t got;
+    struct stat st;
+
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        capacity = (size_t) st.st_size + 1;
+    }
+
+    char *data = malloc(capacity);
+
+    if (data == NULL)
+    {
+        return KB_NOMEM;
+    }
+
+    while ((got = fread(data + length, 1, capacity - length, f)) > 0)
+    {
+        length += got;
+        if (length == capacity)
+        {
+            char *bigger = realloc(data, capacity * 2);
+            if (bigger == NULL)
+            {
+                free(data);
+                return KB_NOMEM;
+            }
+            data = bigger;
+            capacity *= 2;
+        }
+    }
+
+    // The entries point into the buffer for as long as the load lasts, so give
+    // back any unused capacity (keeping one byte to terminate the last line)
+    if (capacity > length + 1)
+    {
+        char *fitted = realloc(data, length + 1);
+        if (fitted != NULL)
+        {
+            data = fitted;
+        }
+    }
+
+    *buffer = data;
+    *size = length;
+    return KB_OK;
+}
+
+/*
+ * Get the end of the line starting at <line>, ignoring "\r" and anything after
+ * it, as knowledge_read() always has.
+ *
+ * Input:
+ *   line       - the start of the line
+ *   end        - the end of the chunk
+ *   next       - set to the start of the next line
+ *
+ * Returns:
+ *   the end of the line's content
+ */
+static const char *line_end(const char *line, const char *end, const char **next)
+{
+    const char *nl = memchr(line, '\n', end - line);
+
+    *next = nl == NULL ? end : nl + 1;
+    if (nl == NULL)
+    {
+        nl = end;
+    }
+
+    const char *cr = memchr(line, '\r', nl - line);
+    return cr == NULL ? nl : cr;
+}
+
+/*
+ * Determine whether a line is a section heading, and if so which section:
+ * "[<intent>]" for the entities of an intent, or "[<intent> aliases]" for
+ * its aliases (see knowledge_alias()).
+ *
+ * Returns:
+ *   true, if the line is a section heading (and <section> is set)
+ *   false, otherwise
+ */
+static bool parse_heading(const char *line, const char *end, int *section)
+{
+    if (end - line < 2 || line[0] != '[' || end[-1] != ']')
+    {
+        return false;
+    }
+
+    // The longest intent is WHERE, which is 5 characters long
+    char section_name[6];
+    int length = 0;
+    const char *c = line + 1;
+    for (; c < end && *c != ']' && *c != ' ' && length < 5; c++)
+    {
+        section_name[length++] = *c;
+    }
+    section_name[length] = '\0';
+
+    // The rest of the heading is "]", or " aliases]"
+    char suffix[10];
+    int rest = (int) (end - c);
+    if (rest < (int) sizeof(suffix))
+    {
+        memcpy(suffix, c, rest);
+        suffix[rest] = '\0';
+    }
+
+    *section = get_intent(section_name);
+    if (*section >= 0 && rest < (int) sizeof(suffix) && compare_token(suffix, " aliases]") == 0)
+    {
+        *section = ALIAS_SECTION(*section);
+    }
+    else if (*section < 0 || rest != 1)
+    {
+        *section = SECTION_INVALID;
+    }
+    return true;
+}
+
+/*
+ * First pass over a chunk: find the last section heading in it.
+ */
+static void *find_sections(void *arg)
+{
+    CHUNK *chunk = arg;
+    const char *line = chunk->start;
+    const char *next;
+    int section;
+
+    TRACE_BEGIN(span, "find_sections");
+
+    chunk->last_section = SECTION_UNSET;
+    while (line < chunk->end)
+    {
+        const char *end = line_end(line, chunk->end, &next);
+        if (parse_heading(line, end, &section))
+        {
+            chunk->last_section = section;
+        }
+        line = next;
+    }
+
+    TRACE_END(span);
+    return NULL;
+}
+
+/*
+ * Order entries by entity. Equal entities are ordered from the last read to
+ * the first read, as insert_to_list() orders them; since the entities point
+ * into the file buffer, the later line is the one at the higher address.
+ */
+static int compare_entries(const void *a, const void *b)
+{
+    const KB_ENTRY *entry1 = a;
+    const KB_ENTRY *entry2 = b;
+    int cmp = compare_token(entry1->entity, entry2->entity);
+
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    return entry1->entity < entry2->entity ? 1 : entry1->entity > entry2->entity ? -1 : 0;
+}
+
+/*
+ * Append an entry to a section of a chunk.
+ *
+ * Returns:
+ *   the new entry, if successful
+ *   NULL, if there was a memory allocation failure
+ */
+static KB_ENTRY *add_entry(CHUNK *chunk, int section)
+{
+    if (chunk->count[section] == chunk->capacity[section])
+    {
+        int capacity = chunk->capacity[section] == 0 ? 64 : chunk->capacity[section] * 2;
+        KB_ENTRY *entries = realloc(chunk->entries[section], capacity * sizeof(KB_ENTRY));
+
+        if (entries == NULL)
+        {
+            return NULL;
+        }
+        chunk->entries[section] = entries;
+        chunk->capacity[section] = capacity;
+    }
+    return &chunk->entries[section][chunk->count[section]++];
+}
+
+/*
+ * Second pass over a chunk: parse its entries, then sort those of each section.
+ */
+static void *parse_chunk(void *arg)
+{
+    CHUNK *chunk = arg;
+    const char *line = chunk->start;
+    const char *next;
+    int section = chunk->first_section;
+
+    TRACE_BEGIN(span, "parse_chunk");
+
+    while (line < chunk->end && !chunk->mem_error)
+    {
+        const char *end = line_end(line, chunk->end, &next);
+        const char *equals;
+
+        // Section heading (lines in unrecognised sections are ignored)
+        if (parse_heading(line, end, &section) || section < 0)
+        {
+            line = next;
+            continue;
+        }
+
+        // Lines that do not contain '=' are ignored; leading '='s are skipped
+        while (line < end && *line == '=')
+        {
+            line++;
+        }
+        equals = memchr(line, '=', end - line);
+        if (line == end || equals == NULL)
+        {
+            line = next;
+            continue;
+        }
+
+        KB_ENTRY *entry = add_entry(chunk, section);
+        if (entry == NULL)
+        {
+            chunk->mem_error = true;
+            break;
+        }
+
+        // Terminate the entity at '=' and the response at the end of the line,
+        // truncating them to fit in a node, so they can be used in place
+        char *entity = (char *) line;
+        char *response = (char *) equals + 1;
+
+        entity[equals - line < MAX_ENTITY ? equals - line : MAX_ENTITY - 1] = '\0';
+        response[end - response < MAX_RESPONSE ? end - response : MAX_RESPONSE - 1] = '\0';
+
+        entry->entity = entity;
+        entry->response = response;
+
+        line = next;
+    }
+
+    for (int i = 0; i < NUM_SECTIONS; i++)
+    {
+        if (chunk->count[i] > 0)
+        {
+            qsort(chunk->entries[i], chunk->count[i], sizeof(KB_ENTRY), compare_entries);
+        }
+    }
+
+    TRACE_END(span);
+    return NULL;
+}
+
+/*
+ * Order pointers to entries as compare_entries() orders the entries.
+ */
+static int compare_entry_pointers(const void *a, const void *b)
+{
+    return compare_entries(*(const KB_ENTRY * const *) a, *(const KB_ENTRY * const *) b);
+}
+
+/*
+ * Get where an entry would go in a sorted run: the number of entries of the
+ * run that come before it.
+ */
+static int lower_bound(const KB_ENTRY *run, int n, const KB_ENTRY *entry)
+{
+    int low = 0;
+    int high = n;
+
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (compare_entries(&run[mid], entry) < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/*
+ * Split the merge of one section's runs into <parts> parts of about the same
+ * size, by regular sampling: each run offers LOADER_SAMPLES entries per part,
+ * evenly spaced, and the samples at each multiple of the number of samples
+ * per part split the section. Each split falls at the same entry in every run
+ * (compare_entries() puts no two entries level), so the parts can be merged
+ * independently, each into its own stretch of the merged array.
+ *
+ * Input:
+ *   load       - the loaded entries
+ *   section    - the section
+ *   parts      - the number of parts (at least 1)
+ *   jobs       - receives the <parts> jobs
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int split_merge(KB_LOAD *load, int section, int parts, MERGE_JOB *jobs)
+{
+    CHUNK *chunks = load->chunks;
+    int n_chunks = load->n_chunks;
+    const KB_ENTRY **samples = NULL;
+    int n_samples = 0;
+
+    if (parts > 1)
+    {
+        samples = malloc((size_t) n_chunks * parts * LOADER_SAMPLES * sizeof(KB_ENTRY *));
+        if (samples == NULL)
+        {
+            return KB_NOMEM;
+        }
+
+        for (int c = 0; c < n_chunks; c++)
+        {
+            int count = chunks[c].count[section];
+            for (int k = 0; k < parts * LOADER_SAMPLES && count > 0; k++)
+            {
+                samples[n_samples++] = &chunks[c].entries[section][(long long) k * count / (parts * LOADER_SAMPLES)];
+            }
+        }
+        qsort(samples, n_samples, sizeof(KB_ENTRY *), compare_entry_pointers);
+    }
+
+    int out = 0;
+    for (int p = 0; p < parts; p++)
+    {
+        jobs[p].load = load;
+        jobs[p].section = section;
+        jobs[p].out = out;
+        for (int c = 0; c < n_chunks; c++)
+        {
+            int count = chunks[c].count[section];
+            jobs[p].from[c] = p == 0 ? 0 : jobs[p - 1].to[c];
+            jobs[p].to[c] = p == parts - 1 ? count :
+                lower_bound(chunks[c].entries[section], count, samples[(long long) (p + 1) * n_samples / parts]);
+            out += jobs[p].to[c] - jobs[p].from[c];
+        }
+    }
+
+    free(samples);
+    return KB_OK;
+}
+
+/*
+ * Restore the order of a heap of runs (see merge_runs()) below <k>, after the
+ * next entry of the run at <k> has changed.
+ */
+static void sift_down(int *heap, int n, int k, CHUNK *chunks, int section, const int *pos)
+{
+    for (;;)
+    {
+        int least = k;
+        for (int child = 2 * k + 1; child <= 2 * k + 2 && child < n; child++)
+        {
+            if (compare_entries(&chunks[heap[child]].entries[section][pos[heap[child]]],
+                &chunks[heap[least]].entries[section][pos[heap[least]]]) < 0)
+            {
+                least = child;
+            }
+        }
+        if (least == k)
+        {
+            return;
+        }
+
+        int run = heap[k];
+        heap[k] = heap[least];
+        heap[least] = run;
+        k = least;
+    }
+}
+
+/*
+ * Merge one part of a section's sorted runs (one from each chunk; see
+ * split_merge()) into its stretch of the section's array of pointers to the
+ * entries. The runs are kept in a heap by their next entry, so each entry
+ * takes O(log <chunks>) comparisons.
+ */
+static void *merge_runs(void *arg)
+{
+    MERGE_JOB *job = arg;
+    KB_LOAD *load = job->load;
+    CHUNK *chunks = load->chunks;
+    int section = job->section;
+    KB_ENTRY **out = load->sorted[section] + job->out;
+    int pos[LOADER_MAX_THREADS];
+    int heap[LOADER_MAX_THREADS];
+    int n = 0;
+
+    TRACE_BEGIN(span, "merge_runs");
+
+    for (int c = 0; c < load->n_chunks; c++)
+    {
+        pos[c] = job->from[c];
+        if (pos[c] < job->to[c])
+        {
+            heap[n++] = c;
+        }
+    }
+    for (int k = n / 2 - 1; k >= 0; k--)
+    {
+        sift_down(heap, n, k, chunks, section, pos);
+    }
+
+    // Repeatedly take the smallest next entry of the runs
+    while (n > 0)
+    {
+        int c = heap[0];
+        *out++ = &chunks[c].entries[section][pos[c]++];
+        if (pos[c] == job->to[c])
+        {
+            heap[0] = heap[--n];
+        }
+        sift_down(heap, n, 0, chunks, section, pos);
+    }
+
+    TRACE_END(span);
+    return NULL;
+}
+
+/*
+ * Free everything allocated by load_entries(), including the file buffer
+ * the entries point into.
+ *
+ * Input:
+ *   load       - the loaded entries
+ */
+void free_entries(KB_LOAD *load)
+{
+    for (int c = 0; c < load->n_chunks; c++)
+    {
+        for (int i = 0; i < NUM_SECTIONS; i++)
+        {
+            free(load->chunks[c].entries[i]);
+        }
+    }
+    for (int i = 0; i < NUM_SECTIONS; i++)
+    {
+        free(load->sorted[i]);
+        load->sorted[i] = NULL;
+        load->count[i] = 0;
+    }
+    free(load->chunks);
+    free(load->buffer);
+    load->chunks = NULL;
+    load->buffer = NULL;
+    load->n_chunks = 0;
+}
+
+/*
+ * Read the entity/response pairs (and aliases) in a knowledge file, and sort
+ * those of each section. The file is closed afterwards.
+ *
+ * The file is read into one buffer and the entries point into it, so the only
+ * other memory needed is two pointers per entry; nothing is copied until the
+ * nodes of the BST are created.
+ *
+ * Input:
+ *   f          - the file
+ *   load       - receives the sorted entries of each section; free them with
+ *                free_entries()
+ *
+ * Returns:
+ *   the number of entity/response pairs read from the file (not counting
+ *   aliases),
+ *   or KB_NOMEM if there was a memory allocation failure
+ */
+int load_entries(FILE *f, KB_LOAD *load)
+{
+    char *buffer;
+    size_t size;
+
+    memset(load, 0, sizeof(KB_LOAD));
+
+    TRACE_BEGIN(span, "read_file");
+    int status = read_file(f, &buffer, &size);
+    fclose(f);
+    TRACE_END(span);
+    if (status != KB_OK)
+    {
+        return status;
+    }
+
+    // One chunk per thread, but no chunk smaller than LOADER_MIN_CHUNK
+    int n_chunks = loader_threads();
+    if ((size_t) n_chunks > size / LOADER_MIN_CHUNK)
+    {
+        n_chunks = (int) (size / LOADER_MIN_CHUNK);
+    }
+    if (n_chunks < 1)
+    {
+        n_chunks = 1;
+    }
+
+    load->buffer = buffer;
+    load->chunks = calloc(n_chunks, sizeof(CHUNK));
+    if (load->chunks == NULL)
+    {
+        free_entries(load);
+        return KB_NOMEM;
+    }
+
+    // Split the buffer at the line boundary after each nominal chunk boundary
+    char *start = buffer;
+    char *file_end = buffer + size;
+    for (int c = 0; c < n_chunks; c++)
+    {
+        char *end = c == n_chunks - 1 ? file_end : buffer + size / n_chunks * (c + 1);
+        if (end < start)
+        {
+            end = start;
+        }
+        char *nl = memchr(end, '\n', file_end - end);
+        if (c < n_chunks - 1)
+        {
+            end = nl == NULL ? file_end : nl + 1;
+        }
+
+        load->chunks[c].start = start;
+        load->chunks[c].end = end;
+        start = end;
+    }
+    load->n_chunks = n_chunks;
+
+    // Find the section in force at the start of each chunk
+    run_parallel(find_sections, load->chunks, sizeof(CHUNK), n_chunks);
+
+    int section = SECTION_INVALID;
+    for (int c = 0; c < n_chunks; c++)
+    {
+        load->chunks[c].first_section = section;
+        if (load->chunks[c].last_section != SECTION_UNSET)
+        {
+            section = load->chunks[c].last_section;
+        }
+    }
+
+    // Parse and sort each chunk
+    run_parallel(parse_chunk, load->chunks, sizeof(CHUNK), n_chunks);
+
+    bool mem_error = false;
+    for (int c = 0; c < n_chunks; c++)
+    {
+        mem_error = mem_error || load->chunks[c].mem_error;
+    }
+
+    // Merge the runs of each section, sharing the threads out between the
+    // sections by size (but splitting no part smaller than LOADER_MIN_MERGE)
+    int grand_total = 0;
+    int nonempty = 0;
+    for (int i = 0; i < NUM_SECTIONS; i++)
+    {
+        for (int c = 0; c < n_chunks; c++)
+        {
+            load->count[i] += load->chunks[c].count[i];
+        }
+        grand_total += load->count[i];
+        nonempty += load->count[i] > 0;
+    }
+
+    int spare = loader_threads() - nonempty;
+    int max_jobs = spare > 0 ? nonempty + spare : nonempty;
+    MERGE_JOB *jobs = malloc((max_jobs > 0 ? max_jobs : 1) * sizeof(MERGE_JOB));
+    int n_jobs = 0;
+    mem_error = mem_error || jobs == NULL;
+    for (int i = 0; i < NUM_SECTIONS && !mem_error; i++)
+    {
+        int total = load->count[i];
+        load->sorted[i] = malloc((total > 0 ? total : 1) * sizeof(KB_ENTRY *));
+        if (load->sorted[i] == NULL)
+        {
+            mem_error = true;
+            break;
+        }
+        if (total == 0)
+        {
+            continue;
+        }
+
+        int parts = 1;
+        if (spare > 0)
+        {
+            parts += (int) ((long long) spare * total / grand_total);
+        }
+        if (parts > total / LOADER_MIN_MERGE + 1)
+        {
+            parts = total / LOADER_MIN_MERGE + 1;
+        }
+        mem_error = split_merge(load, i, parts, jobs + n_jobs) != KB_OK;
+        n_jobs += parts;
+    }
+
+    if (!mem_error)
+    {
+        run_parallel(merge_runs, jobs, sizeof(MERGE_JOB), n_jobs);
+    }
+    free(jobs);
+
+    if (mem_error)
+    {
+        free_entries(load);
+        return KB_NOMEM;
+    }
+
+    return load->count[INTENT_WHAT] + load->count[INTENT_WHERE] + load->count[INTENT_WHO];
+}
+
+/*
+ * Merge sorted entries with a vine of BST nodes (see tree_to_vine()), in one
+ * linear pass over both, into a sorted array of items ready to be built into
+ * a BST by build_balanced_bst(). Each item is an existing node, an entry that
+ * needs a new node, or both (when the entry's response replaces the node's).
+ * Entities that appear more than once are kept only once, and which response
+ * survives is decided by <policy>:
+ *
+ *   KB_MERGE_REPLACE - the entries replace the vine, and later lines of the
+ *                      file replace earlier ones (last writer wins)
+ *   KB_MERGE_KEEP    - the vine is kept, and earlier lines of the file are
+ *                      kept over later ones (first writer wins)
+ *
+ * Equal entities are sorted from the last read to the first read.
+ *
+ * Input:
+ *   vine           - the head of the vine
+ *   entries        - the sorted entries
+ *   m              - the number of entries
+ *   policy         - KB_MERGE_REPLACE or KB_MERGE_KEEP
+ *   items          - receives the merged items (room for the length of the
+ *                    vine plus m)
+ *
+ * Returns:
+ *   the number of items
+ */
+int merge_entries(KB_NODE *vine, KB_ENTRY **entries, int m, int policy, BUILD_ITEM *items)
+{
+    int n = 0;
+    int k = 0;
+    int cmp;
+
+    TRACE_BEGIN(span, "merge_entries");
+
+    while (vine != NULL || k < m)
+    {
+        if (k == m)
+        {
+            cmp = 1;
+        }
+        else if (vine == NULL)
+        {
+            cmp = -1;
+        }
+        else
+        {
+            cmp = compare_token(entries[k]->entity, vine->entity);
+        }
+
+        // Take the vine node
+        if (cmp > 0)
+        {
+            items[n].node = vine;
+            items[n].entry = NULL;
+            n++;
+            vine = vine->right_child;
+            continue;
+        }
+
+        // Find the run of entries with the same entity (newest first)
+        int newest = k;
+        int oldest = k;
+        while (oldest + 1 < m && compare_token(entries[oldest + 1]->entity, entries[k]->entity) == 0)
+        {
+            oldest++;
+        }
+        k = oldest + 1;
+
+        // Entity already in the vine
+        if (cmp == 0)
+        {
+            items[n].node = vine;
+            items[n].entry = policy == KB_MERGE_REPLACE ? entries[newest] : NULL;
+            vine = vine->right_child;
+        }
+
+        // New entity
+        else
+        {
+            items[n].node = NULL;
+            items[n].entry = entries[policy == KB_MERGE_KEEP ? oldest : newest];
+        }
+        n++;
+    }
+
+    TRACE_END(span);
+    return n;
+}
+
+/* the memory allocation failures while building a BST */
+typedef struct build_failures
+{
+    atomic_int dropped;             // new entities left out
+    atomic_int unchanged;           // existing entities whose response was not updated
+} BUILD_FAILURES;
+
+/* the work of building one subtree on another thread */
+typedef struct build_job
+{
+    BUILD_ITEM *items;
+    int n;
+    int depth;
+    BUILD_FAILURES *failures;
+    KB_NODE *root;
+} BUILD_JOB;
+
+static KB_NODE *build_subtree(BUILD_ITEM *items, int n, int depth, BUILD_FAILURES *failures);
+
+static void *build_job(void *arg)
+{
+    BUILD_JOB *job = arg;
+
+    TRACE_BEGIN(span, "build_subtree");
+    job->root = build_subtree(job->items, job->n, job->depth, job->failures);
+    TRACE_END(span);
+    return NULL;
+}
+
+/*
+ * Attach <right> below the largest node of <left>. Every entity in <right>
+ * must be greater than every entity in <left>.
+ */
+static KB_NODE *join_subtrees(KB_NODE *left, KB_NODE *right)
+{
+    if (left == NULL)
+    {
+        return right;
+    }
+
+    KB_NODE *largest = left;
+    while (largest->right_child != NULL)
+    {
+        largest = largest->right_child;
+    }
+    largest->right_child = right;
+
+    return left;
+}
+
+/*
+ * Build a balanced BST from <n> sorted items, bottom-up. The left subtree has
+ * n/2 items, as in convert_to_balanced_bst(), so the shape does not depend on
+ * how the work is divided. While <depth> is positive, large left subtrees are
+ * built on another thread.
+ */
+static KB_NODE *build_subtree(BUILD_ITEM *items, int n, int depth, BUILD_FAILURES *failures)
+{
+    if (n <= 0)
+    {
+        return NULL;
+    }
+
+    int mid = n / 2;
+    BUILD_JOB job;
+    pthread_t thread;
+    bool forked = false;
+    KB_NODE *left_subtree;
+    KB_NODE *right_subtree;
+
+    // Build the left subtree on another thread
+    if (depth > 0 && n >= BUILD_PARALLEL_CUTOFF)
+    {
+        job.items = items;
+        job.n = mid;
+        job.depth = depth - 1;
+        job.failures = failures;
+        forked = pthread_create(&thread, NULL, build_job, &job) == 0;
+    }
+
+    // Right subtree has n (total) - n/2 (left subtree) - 1 (root) items
+    right_subtree = build_subtree(items + mid + 1, n - mid - 1, depth - 1, failures);
+
+    if (forked)
+    {
+        pthread_join(thread, NULL);
+        left_subtree = job.root;
+    }
+    else
+    {
+        left_subtree = build_subtree(items, mid, depth - 1, failures);
+    }
+
+    // Create (or update) the root node
+    KB_NODE *root = items[mid].node;
+    if (root == NULL)
+    {
+        root = create_new_node(items[mid].entry->entity, items[mid].entry->response);
+
+        // Memory allocation failure (leave the entity out)
+        if (root == NULL)
+        {
+            atomic_fetch_add(&failures->dropped, 1);
+            return join_subtrees(left_subtree, right_subtree);
+        }
+    }
+    else if (items[mid].entry != NULL && set_response(root, items[mid].entry->response) != KB_OK)
+    {
+        // Memory allocation failure (keep the old response)
+        atomic_fetch_add(&failures->unchanged, 1);
+    }
+
+    root->left_child = left_subtree;
+    root->right_child = right_subtree;
+
+    return root;
+}
+
+/*
+ * Build a balanced BST from sorted items (see merge_entries()), creating the
+ * nodes for new entities as it goes. Large subtrees are built in parallel,
+ * down to BUILD_PARALLEL_CUTOFF items; the tree has the same shape however
+ * many threads are used.
+ *
+ * Input:
+ *   items          - the sorted items
+ *   n              - the number of items
+ *   threads        - the number of threads that may be used
+ *   count          - set to the number of nodes in the BST
+ *   mem_error      - set to true if there is a memory allocation failure
+ *                    (the entities that could not be allocated are left out,
+ *                    and the responses that could not be updated are kept)
+ *
+ * Returns:
+ *   the root of the balanced BST
+ */
+KB_NODE *build_balanced_bst(BUILD_ITEM *items, int n, int threads, int *count, bool *mem_error)
+{
+    BUILD_FAILURES failures;
+    int depth = 0;
+
+    TRACE_BEGIN(span, "build_balanced_bst");
+
+    // Each level of forking doubles the number of threads
+    while ((1 << (depth + 1)) <= threads)
+    {
+        depth++;
+    }
+
+    atomic_init(&failures.dropped, 0);
+    atomic_init(&failures.unchanged, 0);
+    KB_NODE *root = build_subtree(items, n, depth, &failures);
+
+    *count = n - atomic_load(&failures.dropped);
+    if (atomic_load(&failures.dropped) > 0 || atomic_load(&failures.unchanged) > 0)
+    {
+        *mem_error = true;
+    }
+
+    TRACE_END(span);
+    return root;
+}
@@ -24,16 +24,14 @@ int main(int argc, char *argv[]) {
 
 	/* 
 	 * Note that these tests do not check for memory allocation failures.
-	 * Do not run them together with #define malloc(s) my_alloc(s).
+	 * Do not run them together with an allocation failure schedule (see alloc_fail()).
 	 */
 
 	//bst_tests();				/* Uncomment to run tests on bst.c */
 	//linkedlist_tests();		/* Uncomment to run tests on linkedlist.c */
+	//phonetic_tests();			/* Uncomment to run tests on phonetic.c */
+	//alloc_tests("sample.unsorted.ini");	/* Uncomment (and compile with -DKB_ALLOC_TRACKING) to fail each allocation of knowledge.c in turn */
 
-	/* Initialise the BST and Linked List */
-	KB_NODE *WHAT_root, *WHERE_root, *WHO_root = NULL;
-	LIST_NODE *WHAT_head, *WHERE_head, *WHO_head = NULL;
-	
 	/* Initialize the pseudo-RNG */
 	srand(time(NULL));			/* Seed with time of execution */
 
@@ -49,6 +47,11 @@ int main(int argc, char *argv[]) {
 	inv[1] = NULL;
 	chatbot_do_reset(1, inv, output, MAX_RESPONSE);
 
+	/* load the smalltalk content */
+	FILE *smalltalk_file = fopen(SMALLTALK_FILE, "r");
+	if (smalltalk_file == NULL || smalltalk_read(smalltalk_file) < 0)
+		printf("%s: (could not load %s; smalltalk is disabled)\n", chatbot_botname(), SMALLTALK_FILE);
+
 	/* print a welcome message */
 	printf("%s: Hello, I'm %s.\n", chatbot_botname(), chatbot_botname());
 
@@ -87,38 +90,10 @@ int main(int argc, char *argv[]) {
 
 	} while (!done);
 
-	return 0;
-}
-
-
-/*
- * Utility function for comparing string case-insensitively.
- *
- * Input:
- *   token1 - the first token
- *   token2 - the second token
- *
- * Returns:
- *   as strcmp()
- */
-int compare_token(const char *token1, const char *token2) {
-
-	int i = 0;
-	while (token1[i] != '\0' && token2[i] != '\0') {
-		if (toupper(token1[i]) < toupper(token2[i]))
-			return -1;
-		else if (toupper(token1[i]) > toupper(token2[i]))
-			return 1;
-		i++;
-	}
-
-	if (token1[i] == '\0' && token2[i] == '\0')
-		return 0;
-	else if (token1[i] == '\0')
-		return -1;
-	else
-		return 1;
+	/* finish any saves and write back any tenants that have changed */
+	chatbot_close();
 
+	return 0;
 }
 
 
@@ -0,0 +1,637 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the MARC library (see marc.h), which embeds the
+ * chatbot's knowledge bases and conversations in another program.
+ *
+ * A MARC_KB wraps a knowledge base with a lock, so that sessions on different
+ * threads can share it; it may overlay another MARC_KB (e.g. a tenant's layer
+ * on a base shared by all tenants, see marc_kb_layer()). A MARC_SESSION holds
+ * one conversation, and learns into an overlay of its own (see
+ * knowledge_create_overlay()), so that what one person teaches it is not
+ * told to everyone else. Where the chatbot would prompt the user (to offer the
+ * closest match, or to learn an answer it does not know), the session replies
+ * with the question and remembers what it is waiting for; the next line is
+ * taken as the answer.
+ *
+ * A session understands questions (what/where/who), forget and exit/quit.
+ * Loading and saving files are left to the program, through marc_kb_load()
+ * and marc_kb_save() (or marc_session_save(), for what a session learned),
+ * so that the people chatting cannot reach the file system.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "chat1002.h"
+#include "marc.h"
+
+_Static_assert(MARC_OK == KB_OK && MARC_CLOSESTMATCH == KB_CLOSESTMATCH && MARC_NOTFOUND == KB_NOTFOUND &&
+    MARC_INVALID == KB_INVALID && MARC_NOMEM == KB_NOMEM, "MARC return codes must match KB return codes");
+
+/* what a session is waiting for */
+#define SESSION_IDLE        0   /* a new line of input */
+#define SESSION_CONFIRM     1   /* yes or no, to the closest match it offered */
+#define SESSION_LEARN       2   /* the answer to a question it could not answer */
+
+/* word delimiters, as in main.c */
+#define SESSION_DELIMITERS  " ?\t\n"
+
+/* a knowledge base shared by sessions */
+struct marc_kb
+{
+    KNOWLEDGE_BASE *kb;
+    pthread_mutex_t lock;               // held while the knowledge base is used
+    MARC_KB *base;                      // the knowledge base this one overlays, if any
+};
+
+/* one conversation */
+struct marc_session
+{
+    MARC_KB *kb;
+    KNOWLEDGE_BASE *overlay;            // what this session has learned and forgotten
+    int state;                          // SESSION_IDLE, SESSION_CONFIRM or SESSION_LEARN
+    char intent[MAX_INTENT];            // the question being answered
+    char entity[MAX_ENTITY];
+    char match[MAX_ENTITY];             // the closest match offered
+    char question[MAX_RESPONSE];        // the question asked back, e.g. "what is SIT?"
+};
+
+/*
+ * Creates an empty knowledge base.
+ *
+ * Input:
+ *   name       - the name of the knowledge base (e.g. the tenant it is for)
+ *
+ * Returns:
+ *   the knowledge base, if successful
+ *   NULL, if there was a memory allocation failure
+ */
+MARC_KB *marc_kb_open(const char *name)
+{
+    MARC_KB *kb = malloc(sizeof(MARC_KB));
+
+    if (kb == NULL)
+    {
+        return NULL;
+    }
+    kb->base = NULL;
+
+    kb->kb = knowledge_create(name);
+    if (kb->kb == NULL || pthread_mutex_init(&kb->lock, NULL) != 0)
+    {
+        knowledge_free(kb->kb);
+        free(kb);
+        return NULL;
+    }
+
+    return kb;
+}
+
+/*
+ * Locks a knowledge base and the knowledge bases below it, from the top down
+ * (so that two stacks sharing a base cannot deadlock).
+ */
+static void lock_layers(MARC_KB *kb)
+{
+    for (; kb != NULL; kb = kb->base)
+    {
+        pthread_mutex_lock(&kb->lock);
+    }
+}
+
+/*
+ * Unlocks a knowledge base and the knowledge bases below it.
+ */
+static void unlock_layers(MARC_KB *kb)
+{
+    while (kb != NULL)
+    {
+        MARC_KB *base = kb->base;
+        pthread_mutex_unlock(&kb->lock);
+        kb = base;
+    }
+}
+
+/*
+ * Layers a knowledge base over another, which answers what it does not know
+ * itself (see knowledge_get()). The base must outlive the knowledge base;
+ * learning in the knowledge base (or in its sessions) never changes the base.
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *   base       - the knowledge base to overlay (NULL for none)
+ *
+ * Returns:
+ *   MARC_OK, if successful
+ *   MARC_INVALID, if the base is the knowledge base or overlays it
+ */
+int marc_kb_layer(MARC_KB *kb, MARC_KB *base)
+{
+    for (MARC_KB *below = base; below != NULL; below = below->base)
+    {
+        if (below == kb)
+        {
+            return MARC_INVALID;
+        }
+    }
+
+    pthread_mutex_lock(&kb->lock);
+    kb->base = base;
+    knowledge_set_below(kb->kb, base == NULL ? NULL : base->kb);
+    pthread_mutex_unlock(&kb->lock);
+
+    return MARC_OK;
+}
+
+/*
+ * Reads a knowledge file into a knowledge base, merging it into the existing
+ * knowledge (see knowledge_read()).
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *   filename   - the file
+ *
+ * Returns:
+ *   the number of entity/response pairs read, if successful
+ *   MARC_NOTFOUND, if the file could not be opened
+ *   MARC_NOMEM, if there was a memory allocation failure
+ */
+int marc_kb_load(MARC_KB *kb, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+
+    if (f == NULL)
+    {
+        return MARC_NOTFOUND;
+    }
+
+    pthread_mutex_lock(&kb->lock);
+    int status = knowledge_read(kb->kb, f);
+    pthread_mutex_unlock(&kb->lock);
+
+    return status;
+}
+
+/*
+ * Gets the response to a question, without asking anything.
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *   intent     - the question word
+ *   entity     - the entity
+ *   response   - a buffer to receive the response
+ *   n          - the size of the response buffer
+ *
+ * Returns:
+ *   MARC_OK, if the entity is known (its response is copied to the buffer)
+ *   MARC_CLOSESTMATCH, if only a close match is known (the match's response
+ *   is copied to the buffer)
+ *   MARC_NOTFOUND, if nothing suitable is known
+ *   MARC_INVALID, if the intent is not a question word
+ */
+int marc_kb_get(MARC_KB *kb, const char *intent, const char *entity, char *response, int n)
+{
+    lock_layers(kb);
+    int status = knowledge_get(kb->kb, intent, entity, NULL, response, n);
+    unlock_layers(kb);
+
+    return status;
+}
+
+/*
+ * Sets the response to a question (see knowledge_put()).
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *   intent     - the question word
+ *   entity     - the entity
+ *   response   - the response
+ *
+ * Returns:
+ *   MARC_OK, if successful
+ *   MARC_INVALID, if the intent is not a question word
+ *   MARC_NOMEM, if there was a memory allocation failure
+ */
+int marc_kb_put(MARC_KB *kb, const char *intent, const char *entity, const char *response)
+{
+    lock_layers(kb);
+    int status = knowledge_put(kb->kb, intent, entity, response);
+    unlock_layers(kb);
+
+    return status;
+}
+
+/*
+ * Makes an alias stand for an entity, so that both get the same answer (see
+ * knowledge_alias()).
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *   intent     - the question word
+ *   alias      - the alias
+ *   entity     - the entity it stands for
+ *
+ * Returns:
+ *   MARC_OK, if successful
+ *   MARC_INVALID, if the intent is not a question word, or the alias would
+ *   stand for itself
+ *   MARC_NOMEM, if there was a memory allocation failure
+ */
+int marc_kb_alias(MARC_KB *kb, const char *intent, const char *alias, const char *entity)
+{
+    lock_layers(kb);
+    int status = knowledge_alias(kb->kb, intent, alias, entity);
+    unlock_layers(kb);
+
+    return status;
+}
+
+/*
+ * Saves a knowledge base to a file. The file is written in the background
+ * (see knowledge_write_async()), so sessions can carry on meanwhile; but a
+ * knowledge base that overlays another is saved together with the layers
+ * below it, before returning.
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *   filename   - the file
+ *
+ * Returns:
+ *   MARC_OK, if the file is being written (see marc_kb_wait_save())
+ *   MARC_INVALID, if the file could not be opened for writing
+ *   MARC_NOMEM, if there was a memory allocation failure
+ */
+int marc_kb_save(MARC_KB *kb, const char *filename)
+{
+    lock_layers(kb);
+    int status = knowledge_write_async(kb->kb, filename);
+    unlock_layers(kb);
+
+    return status;
+}
+
+/*
+ * Waits for the saves started by marc_kb_save() to finish, and reports
+ * whether any of them failed since this was last called.
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *
+ * Returns:
+ *   MARC_OK, if every save was written
+ *   MARC_INVALID, if a file could not be written or renamed
+ *   MARC_NOMEM, if there was a memory allocation failure while saving
+ */
+int marc_kb_wait_save(MARC_KB *kb)
+{
+    pthread_mutex_lock(&kb->lock);
+    int status = knowledge_save_status(kb->kb, true);
+    pthread_mutex_unlock(&kb->lock);
+
+    return status;
+}
+
+/*
+ * Closes a knowledge base, waiting for any save to finish. Its sessions, and
+ * the knowledge bases layered over it, must be closed first.
+ *
+ * Input:
+ *   kb         - the knowledge base (may be NULL)
+ */
+void marc_kb_close(MARC_KB *kb)
+{
+    if (kb != NULL)
+    {
+        knowledge_free(kb->kb);
+        pthread_mutex_destroy(&kb->lock);
+        free(kb);
+    }
+}
+
+/*
+ * Starts a conversation with a knowledge base. What is learned and forgotten
+ * in the conversation is kept in the session, over the knowledge base.
+ *
+ * Input:
+ *   kb         - the knowledge base
+ *
+ * Returns:
+ *   the session, if successful
+ *   NULL, if there was a memory allocation failure
+ */
+MARC_SESSION *marc_session_open(MARC_KB *kb)
+{
+    MARC_SESSION *session = calloc(1, sizeof(MARC_SESSION));
+
+    if (session == NULL)
+    {
+        return NULL;
+    }
+
+    session->overlay = knowledge_create_overlay("", kb->kb);
+    if (session->overlay == NULL)
+    {
+        free(session);
+        return NULL;
+    }
+    session->kb = kb;
+    session->state = SESSION_IDLE;
+
+    return session;
+}
+
+/*
+ * Ends a conversation.
+ *
+ * Input:
+ *   session    - the session (may be NULL)
+ */
+void marc_session_close(MARC_SESSION *session)
+{
+    if (session != NULL)
+    {
+        knowledge_free(session->overlay);
+        free(session);
+    }
+}
+
+/*
+ * Saves the knowledge base as a session sees it: the knowledge base (and the
+ * layers below it) with what the session has learned and forgotten.
+ *
+ * Input:
+ *   session    - the session
+ *   filename   - the file
+ *
+ * Returns:
+ *   MARC_OK, if successful
+ *   MARC_INVALID, if the file could not be written
+ *   MARC_NOMEM, if there was a memory allocation failure
+ */
+int marc_session_save(MARC_SESSION *session, const char *filename)
+{
+    lock_layers(session->kb);
+    int status = knowledge_write(session->overlay, filename);
+    unlock_layers(session->kb);
+
+    return status;
+}
+
+/*
+ * Divides a line into words, as the main loop does: at the delimiters, with
+ * trailing punctuation removed from each word.
+ *
+ * Returns:
+ *   the number of words
+ */
+static int split_words(char *line, char *inv[])
+{
+    int inc = 0;
+    char *word = line;
+
+    while (inc < MAX_INPUT - 1)
+    {
+        word += strspn(word, SESSION_DELIMITERS);
+        if (*word == '\0')
+        {
+            break;
+        }
+
+        size_t len = strcspn(word, SESSION_DELIMITERS);
+        char *next = word[len] == '\0' ? word + len : word + len + 1;
+        word[len] = '\0';
+
+        while (len > 0 && ispunct((unsigned char) word[len - 1]))
+        {
+            word[--len] = '\0';
+        }
+        inv[inc++] = word;
+        word = next;
+    }
+
+    inv[inc] = NULL;
+    return inc;
+}
+
+/*
+ * Joins words into an entity, which is truncated if it is too long.
+ */
+static void join_words(int inc, char *inv[], char *entity)
+{
+    int used = 0;
+
+    entity[0] = '\0';
+    for (int i = 0; i < inc && used < MAX_ENTITY; i++)
+    {
+        used += snprintf(entity + used, MAX_ENTITY - used, "%s%s", i > 0 ? " " : "", inv[i]);
+    }
+}
+
+/*
+ * Asks for the answer to the question being answered, which the next line
+ * will give.
+ */
+static void ask_to_learn(MARC_SESSION *session, char *response, int n)
+{
+    session->state = SESSION_LEARN;
+    snprintf(response, n, "I don't know. %s", session->question);
+}
+
+/*
+ * Answers a question (see chatbot_do_question()), offering the closest match
+ * or asking to learn the answer if the entity is not known.
+ */
+static void session_question(MARC_SESSION *session, int inc, char *inv[], char *response, int n)
+{
+    // Skip "is" or "are" (but say it when asking the question back)
+    int first = 1;
+    if (inc >= 2 && (compare_token(inv[1], "is") == 0 || compare_token(inv[1], "are") == 0))
+    {
+        first = 2;
+    }
+    if (first >= inc)
+    {
+        snprintf(response, n, "Please provide an entity.");
+        return;
+    }
+
+    snprintf(session->intent, MAX_INTENT, "%s", inv[0]);
+    join_words(inc - first, inv + first, session->entity);
+    snprintf(session->question, MAX_RESPONSE, "%s%s%s %s?", inv[0], first == 2 ? " " : "", first == 2 ? inv[1] : "",
+        session->entity);
+
+    lock_layers(session->kb);
+    int status = knowledge_get(session->overlay, session->intent, session->entity, session->match, response, n);
+    unlock_layers(session->kb);
+
+    if (status == KB_CLOSESTMATCH)
+    {
+        session->state = SESSION_CONFIRM;
+        snprintf(response, n, "Sorry, I don't know about %s. Did you mean %s? (yes/no)", session->entity, session->match);
+    }
+    else if (status == KB_NOTFOUND)
+    {
+        ask_to_learn(session, response, n);
+    }
+    else if (status == KB_INVALID)
+    {
+        snprintf(response, n, "Invalid question.");
+    }
+}
+
+/*
+ * Takes a line as the answer to the closest match offered.
+ */
+static void session_confirm(MARC_SESSION *session, const char *line, char *response, int n)
+{
+    char answer[MAX_INPUT];
+    char *inv[MAX_INPUT];
+
+    snprintf(answer, MAX_INPUT, "%s", line);
+    const char *word = split_words(answer, inv) > 0 ? inv[0] : "";
+
+    session->state = SESSION_IDLE;
+    if (compare_token(word, "yes") == 0 || compare_token(word, "y") == 0)
+    {
+        lock_layers(session->kb);
+        int status = knowledge_accept(session->overlay, session->intent, session->match, response, n);
+        unlock_layers(session->kb);
+
+        // Forgotten since it was offered
+        if (status == KB_NOTFOUND)
+        {
+            ask_to_learn(session, response, n);
+        }
+    }
+    else if (compare_token(word, "no") == 0 || compare_token(word, "n") == 0)
+    {
+        ask_to_learn(session, response, n);
+    }
+    else
+    {
+        snprintf(response, n, "I dont understand '%s'", word);
+    }
+}
+
+/*
+ * Takes a line as the answer to the question that could not be answered.
+ */
+static void session_learn(MARC_SESSION *session, const char *line, char *response, int n)
+{
+    char answer[MAX_RESPONSE];
+
+    snprintf(answer, MAX_RESPONSE, "%.*s", (int) strcspn(line, "\r\n"), line);
+    session->state = SESSION_IDLE;
+
+    // Only the session's own overlay changes (but an alias is looked up in
+    // the layers below)
+    lock_layers(session->kb);
+    int status = knowledge_put(session->overlay, session->intent, session->entity, answer);
+    unlock_layers(session->kb);
+
+    snprintf(response, n, "%s", status == KB_NOMEM ? "Memory allocation failure." : "Thank you.");
+}
+
+/*
+ * Forgets the answer to a question (see chatbot_do_forget()).
+ */
+static void session_forget(MARC_SESSION *session, int inc, char *inv[], char *response, int n)
+{
+    int first = inc >= 3 && (compare_token(inv[2], "is") == 0 || compare_token(inv[2], "are") == 0) ? 3 : 2;
+    char entity[MAX_ENTITY];
+
+    if (inc < 2 || get_intent(inv[1]) < 0)
+    {
+        snprintf(response, n, "Usage: forget what|where|who <entity>.");
+        return;
+    }
+    if (first >= inc)
+    {
+        snprintf(response, n, "Please provide an entity.");
+        return;
+    }
+
+    join_words(inc - first, inv + first, entity);
+
+    lock_layers(session->kb);
+    int status = knowledge_forget(session->overlay, inv[1], entity);
+    unlock_layers(session->kb);
+
+    if (status == KB_OK)
+    {
+        snprintf(response, n, "I have forgotten about %s.", entity);
+    }
+    else if (status == KB_NOMEM)
+    {
+        snprintf(response, n, "Memory allocation failure.");
+    }
+    else
+    {
+        snprintf(response, n, "I didn't know about %s anyway.", entity);
+    }
+}
+
+/*
+ * Handles a line of a conversation, as the chatbot's main loop does: either
+ * a new request, or the answer to a question the session asked in its last
+ * response.
+ *
+ * Input:
+ *   session    - the session
+ *   line       - the line of input (a trailing newline is ignored)
+ *   response   - a buffer to receive the response
+ *   n          - the size of the response buffer
+ *
+ * Returns:
+ *   0, if the conversation continues
+ *   1, if it has ended (the line was "exit" or "quit")
+ */
+int marc_session_handle_line(MARC_SESSION *session, const char *line, char *response, int n)
+{
+    char input[MAX_INPUT];
+    char *inv[MAX_INPUT];
+
+    response[0] = '\0';
+
+    // The answer to a question asked in the last response
+    if (session->state == SESSION_CONFIRM)
+    {
+        session_confirm(session, line, response, n);
+        return 0;
+    }
+    else if (session->state == SESSION_LEARN)
+    {
+        session_learn(session, line, response, n);
+        return 0;
+    }
+
+    // A new request
+    snprintf(input, MAX_INPUT, "%s", line);
+    int inc = split_words(input, inv);
+
+    if (inc < 1)
+    {
+        snprintf(response, n, "Try asking me a question.");
+    }
+    else if (compare_token(inv[0], "exit") == 0 || compare_token(inv[0], "quit") == 0)
+    {
+        snprintf(response, n, "Goodbye!");
+        return 1;
+    }
+    else if (get_intent(inv[0]) >= 0)
+    {
+        session_question(session, inc, inv, response, n);
+    }
+    else if (compare_token(inv[0], "forget") == 0)
+    {
+        session_forget(session, inc, inv, response, n);
+    }
+    else
+    {
+        snprintf(response, n, "I don't understand \"%s\".", inv[0]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file contains the public interface of the MARC library, which lets a
+ * program embed the chatbot's knowledge bases and conversations in-process
+ * rather than running the chatbot executable. Everything is reached through
+ * explicit handles: the library has no global state, does not read stdin or
+ * write stdout, and never prompts. See marc.c.
+ */
+
+#ifndef _MARC_H
+#define _MARC_H
+
+/* return codes (the same as those of the knowledge base, see chat1002.h) */
+#define MARC_OK             0
+#define MARC_CLOSESTMATCH   1
+#define MARC_NOTFOUND      -1
+#define MARC_INVALID       -2
+#define MARC_NOMEM         -3
+
+/* a knowledge base, which may be shared by sessions on any number of threads
+   (and overlaid by other knowledge bases) */
+typedef struct marc_kb MARC_KB;
+
+/* one conversation with a knowledge base */
+typedef struct marc_session MARC_SESSION;
+
+/* marks the functions the library exports: it is built with MARC_BUILD defined
+   and everything else hidden (-fvisibility=hidden), so that only these are
+   visible to the program using it */
+#if defined(_WIN32) && defined(MARC_BUILD)
+#define MARC_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define MARC_API __attribute__((visibility("default")))
+#else
+#define MARC_API
+#endif
+
+/* knowledge bases */
+MARC_API MARC_KB *marc_kb_open(const char *name);
+MARC_API int marc_kb_load(MARC_KB *kb, const char *filename);
+MARC_API int marc_kb_layer(MARC_KB *kb, MARC_KB *base);
+MARC_API int marc_kb_get(MARC_KB *kb, const char *intent, const char *entity, char *response, int n);
+MARC_API int marc_kb_put(MARC_KB *kb, const char *intent, const char *entity, const char *response);
+MARC_API int marc_kb_alias(MARC_KB *kb, const char *intent, const char *alias, const char *entity);
+MARC_API int marc_kb_save(MARC_KB *kb, const char *filename);
+MARC_API int marc_kb_wait_save(MARC_KB *kb);
+MARC_API void marc_kb_close(MARC_KB *kb);
+
+/* conversations */
+MARC_API MARC_SESSION *marc_session_open(MARC_KB *kb);
+MARC_API int marc_session_handle_line(MARC_SESSION *session, const char *line, char *response, int n);
+MARC_API int marc_session_save(MARC_SESSION *session, const char *filename);
+MARC_API void marc_session_close(MARC_SESSION *session);
+
+#endif
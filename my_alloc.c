@@ -1,16 +1,572 @@
-#include "chat1002.h"
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the allocation tracker. When the chatbot is compiled
+ * with -DKB_ALLOC_TRACKING, chat1002.h routes malloc(), calloc(), realloc()
+ * and free() here, and every block carries a small header recording its size
+ * and the source file (the subsystem) that allocated it. That gives, for each
+ * subsystem, the number of allocations and frees, and the bytes live now and
+ * at the peak (see alloc_report()).
+ *
+ * Allocations can also be failed on a deterministic schedule: "fail the Nth
+ * allocation from now" (see alloc_fail()). alloc_tests() uses it to fail
+ * each allocation of knowledge_read() and knowledge_put() in turn, checking
+ * that each failure is handled and that nothing leaks.
+ *
+ * The tracker is thread-safe, but the Nth allocation is only the same on
+ * every run if the allocations happen in the same order, so run_parallel()
+ * runs its jobs one at a time when tracking.
+ */
+
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "chat1002.h"
+
+/* the tracker itself uses the real allocator */
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+
+/* the most source files that are counted apart (the rest share the last) */
+#define ALLOC_SUBSYSTEMS    32
+
+/* the entities learned by the knowledge_put() sweep of alloc_tests() */
+#define ALLOC_TEST_PUTS     4
+
+/* the header in front of each tracked block (aligned for any type) */
+typedef union alloc_header
+{
+    struct
+    {
+        size_t size;                        // the size asked for
+        int subsystem;                      // the index of the subsystem that allocated it
+    } info;
+    max_align_t align;
+} ALLOC_HEADER;
+
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static ALLOC_STATS subsystems[ALLOC_SUBSYSTEMS];
+static int n_subsystems = 0;
+static ALLOC_STATS total = { "total", 0, 0, 0, 0, 0 };
+
+/* the failure schedule (see alloc_fail()) */
+static long counted = 0;                    // the allocations since the schedule was set
+static long fail_from = 0;                  // the first allocation to fail (0 = none)
+static long fail_count = 0;                 // the number to fail (-1 = all from then on)
+static const char *last_failure = NULL;     // the subsystem of the last allocation failed
+
+/*
+ * Find the statistics of the subsystem of a source file, adding them if it is
+ * new. The caller holds alloc_lock.
+ *
+ * Returns:
+ *   the index of the subsystem
+ */
+static int find_subsystem(const char *file)
+{
+    const char *name = file;
+
+    // The name of the file, without its directory
+    for (const char *c = file; *c != '\0'; c++)
+    {
+        if (*c == '/' || *c == '\\')
+        {
+            name = c + 1;
+        }
+    }
+
+    for (int i = 0; i < n_subsystems; i++)
+    {
+        if (subsystems[i].subsystem == name || strcmp(subsystems[i].subsystem, name) == 0)
+        {
+            return i;
+        }
+    }
 
-void *my_alloc(size_t s)
+    if (n_subsystems == ALLOC_SUBSYSTEMS)
+    {
+        return ALLOC_SUBSYSTEMS - 1;
+    }
+    subsystems[n_subsystems].subsystem = name;
+    return n_subsystems++;
+}
+
+/*
+ * Count an allocation against the schedule. The caller holds alloc_lock.
+ *
+ * Returns:
+ *   true, if the allocation is to fail
+ *   false, otherwise
+ */
+static bool scheduled_failure(int subsystem)
 {
-    int result = rand() % 5;
-    if (result == 0)
+    counted++;
+    if (fail_from == 0 || counted < fail_from || (fail_count >= 0 && counted >= fail_from + fail_count))
+    {
+        return false;
+    }
+
+    subsystems[subsystem].failures++;
+    total.failures++;
+    last_failure = subsystems[subsystem].subsystem;
+    return true;
+}
+
+/*
+ * Add (or, if <bytes> is negative, take away) live bytes of a subsystem. The
+ * caller holds alloc_lock.
+ */
+static void count_bytes(int subsystem, long long bytes)
+{
+    ALLOC_STATS *stats[2] = { &subsystems[subsystem], &total };
+
+    for (int k = 0; k < 2; k++)
+    {
+        stats[k]->live = (size_t) ((long long) stats[k]->live + bytes);
+        if (stats[k]->live > stats[k]->peak)
+        {
+            stats[k]->peak = stats[k]->live;
+        }
+    }
+}
+
+/*
+ * Allocate a tracked block (see malloc()).
+ *
+ * Input:
+ *   s          - the size of the block
+ *   file       - the source file allocating it (__FILE__)
+ *
+ * Returns:
+ *   the pointer to the block, if successful
+ *   NULL, if the allocation failed (or was scheduled to fail)
+ */
+void *my_alloc(size_t s, const char *file)
+{
+    pthread_mutex_lock(&alloc_lock);
+    int subsystem = find_subsystem(file);
+    bool fail = scheduled_failure(subsystem);
+    pthread_mutex_unlock(&alloc_lock);
+
+    ALLOC_HEADER *header = fail ? NULL : malloc(sizeof(ALLOC_HEADER) + s);
+    if (header == NULL)
     {
         return NULL;
     }
-    else
+    header->info.size = s;
+    header->info.subsystem = subsystem;
+
+    pthread_mutex_lock(&alloc_lock);
+    subsystems[subsystem].allocs++;
+    total.allocs++;
+    count_bytes(subsystem, (long long) s);
+    pthread_mutex_unlock(&alloc_lock);
+
+    return header + 1;
+}
+
+/*
+ * Allocate a tracked block of zeroes (see calloc()).
+ */
+void *my_calloc(size_t n, size_t s, const char *file)
+{
+    if (s != 0 && n > (SIZE_MAX - sizeof(ALLOC_HEADER)) / s)
+    {
+        return NULL;
+    }
+
+    void *block = my_alloc(n * s, file);
+    if (block != NULL)
+    {
+        memset(block, 0, n * s);
+    }
+    return block;
+}
+
+/*
+ * Resize a tracked block (see realloc()). A block that moves is counted
+ * against the subsystem resizing it.
+ */
+void *my_realloc(void *p, size_t s, const char *file)
+{
+    if (p == NULL)
+    {
+        return my_alloc(s, file);
+    }
+
+    pthread_mutex_lock(&alloc_lock);
+    int subsystem = find_subsystem(file);
+    bool fail = scheduled_failure(subsystem);
+    pthread_mutex_unlock(&alloc_lock);
+
+    ALLOC_HEADER *old = (ALLOC_HEADER *) p - 1;
+    size_t old_size = old->info.size;
+    int old_subsystem = old->info.subsystem;
+
+    ALLOC_HEADER *header = fail ? NULL : realloc(old, sizeof(ALLOC_HEADER) + s);
+    if (header == NULL)
+    {
+        return NULL;
+    }
+    header->info.size = s;
+    header->info.subsystem = subsystem;
+
+    pthread_mutex_lock(&alloc_lock);
+    if (subsystem != old_subsystem)
+    {
+        subsystems[old_subsystem].frees++;
+        subsystems[subsystem].allocs++;
+    }
+    count_bytes(old_subsystem, -(long long) old_size);
+    count_bytes(subsystem, (long long) s);
+    pthread_mutex_unlock(&alloc_lock);
+
+    return header + 1;
+}
+
+/*
+ * Free a tracked block (see free()).
+ *
+ * Input:
+ *   p          - the block (may be NULL)
+ */
+void my_free(void *p)
+{
+    if (p == NULL)
+    {
+        return;
+    }
+
+    ALLOC_HEADER *header = (ALLOC_HEADER *) p - 1;
+
+    pthread_mutex_lock(&alloc_lock);
+    subsystems[header->info.subsystem].frees++;
+    total.frees++;
+    count_bytes(header->info.subsystem, -(long long) header->info.size);
+    pthread_mutex_unlock(&alloc_lock);
+
+    free(header);
+}
+
+/*
+ * Set which allocations fail: <count> allocations in a row, starting with the
+ * <nth> from now (counting from 1), then none. alloc_fail(0, 0) fails none.
+ *
+ * Input:
+ *   nth        - the first allocation to fail, or 0 for none
+ *   count      - the number of allocations to fail, or -1 for all from then on
+ */
+void alloc_fail(long nth, long count)
+{
+    pthread_mutex_lock(&alloc_lock);
+    counted = 0;
+    fail_from = nth;
+    fail_count = count;
+    last_failure = NULL;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Get the number of allocations since the schedule was last set (see
+ * alloc_fail()), whether they failed or not.
+ */
+long alloc_counted()
+{
+    pthread_mutex_lock(&alloc_lock);
+    long n = counted;
+    pthread_mutex_unlock(&alloc_lock);
+    return n;
+}
+
+/*
+ * Get the subsystem of the last allocation that was failed on schedule.
+ *
+ * Returns:
+ *   the name of its source file
+ *   NULL, if none has been failed since the schedule was set
+ */
+const char *alloc_last_failure()
+{
+    pthread_mutex_lock(&alloc_lock);
+    const char *name = last_failure;
+    pthread_mutex_unlock(&alloc_lock);
+    return name;
+}
+
+/*
+ * Get the statistics of all the subsystems together.
+ */
+ALLOC_STATS alloc_total()
+{
+    pthread_mutex_lock(&alloc_lock);
+    ALLOC_STATS stats = total;
+    pthread_mutex_unlock(&alloc_lock);
+    return stats;
+}
+
+/*
+ * Start measuring the peaks again, from the bytes live now.
+ */
+void alloc_reset_peaks()
+{
+    pthread_mutex_lock(&alloc_lock);
+    for (int i = 0; i < n_subsystems; i++)
+    {
+        subsystems[i].peak = subsystems[i].live;
+    }
+    total.peak = total.live;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Print the statistics of each subsystem, and of all of them together.
+ *
+ * Input:
+ *   f          - the file to print to
+ */
+void alloc_report(FILE *f)
+{
+    pthread_mutex_lock(&alloc_lock);
+    fprintf(f, "%-16s %10s %10s %8s %12s %12s\n", "subsystem", "allocs", "frees", "failed", "live", "peak");
+    for (int i = 0; i <= n_subsystems; i++)
     {
-        return calloc(s, 1);
+        ALLOC_STATS *stats = i < n_subsystems ? &subsystems[i] : &total;
+        fprintf(f, "%-16s %10ld %10ld %8ld %12zu %12zu\n", stats->subsystem, stats->allocs, stats->frees, stats->failures, stats->live, stats->peak);
     }
-    
-}
\ No newline at end of file
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+#ifdef KB_ALLOC_TRACKING
+/*
+ * Read a file into a new knowledge base, for alloc_tests(). Its optional
+ * indexes are turned on, so that their failures are swept too.
+ *
+ * Returns:
+ *   the result of knowledge_read(), or KB_NOMEM if the knowledge base could
+ *   not be created (<kb> is then NULL)
+ */
+static int read_file(const char *filename, KNOWLEDGE_BASE **kb)
+{
+    FILE *f = fopen(filename, "r");
+
+    if (f == NULL)
+    {
+        *kb = NULL;
+        return KB_NOTFOUND;
+    }
+    if ((*kb = knowledge_create("alloc_tests")) == NULL)
+    {
+        fclose(f);
+        return KB_NOMEM;
+    }
+    knowledge_set_fulltext(*kb, true);
+    knowledge_set_phonetic(*kb, "who", true);
+    return knowledge_read(*kb, f);
+}
+
+/*
+ * Learn a few entities, for alloc_tests(): new ones, and one already known.
+ *
+ * Returns:
+ *   KB_OK, if all were learned
+ *   the first error, otherwise
+ */
+static int put_entities(KNOWLEDGE_BASE *kb)
+{
+    static const char *entities[ALLOC_TEST_PUTS][3] = {
+        { "what", "alloc test", "A test of memory allocation failures." },
+        { "who", "Alloc Tester", "Someone who fails allocations." },
+        { "where", "alloc test", "In my_alloc.c." },
+        { "what", "alloc test", "A test that learns something again." }
+    };
+    int status = KB_OK;
+
+    for (int k = 0; k < ALLOC_TEST_PUTS && status == KB_OK; k++)
+    {
+        status = knowledge_put(kb, entities[k][0], entities[k][1], entities[k][2]);
+    }
+    return status;
+}
+
+/*
+ * Check that a knowledge base still answers every entity of another, built
+ * without any failures, with the same response, for alloc_tests().
+ *
+ * Input:
+ *   expected   - the knowledge base built without failures
+ *   kb         - the knowledge base to check
+ *
+ * Returns:
+ *   the number of entities that were not answered, or answered differently
+ */
+static int compare_knowledge(KNOWLEDGE_BASE *expected, KNOWLEDGE_BASE *kb)
+{
+    static const char *intents[NUM_INTENTS] = { "what", "where", "who" };
+    char text[MAX_RESPONSE];
+    char response[MAX_RESPONSE];
+    TREE_CURSOR cursor;
+    int wrong = 0;
+
+    for (int i = 0; i < NUM_INTENTS; i++)
+    {
+        if (!cursor_open(&cursor, expected->root[i]))
+        {
+            return 1;
+        }
+        for (KB_NODE *node = cursor_next(&cursor); node != NULL; node = cursor_next(&cursor))
+        {
+            if (knowledge_get(kb, intents[i], node->entity, NULL, response, MAX_RESPONSE) != KB_OK ||
+                strcmp(response, intern_read(node->response, text)) != 0)
+            {
+                wrong++;
+            }
+        }
+        cursor_close(&cursor);
+    }
+    return wrong;
+}
+
+/*
+ * Run one step of alloc_tests() with each of its allocations failed in turn,
+ * and report the failures that were neither reported as KB_NOMEM nor
+ * recovered from, or that leaked. A failure is only recovered from if the
+ * knowledge base still answers everything that was read or learned.
+ *
+ * Input:
+ *   name       - the name of the step
+ *   filename   - the file to read
+ *   put        - true to sweep knowledge_put() (after reading the file),
+ *                false to sweep knowledge_read()
+ *
+ * Returns:
+ *   the number of failure points that went wrong
+ */
+static int sweep(const char *name, const char *filename, bool put)
+{
+    KNOWLEDGE_BASE *kb;
+    int errors = 0;
+    int reported = 0;
+    int recovered = 0;
+    int status = KB_OK;
+    long points = 0;
+    size_t peak = 0;
+
+    // Without failures, to count the allocations of the step (twice, so that
+    // anything that every knowledge base shares, such as the response store,
+    // has grown before the sweep, and is not mistaken for a leak)
+    for (int run = 0; run < 2 && status >= 0; run++)
+    {
+        status = put ? read_file(filename, &kb) : KB_OK;
+        alloc_reset_peaks();
+        size_t before = alloc_total().live;
+        alloc_fail(0, 0);
+
+        if (status >= 0)
+        {
+            status = put ? put_entities(kb) : read_file(filename, &kb);
+        }
+        points = alloc_counted();
+        peak = alloc_total().peak - before;
+        knowledge_free(kb);
+    }
+    if (status < 0)
+    {
+        printf("%s: failed without any allocation failures (%d)\n", name, status);
+        return 1;
+    }
+    printf("%s: %ld allocations, peak %zu bytes\n", name, points, peak);
+
+    // What the knowledge base should know after the step
+    KNOWLEDGE_BASE *expected;
+    status = read_file(filename, &expected);
+    if (status >= 0 && put)
+    {
+        status = put_entities(expected);
+    }
+    if (status < 0)
+    {
+        printf("%s: failed without any allocation failures (%d)\n", name, status);
+        knowledge_free(expected);
+        return 1;
+    }
+
+    for (long n = 1; n <= points; n++)
+    {
+        size_t live = alloc_total().live;
+        int wrong = 0;
+
+        if (put)
+        {
+            read_file(filename, &kb);
+            alloc_fail(n, 1);
+            status = kb == NULL ? KB_NOMEM : put_entities(kb);
+        }
+        else
+        {
+            alloc_fail(n, 1);
+            status = read_file(filename, &kb);
+        }
+        const char *failed = alloc_last_failure();
+        alloc_fail(0, 0);
+        if (status >= 0)
+        {
+            wrong = compare_knowledge(expected, kb);
+        }
+        knowledge_free(kb);
+
+        // Either reported, or recovered from (e.g. an index left incomplete)
+        long long leaked = (long long) alloc_total().live - (long long) live;
+        if (status == KB_NOMEM)
+        {
+            reported++;
+        }
+        else if (status >= 0)
+        {
+            recovered++;
+        }
+        if ((status < 0 && status != KB_NOMEM) || leaked != 0 || wrong > 0)
+        {
+            printf("  allocation %ld (%s): returned %d, leaked %lld bytes, %d entities lost\n", n, failed == NULL ? "none" : failed, status, leaked, wrong);
+            errors++;
+        }
+    }
+    knowledge_free(expected);
+
+    printf("%s: %ld failure points, %d reported, %d recovered from, %d wrong\n", name, points, reported, recovered, errors);
+    return errors;
+}
+#endif
+
+/*
+ * Fail each allocation of knowledge_read() and knowledge_put() in turn,
+ * checking that each failure is either reported as KB_NOMEM or recovered
+ * from, and that freeing the knowledge base afterwards frees everything it
+ * allocated. Only meaningful when compiled with -DKB_ALLOC_TRACKING.
+ *
+ * Input:
+ *   filename   - the file to read
+ *
+ * Returns:
+ *   the number of failure points that went wrong
+ */
+int alloc_tests(const char *filename)
+{
+    printf("== BEGIN my_alloc.c TESTS ==\n\n");
+
+#ifdef KB_ALLOC_TRACKING
+    int errors = sweep("knowledge_read", filename, false);
+    errors += sweep("knowledge_put", filename, true);
+    printf("\n");
+    alloc_report(stdout);
+#else
+    int errors = 0;
+    (void) filename;
+    printf("(compile with -DKB_ALLOC_TRACKING to track allocations)\n");
+#endif
+
+    printf("\n== END my_alloc.c TESTS ==\n\n");
+    return errors;
+}
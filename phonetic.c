@@ -0,0 +1,594 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the phonetic index, which finds the names that sound
+ * like a misspelt one ("Frank Gwan" for "Frank Guan"), so that they can be
+ * offered before the closest match by ASCII difference (see
+ * knowledge_set_phonetic()).
+ *
+ * Each word of a name is reduced to a phonetic key, after Metaphone: vowels
+ * are dropped after the first letter, letters that sound alike share a code
+ * (e.g. "ph" and "v" are F, "zh" and "j" are J) and letters that are mostly
+ * silent (h, w and y, except at the start of a word) are dropped. The index
+ * lists, for each key, the names with a word of that key, so a name is
+ * looked up in O(1) average time per word. The names found are ranked by how
+ * many of the words asked about they sound like, so "Jang Zhengkwee" still
+ * finds "Wang Zhengkui" through its surname.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include "chat1002.h"
+
+/* the initial number of buckets of the table of keys */
+#define PHONETIC_BUCKETS    64
+
+/* the most words of a name that are looked up */
+#define PHONETIC_WORDS      8
+
+/* the most names that one lookup finds */
+#define PHONETIC_RANKED     32
+
+/*
+ * Determine whether a letter is a vowel.
+ */
+static bool is_vowel(char c)
+{
+    return c == 'a' || c == 'e' || c == 'i' || c == 'o' || c == 'u';
+}
+
+/*
+ * Get the letter at a position of a word, or '\0' past its end.
+ */
+static char letter(const char *word, int length, int i)
+{
+    return i >= 0 && i < length ? (char) tolower((unsigned char) word[i]) : '\0';
+}
+
+/*
+ * Reduce a word to its phonetic key (see the comment at the top of the file).
+ * A letter that has the same code as the letter before it adds nothing, so
+ * "Anna" and "Ana" (or "Zhengkui" and "Zhengkwee") have the same key.
+ *
+ * Input:
+ *   word       - the word (its letters are read, up to <length>)
+ *   length     - the number of characters of the word
+ *   key        - a buffer of PHONETIC_KEY characters to receive the key
+ */
+void phonetic_key(const char *word, int length, char *key)
+{
+    int used = 0;
+    char last = '\0';
+    int i = 0;
+
+    // Silent first letters
+    char c0 = letter(word, length, 0), c1 = letter(word, length, 1);
+    if ((c0 == 'k' || c0 == 'g' || c0 == 'p') && c1 == 'n')
+    {
+        i = 1;
+    }
+    else if ((c0 == 'w' && c1 == 'r') || (c0 == 'p' && c1 == 's'))
+    {
+        i = 1;
+    }
+
+    for (int start = i; i < length && used < PHONETIC_KEY - 1; i++)
+    {
+        char c = letter(word, length, i);
+        char next = letter(word, length, i + 1);
+        char after = letter(word, length, i + 2);
+        const char *code = "";
+
+        if (!isalpha((unsigned char) c))
+        {
+            continue;
+        }
+        if (is_vowel(c))
+        {
+            code = i == start ? "A" : "";
+        }
+        else switch (c)
+        {
+            case 'b':
+                code = i > 0 && letter(word, length, i - 1) == 'm' && next == '\0' ? "" : "P";
+                break;
+            case 'c':
+                if (next == 'h')
+                {
+                    code = "X";
+                    i++;
+                }
+                else
+                {
+                    code = next == 'e' || next == 'i' || next == 'y' ? "S" : "K";
+                }
+                break;
+            case 'd':
+                code = next == 'g' && (after == 'e' || after == 'i' || after == 'y') ? "J" : "T";
+                break;
+            case 'g':
+                if (next == 'h')
+                {
+                    code = i == start ? "K" : "";
+                    i++;
+                }
+                else
+                {
+                    code = next == 'e' || next == 'i' || next == 'y' ? "J" : "K";
+                }
+                break;
+            case 'h':
+            case 'w':
+            case 'y':
+                // Only sounded at the start of a word, before a vowel
+                code = i == start && (is_vowel(next) || (c == 'w' && next == 'h')) ? (c == 'h' ? "H" : c == 'w' ? "W" : "Y") : "";
+                break;
+            case 'p':
+                code = next == 'h' ? "F" : "P";
+                i += next == 'h';
+                break;
+            case 's':
+                if (next == 'h' || ((next == 'i') && (after == 'o' || after == 'a')))
+                {
+                    code = "X";
+                    i += next == 'h';
+                }
+                else
+                {
+                    code = next == 'c' && after == 'h' ? "SK" : "S";
+                    i += next == 'c' && after == 'h' ? 2 : 0;
+                }
+                break;
+            case 't':
+                if (next == 'h')
+                {
+                    code = "0";
+                    i++;
+                }
+                else if (next == 'i' && (after == 'o' || after == 'a'))
+                {
+                    code = "X";
+                }
+                else
+                {
+                    code = next == 'c' && after == 'h' ? "" : "T";
+                }
+                break;
+            case 'v':
+                code = "F";
+                break;
+            case 'q':
+                code = "K";
+                break;
+            case 'x':
+                code = i == start ? "S" : "KS";
+                break;
+            case 'z':
+                code = next == 'h' ? "J" : "S";
+                i += next == 'h';
+                break;
+            default:
+                // f, j, k, l, m, n and r are their own codes
+                code = c == 'f' ? "F" : c == 'j' ? "J" : c == 'k' ? "K" : c == 'l' ? "L" : c == 'm' ? "M" : c == 'n' ? "N" : "R";
+                break;
+        }
+
+        for (; *code != '\0' && used < PHONETIC_KEY - 1; code++)
+        {
+            if (*code != last)
+            {
+                key[used++] = *code;
+            }
+            last = *code;
+        }
+
+        // A vowel between two letters of the same code keeps them apart
+        if (is_vowel(c))
+        {
+            last = '\0';
+        }
+    }
+
+    key[used] = '\0';
+}
+
+/*
+ * Find the next word of a name: a run of letters. A run of letters and digits
+ * ("ICT1002") is not a name, so it is skipped.
+ *
+ * Input:
+ *   name       - the rest of the name
+ *   length     - receives the number of letters of the word
+ *
+ * Returns:
+ *   the start of the word
+ *   NULL, if there are no more words
+ */
+static const char *next_word(const char *name, int *length)
+{
+    while (*name != '\0')
+    {
+        while (*name != '\0' && !isalnum((unsigned char) *name))
+        {
+            name++;
+        }
+
+        bool digits = false;
+        *length = 0;
+        while (isalnum((unsigned char) name[*length]))
+        {
+            digits = digits || isdigit((unsigned char) name[*length]);
+            (*length)++;
+        }
+
+        if (*length > 0 && !digits)
+        {
+            return name;
+        }
+        name += *length;
+    }
+    return NULL;
+}
+
+/*
+ * Get the distinct phonetic keys of the words of a name.
+ *
+ * Returns:
+ *   the number of keys (at most PHONETIC_WORDS)
+ */
+static int name_keys(const char *name, char keys[][PHONETIC_KEY])
+{
+    int n = 0;
+    int length;
+
+    for (const char *word = next_word(name, &length); word != NULL && n < PHONETIC_WORDS; word = next_word(word + length, &length))
+    {
+        phonetic_key(word, length, keys[n]);
+
+        bool seen = keys[n][0] == '\0';
+        for (int k = 0; k < n && !seen; k++)
+        {
+            seen = strcmp(keys[k], keys[n]) == 0;
+        }
+        if (!seen)
+        {
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Creates an empty phonetic index.
+ *
+ * Returns:
+ *   the pointer to the new index, if successful
+ *   NULL, if there was a memory allocation failure
+ */
+PHONETIC_INDEX *phonetic_create()
+{
+    PHONETIC_INDEX *index = calloc(1, sizeof(PHONETIC_INDEX));
+
+    if (index == NULL)
+    {
+        return NULL;
+    }
+
+    index->keys = hash_create(PHONETIC_BUCKETS);
+    if (index->keys == NULL)
+    {
+        free(index);
+        return NULL;
+    }
+    index->bytes = sizeof(PHONETIC_INDEX);
+    return index;
+}
+
+/*
+ * Free the names of a phonetic key.
+ */
+static void free_names(void *value)
+{
+    PHONETIC_NAMES *names = value;
+
+    for (int k = 0; k < names->count; k++)
+    {
+        free(names->entities[k]);
+    }
+    free(names->entities);
+    free(names);
+}
+
+/*
+ * Free a phonetic index.
+ *
+ * Input:
+ *   index      - the index (may be NULL)
+ */
+void phonetic_free(PHONETIC_INDEX *index)
+{
+    if (index != NULL)
+    {
+        hash_destroy(index->keys, free_names);
+        free(index);
+    }
+}
+
+/*
+ * Index a name by the phonetic keys of its words. Indexing a name that is
+ * already indexed does nothing.
+ *
+ * Input:
+ *   index      - the index
+ *   entity     - the name
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure (the name may then be
+ *     indexed by only some of its words)
+ */
+int phonetic_put(PHONETIC_INDEX *index, const char *entity)
+{
+    char keys[PHONETIC_WORDS][PHONETIC_KEY];
+    int n = name_keys(entity, keys);
+
+    for (int k = 0; k < n; k++)
+    {
+        PHONETIC_NAMES *names = hash_get(index->keys, keys[k]);
+        if (names == NULL)
+        {
+            if ((names = calloc(1, sizeof(PHONETIC_NAMES))) == NULL)
+            {
+                return KB_NOMEM;
+            }
+            if (hash_put(index->keys, keys[k], names) != KB_OK)
+            {
+                free(names);
+                return KB_NOMEM;
+            }
+            index->bytes += sizeof(PHONETIC_NAMES) + sizeof(HASH_ENTRY) + strlen(keys[k]) + 1;
+        }
+
+        bool known = false;
+        for (int m = 0; m < names->count && !known; m++)
+        {
+            known = compare_token(names->entities[m], entity) == 0;
+        }
+        if (known)
+        {
+            continue;
+        }
+
+        if (names->count == names->capacity)
+        {
+            int capacity = names->capacity == 0 ? 2 : names->capacity * 2;
+            char **entities = realloc(names->entities, capacity * sizeof(char *));
+
+            if (entities == NULL)
+            {
+                return KB_NOMEM;
+            }
+            index->bytes += (capacity - names->capacity) * sizeof(char *);
+            names->entities = entities;
+            names->capacity = capacity;
+        }
+
+        char *copy = malloc(strlen(entity) + 1);
+        if (copy == NULL)
+        {
+            return KB_NOMEM;
+        }
+        strcpy(copy, entity);
+        names->entities[names->count++] = copy;
+        index->bytes += strlen(entity) + 1;
+    }
+
+    return KB_OK;
+}
+
+/*
+ * Remove a name from a phonetic index, if it is indexed.
+ *
+ * Input:
+ *   index      - the index
+ *   entity     - the name
+ */
+void phonetic_remove(PHONETIC_INDEX *index, const char *entity)
+{
+    char keys[PHONETIC_WORDS][PHONETIC_KEY];
+    int n = name_keys(entity, keys);
+
+    for (int k = 0; k < n; k++)
+    {
+        PHONETIC_NAMES *names = hash_get(index->keys, keys[k]);
+
+        for (int m = 0; names != NULL && m < names->count; m++)
+        {
+            if (compare_token(names->entities[m], entity) == 0)
+            {
+                index->bytes -= strlen(names->entities[m]) + 1;
+                free(names->entities[m]);
+                names->entities[m] = names->entities[--names->count];
+                break;
+            }
+        }
+
+        // The last name of the key
+        if (names != NULL && names->count == 0)
+        {
+            index->bytes -= sizeof(PHONETIC_NAMES) + sizeof(HASH_ENTRY) + strlen(keys[k]) + 1 + names->capacity * sizeof(char *);
+            free_names(hash_remove(index->keys, keys[k]));
+        }
+    }
+}
+
+/*
+ * Order the copies of names gathered by phonetic_lookup().
+ */
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+/*
+ * Find the names that sound like a name, best first. A name is ranked by the
+ * number of words asked about that it has a word sounding like, then by its
+ * ASCII difference from the name asked about (see get_ascii_difference()).
+ * Only the names that sound like at least half of the words asked about are
+ * found.
+ *
+ * Every name filed under a key of the name asked about is scored before any
+ * is ranked, so the time taken grows with the number of names filed under
+ * those keys (as O(L log L) for L names, as they are sorted to count them).
+ *
+ * Input:
+ *   index      - the index
+ *   entity     - the name asked about
+ *   found      - receives the names found (pointers into the index, valid
+ *                until it is next changed)
+ *   max        - the most names to find
+ *
+ * Returns:
+ *   the number of names found
+ */
+int phonetic_lookup(PHONETIC_INDEX *index, const char *entity, const char **found, int max)
+{
+    char keys[PHONETIC_WORDS][PHONETIC_KEY];
+    int n = name_keys(entity, keys);
+    PHONETIC_NAMES *names[PHONETIC_WORDS];
+    int total = 0;
+
+    if (max > PHONETIC_RANKED)
+    {
+        max = PHONETIC_RANKED;
+    }
+    if (max <= 0)
+    {
+        return 0;
+    }
+
+    for (int k = 0; k < n; k++)
+    {
+        names[k] = hash_get(index->keys, keys[k]);
+        total += names[k] != NULL ? names[k]->count : 0;
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    // Gather every name filed under the keys, and sort them so that each
+    // name's copies (one per word it shares with the name asked about) are
+    // together; the number of copies is its score
+    const char **candidates = malloc(total * sizeof(const char *));
+    if (candidates == NULL)
+    {
+        return 0;
+    }
+    int count = 0;
+    for (int k = 0; k < n; k++)
+    {
+        for (int m = 0; names[k] != NULL && m < names[k]->count; m++)
+        {
+            candidates[count++] = names[k]->entities[m];
+        }
+    }
+    qsort(candidates, count, sizeof(const char *), compare_names);
+
+    // Keep the best <max> of those that sound like enough, best first
+    int score[PHONETIC_RANKED];
+    int difference[PHONETIC_RANKED];
+    int kept = 0;
+    for (int c = 0; c < count; )
+    {
+        const char *name = candidates[c];
+        int s = 0;
+        while (c < count && strcmp(candidates[c], name) == 0)
+        {
+            s++;
+            c++;
+        }
+        if (s * 2 < n || (kept == max && s < score[kept - 1]))
+        {
+            continue;
+        }
+
+        int d = get_ascii_difference(entity, name);
+        int at = kept < max ? kept++ : max;
+        while (at > 0 && (s > score[at - 1] || (s == score[at - 1] && d < difference[at - 1])))
+        {
+            if (at < max)
+            {
+                found[at] = found[at - 1];
+                score[at] = score[at - 1];
+                difference[at] = difference[at - 1];
+            }
+            at--;
+        }
+        if (at < max)
+        {
+            found[at] = name;
+            score[at] = s;
+            difference[at] = d;
+        }
+    }
+
+    free(candidates);
+    return kept;
+}
+
+/*
+ * Runs a series of test cases on phonetic.c
+ *
+ * NOTE: this function does not check for memory allocation failures.
+ * When 'faking' mallocs for testing purposes, do not run this function.
+ */
+int phonetic_tests()
+{
+    char key[PHONETIC_KEY];
+    char name[MAX_ENTITY];
+    char match[MAX_ENTITY];
+    char response[MAX_RESPONSE];
+    const char *found[PHONETIC_CANDIDATES];
+
+    printf("== BEGIN phonetic.c TESTS ==\n\n");
+
+    phonetic_key("Phillip", 7, key);
+    printf("Phillip: %s\n", key);
+    phonetic_key("Filip", 5, key);
+    printf("Filip: %s\n\n", key);
+
+    /* Far more names than are found share the keys of "Tan" and "Ming", and
+       come before the best match; it must still be found first */
+    PHONETIC_INDEX *index = phonetic_create();
+    KNOWLEDGE_BASE *kb = knowledge_create("phonetic_tests");
+    for (int k = 0; k < 200; k++)
+    {
+        snprintf(name, MAX_ENTITY, "Tan Ya Ming Q%d", k);
+        phonetic_put(index, name);
+        knowledge_put(kb, "who", name, "Not the one.");
+    }
+    phonetic_put(index, "Tan Wei Ming");
+    knowledge_put(kb, "who", "Tan Wei Ming", "The one.");
+
+    int n = phonetic_lookup(index, "Tan Wee Ming", found, PHONETIC_CANDIDATES);
+    printf("Sounds like Tan Wee Ming (expect Tan Wei Ming first):");
+    for (int k = 0; k < n; k++)
+    {
+        printf(" %s;", found[k]);
+    }
+    printf("\n");
+
+    knowledge_set_phonetic(kb, "who", true);
+    int status = knowledge_get(kb, "who", "Tan Wee Ming", match, response, MAX_RESPONSE);
+    printf("Who is Tan Wee Ming (expect Tan Wei Ming): %s\n\n", status == KB_CLOSESTMATCH ? match : "(none)");
+
+    knowledge_free(kb);
+    phonetic_free(index);
+
+    printf("== END phonetic.c TESTS ==\n\n");
+    return 0;
+}
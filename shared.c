@@ -0,0 +1,581 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements shared knowledge bases, which let one process load a
+ * knowledge base and many worker processes answer questions from it, without
+ * each worker reading the file and holding its own copy.
+ *
+ * The loader publishes a knowledge base into a POSIX shared-memory segment,
+ * "/marc.<name>.<generation>". The segment is position-independent: a
+ * SHARED_HEADER, then the BST nodes of every intent, then their strings, all
+ * linked by 32-bit offsets from the start of the segment. Once published, a
+ * segment is never changed.
+ *
+ * Workers find the current generation in a small control segment,
+ * "/marc.<name>", and map it read-only. To publish a new version, the loader
+ * writes a new segment and then swaps the generation in the control segment
+ * atomically; workers map the new segment on their next lookup. The name of
+ * the old segment is removed, and its memory is freed when the last worker
+ * unmaps it.
+ *
+ * Only one process should publish under a name at a time. Shared memory is
+ * not available on Windows, where publishing and attaching fail.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "chat1002.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Get the names of the control segment and of the segment of a generation.
+ *
+ * Returns:
+ *   true, if the name is a valid name for a shared knowledge base
+ *   false, if it is empty, too long or contains a '/'
+ */
+static bool shared_names(const char *name, unsigned generation, char *control, char *data)
+{
+    if (name[0] == '\0' || name[0] == '.' || strlen(name) >= MAX_TENANT || strchr(name, '/') != NULL)
+    {
+        return false;
+    }
+
+    snprintf(control, MAX_INPUT, "/marc.%s", name);
+    snprintf(data, MAX_INPUT, "/marc.%s.%u", name, generation);
+    return true;
+}
+
+/*
+ * Collect up to <max> nodes of a BST in order, keeping a stack rather than
+ * recursing.
+ *
+ * Returns:
+ *   the number of nodes collected
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int collect_nodes(KB_NODE *root, KB_NODE **nodes, int max)
+{
+    int capacity = 64;
+    int top = 0;
+    int n = 0;
+    KB_NODE **stack = malloc(capacity * sizeof(KB_NODE *));
+
+    if (stack == NULL)
+    {
+        return KB_NOMEM;
+    }
+
+    while ((root != NULL || top > 0) && n < max)
+    {
+        // Down the left spine
+        while (root != NULL)
+        {
+            if (top == capacity)
+            {
+                KB_NODE **bigger = realloc(stack, capacity * 2 * sizeof(KB_NODE *));
+                if (bigger == NULL)
+                {
+                    free(stack);
+                    return KB_NOMEM;
+                }
+                stack = bigger;
+                capacity *= 2;
+            }
+            stack[top++] = root;
+            root = root->left_child;
+        }
+
+        root = stack[--top];
+        nodes[n++] = root;
+        root = root->right_child;
+    }
+
+    free(stack);
+    return n;
+}
+
+/*
+ * Link the shared nodes first[0..n) (in sorted order) into a balanced BST,
+ * in the same shape as vine_to_balanced_bst().
+ *
+ * Returns:
+ *   the offset of the root, or 0 if n is 0
+ */
+static uint32_t link_nodes(char *base, uint32_t first, int n)
+{
+    if (n <= 0)
+    {
+        return 0;
+    }
+
+    int mid = n / 2;
+    uint32_t root = first + mid * sizeof(SHARED_NODE);
+    SHARED_NODE *node = (SHARED_NODE *) (base + root);
+
+    node->left_child = link_nodes(base, first, mid);
+    node->right_child = link_nodes(base, root + sizeof(SHARED_NODE), n - mid - 1);
+    return root;
+}
+
+/*
+ * Publish a knowledge base as a new generation under a name, for workers to
+ * attach to with shared_attach(). Workers already attached move to the new
+ * generation on their next lookup.
+ *
+ * Input:
+ *   name       - the name to publish under
+ *   kb         - the knowledge base
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if the name is not valid or the segments could not be created
+ *   KB_NOMEM, if there was a memory allocation failure (or the knowledge base
+ *   is too large for 32-bit offsets)
+ */
+int shared_publish(const char *name, KNOWLEDGE_BASE *kb)
+{
+    char control_name[MAX_INPUT];
+    char data_name[MAX_INPUT];
+
+    if (!shared_names(name, 0, control_name, data_name))
+    {
+        return KB_INVALID;
+    }
+
+    // The nodes of every intent, in order, and the size they need
+    int total = 0;
+    for (int i = 0; i < NUM_INTENTS; i++)
+    {
+        total += kb->count[i];
+    }
+
+    KB_NODE **nodes = malloc((total > 0 ? total : 1) * sizeof(KB_NODE *));
+    if (nodes == NULL)
+    {
+        return KB_NOMEM;
+    }
+
+    int count[NUM_INTENTS];
+    int collected = 0;
+    for (int i = 0; i < NUM_INTENTS; i++)
+    {
+        count[i] = collect_nodes(kb->root[i], nodes + collected, total - collected);
+        if (count[i] < 0)
+        {
+            free(nodes);
+            return KB_NOMEM;
+        }
+        collected += count[i];
+    }
+    total = collected;
+
+    uint64_t size = sizeof(SHARED_HEADER) + (uint64_t) total * sizeof(SHARED_NODE);
+    for (int k = 0; k < total; k++)
+    {
+        size += strlen(nodes[k]->entity) + intern_length(nodes[k]->response) + 2;
+    }
+    if (size > UINT32_MAX)
+    {
+        free(nodes);
+        return KB_NOMEM;
+    }
+
+    // The control segment (created by the first publication)
+    int fd = shm_open(control_name, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (st.st_size < (off_t) sizeof(SHARED_CONTROL) &&
+        ftruncate(fd, sizeof(SHARED_CONTROL)) != 0))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        free(nodes);
+        return KB_INVALID;
+    }
+    SHARED_CONTROL *control = mmap(NULL, sizeof(SHARED_CONTROL), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (control == MAP_FAILED)
+    {
+        free(nodes);
+        return KB_NOMEM;
+    }
+
+    unsigned old_generation = atomic_load(&control->generation);
+    unsigned generation = old_generation + 1 != 0 ? old_generation + 1 : 1;
+    shared_names(name, generation, control_name, data_name);
+
+    // The segment of the new generation (replacing any left by a crash)
+    shm_unlink(data_name);
+    fd = shm_open(data_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    char *base = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, (off_t) size) == 0)
+    {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (base == MAP_FAILED)
+    {
+        int status = fd < 0 ? KB_INVALID : KB_NOMEM;
+        shm_unlink(data_name);
+        munmap(control, sizeof(SHARED_CONTROL));
+        free(nodes);
+        return status;
+    }
+
+    // Nodes, then strings
+    SHARED_HEADER *header = (SHARED_HEADER *) base;
+    uint32_t first = sizeof(SHARED_HEADER);
+    uint32_t text = first + total * sizeof(SHARED_NODE);
+    for (int k = 0; k < total; k++)
+    {
+        SHARED_NODE *node = (SHARED_NODE *) (base + first + k * sizeof(SHARED_NODE));
+        char plain[MAX_RESPONSE];
+        const char *response = intern_read(nodes[k]->response, plain);
+        size_t entity_size = strlen(nodes[k]->entity) + 1;
+        size_t response_size = intern_length(nodes[k]->response) + 1;
+
+        node->entity = text;
+        memcpy(base + text, nodes[k]->entity, entity_size);
+        node->response = text + entity_size;
+        memcpy(base + text + entity_size, response, response_size);
+        text += entity_size + response_size;
+    }
+    for (int i = 0; i < NUM_INTENTS; i++)
+    {
+        header->root[i] = link_nodes(base, first, count[i]);
+        header->count[i] = count[i];
+        first += count[i] * sizeof(SHARED_NODE);
+    }
+    header->generation = generation;
+    header->size = size;
+    header->magic = SHARED_MAGIC;
+    munmap(base, size);
+    free(nodes);
+
+    // Swap the generation, then retire the old one (workers that have it
+    // mapped keep it until they move on)
+    atomic_store(&control->generation, generation);
+    munmap(control, sizeof(SHARED_CONTROL));
+    if (old_generation != 0)
+    {
+        shared_names(name, old_generation, control_name, data_name);
+        shm_unlink(data_name);
+    }
+
+    return KB_OK;
+}
+
+/*
+ * Withdraw a shared knowledge base. Workers that are attached keep the
+ * generation they have, but see no new ones.
+ *
+ * Input:
+ *   name       - the name it was published under
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOTFOUND, if nothing is published under the name
+ *   KB_INVALID, if the name is not valid
+ */
+int shared_unpublish(const char *name)
+{
+    char control_name[MAX_INPUT];
+    char data_name[MAX_INPUT];
+
+    if (!shared_names(name, 0, control_name, data_name))
+    {
+        return KB_INVALID;
+    }
+
+    int fd = shm_open(control_name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return KB_NOTFOUND;
+    }
+
+    SHARED_CONTROL *control = mmap(NULL, sizeof(SHARED_CONTROL), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (control != MAP_FAILED)
+    {
+        shared_names(name, atomic_load(&control->generation), control_name, data_name);
+        shm_unlink(data_name);
+        munmap(control, sizeof(SHARED_CONTROL));
+    }
+
+    shm_unlink(control_name);
+    return KB_OK;
+}
+
+/*
+ * Map the current generation of a shared knowledge base, in place of the one
+ * mapped (which is kept if the new one cannot be mapped).
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOTFOUND, if nothing has been published
+ *   KB_INVALID, if the segment could not be mapped or is not valid
+ */
+static int shared_map(SHARED_KB *shared)
+{
+    char control_name[MAX_INPUT];
+    char data_name[MAX_INPUT];
+    unsigned generation;
+    int fd;
+
+    // A generation may be retired between reading it and opening it
+    do
+    {
+        generation = atomic_load(&shared->control->generation);
+        if (generation == 0)
+        {
+            return KB_NOTFOUND;
+        }
+
+        shared_names(shared->name, generation, control_name, data_name);
+        fd = shm_open(data_name, O_RDONLY, 0);
+    } while (fd < 0 && errno == ENOENT && atomic_load(&shared->control->generation) != generation);
+
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(SHARED_HEADER))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return KB_INVALID;
+    }
+
+    const char *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        return KB_INVALID;
+    }
+
+    // A complete segment, whose strings are all terminated within it
+    const SHARED_HEADER *header = (const SHARED_HEADER *) base;
+    if (header->magic != SHARED_MAGIC || header->size != (uint64_t) st.st_size ||
+        header->generation != generation || base[st.st_size - 1] != '\0')
+    {
+        munmap((void *) base, st.st_size);
+        return KB_INVALID;
+    }
+
+    if (shared->base != NULL)
+    {
+        munmap((void *) shared->base, shared->size);
+    }
+    shared->base = base;
+    shared->size = st.st_size;
+    shared->generation = generation;
+    return KB_OK;
+}
+
+/*
+ * Attach to a shared knowledge base, read-only.
+ *
+ * Input:
+ *   name       - the name it was published under
+ *   status     - set to KB_OK, KB_NOTFOUND (nothing is published under the
+ *                name), KB_INVALID (the name or segment is not valid) or
+ *                KB_NOMEM (memory allocation failure)
+ *
+ * Returns:
+ *   the shared knowledge base, if successful
+ *   NULL, otherwise
+ */
+SHARED_KB *shared_attach(const char *name, int *status)
+{
+    char control_name[MAX_INPUT];
+    char data_name[MAX_INPUT];
+
+    if (!shared_names(name, 0, control_name, data_name))
+    {
+        *status = KB_INVALID;
+        return NULL;
+    }
+
+    int fd = shm_open(control_name, O_RDONLY, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(SHARED_CONTROL))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        *status = KB_NOTFOUND;
+        return NULL;
+    }
+
+    SHARED_KB *shared = calloc(1, sizeof(SHARED_KB));
+    SHARED_CONTROL *control = mmap(NULL, sizeof(SHARED_CONTROL), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == NULL || control == MAP_FAILED)
+    {
+        if (control != MAP_FAILED)
+        {
+            munmap(control, sizeof(SHARED_CONTROL));
+        }
+        free(shared);
+        *status = KB_NOMEM;
+        return NULL;
+    }
+
+    snprintf(shared->name, MAX_TENANT, "%s", name);
+    shared->control = control;
+    *status = shared_map(shared);
+    if (*status != KB_OK)
+    {
+        shared_detach(shared);
+        return NULL;
+    }
+
+    return shared;
+}
+
+/*
+ * Get a node of a shared segment from its offset.
+ *
+ * Returns:
+ *   the node, or NULL if the offset is 0 (or outside the segment)
+ */
+static const SHARED_NODE *shared_node(const SHARED_KB *shared, uint32_t offset)
+{
+    if (offset == 0 || offset > shared->size - sizeof(SHARED_NODE))
+    {
+        return NULL;
+    }
+    return (const SHARED_NODE *) (shared->base + offset);
+}
+
+/*
+ * Get the response to a question from a shared knowledge base, moving to the
+ * latest generation first if a new one has been published. Like search(),
+ * the closest match is found if the entity is not known.
+ *
+ * Input:
+ *   shared     - the shared knowledge base
+ *   intent     - the question word
+ *   entity     - the entity
+ *   match      - a buffer of MAX_ENTITY characters to receive the entity of
+ *                the closest match (may be NULL)
+ *   response   - a buffer to receive the response
+ *   n          - the maximum number of characters to write to the response buffer
+ *
+ * Returns:
+ *   as knowledge_get()
+ */
+int shared_get(SHARED_KB *shared, const char *intent, const char *entity, char *match, char *response, int n)
+{
+    int i = get_intent(intent);
+
+    if (i < 0)
+    {
+        return KB_INVALID;
+    }
+
+    if (atomic_load(&shared->control->generation) != shared->generation)
+    {
+        shared_map(shared);
+    }
+
+    const SHARED_HEADER *header = (const SHARED_HEADER *) shared->base;
+    const SHARED_NODE *node = shared_node(shared, header->root[i]);
+    const SHARED_NODE *closest = NULL;
+    int closest_difference = 0;
+
+    while (node != NULL)
+    {
+        const char *node_entity = shared->base + node->entity;
+        int cmp = compare_token(entity, node_entity);
+
+        // Found
+        if (cmp == 0)
+        {
+            snprintf(response, n, "%s", shared->base + node->response);
+            return KB_OK;
+        }
+
+        int difference = get_ascii_difference(entity, node_entity);
+        if (closest == NULL || difference < closest_difference)
+        {
+            closest = node;
+            closest_difference = difference;
+        }
+        node = shared_node(shared, cmp > 0 ? node->right_child : node->left_child);
+    }
+
+    // Not found (offer the closest match, if it is close enough)
+    if (closest == NULL || closest_difference >= MAX_DIFFERENCE)
+    {
+        return KB_NOTFOUND;
+    }
+
+    if (match != NULL)
+    {
+        snprintf(match, MAX_ENTITY, "%s", shared->base + closest->entity);
+    }
+    snprintf(response, n, "%s", shared->base + closest->response);
+    return KB_CLOSESTMATCH;
+}
+
+/*
+ * Detach from a shared knowledge base.
+ *
+ * Input:
+ *   shared     - the shared knowledge base (may be NULL)
+ */
+void shared_detach(SHARED_KB *shared)
+{
+    if (shared != NULL)
+    {
+        if (shared->base != NULL)
+        {
+            munmap((void *) shared->base, shared->size);
+        }
+        munmap(shared->control, sizeof(SHARED_CONTROL));
+        free(shared);
+    }
+}
+
+#else
+
+int shared_publish(const char *name, KNOWLEDGE_BASE *kb)
+{
+    return KB_INVALID;
+}
+
+int shared_unpublish(const char *name)
+{
+    return KB_INVALID;
+}
+
+SHARED_KB *shared_attach(const char *name, int *status)
+{
+    *status = KB_INVALID;
+    return NULL;
+}
+
+int shared_get(SHARED_KB *shared, const char *intent, const char *entity, char *match, char *response, int n)
+{
+    return KB_NOTFOUND;
+}
+
+void shared_detach(SHARED_KB *shared)
+{
+}
+
+#endif
@@ -0,0 +1,502 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the data-driven smalltalk engine. Patterns, reflections
+ * and the jokes, facts and riddles the chatbot can tell are read from an INI
+ * file (see smalltalk.ini) into hash tables, so that recognising a smalltalk
+ * keyword or reflecting a word takes O(1) time regardless of how much content
+ * is loaded.
+ *
+ * smalltalk_read() reads the smalltalk content from a file.
+ * smalltalk_reset() erases all of the smalltalk content.
+ * smalltalk_is_keyword() checks whether a word starts a smalltalk phrase.
+ * smalltalk_respond() writes the response to a smalltalk phrase.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "chat1002.h"
+
+/* first word -> SMALLTALK_PATTERN */
+static HASH_TABLE *keywords = NULL;
+
+/* section name -> SMALLTALK_PATTERN (owns the patterns) */
+static HASH_TABLE *patterns = NULL;
+
+/* word -> reflected word */
+static HASH_TABLE *reflections = NULL;
+
+/* topic -> SMALLTALK_TOPIC */
+static HASH_TABLE *topics = NULL;
+
+/*
+ * Make a heap copy of a string.
+ *
+ * Returns:
+ *   the copy, if successful
+ *   NULL, if there was a memory allocation failure
+ */
+static char *copy_string(const char *str)
+{
+    char *copy = malloc(strlen(str) + 1);
+
+    if (copy != NULL)
+    {
+        strcpy(copy, str);
+    }
+    return copy;
+}
+
+/*
+ * Append a copy of <str> to a string list, growing it as needed.
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int add_string(STRING_LIST *list, const char *str)
+{
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity == 0 ? 4 : list->capacity * 2;
+        char **items = realloc(list->items, capacity * sizeof(char *));
+
+        if (items == NULL)
+        {
+            return KB_NOMEM;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    char *copy = copy_string(str);
+    if (copy == NULL)
+    {
+        return KB_NOMEM;
+    }
+    list->items[list->count++] = copy;
+
+    return KB_OK;
+}
+
+static void free_strings(STRING_LIST *list)
+{
+    for (int i = 0; i < list->count; i++)
+    {
+        free(list->items[i]);
+    }
+    free(list->items);
+}
+
+static void free_pattern(void *value)
+{
+    SMALLTALK_PATTERN *pattern = value;
+
+    free_strings(&pattern->responses);
+    free(pattern);
+}
+
+static void free_topic(void *value)
+{
+    SMALLTALK_TOPIC *topic = value;
+
+    free_strings(&topic->responses);
+    free_strings(&topic->questions);
+    free_strings(&topic->answers);
+    free(topic->correct);
+    free(topic->wrong);
+    free(topic);
+}
+
+/*
+ * Get the table entry named <name>, creating an empty one if needed.
+ *
+ * Returns:
+ *   the entry, if successful
+ *   NULL, if there was a memory allocation failure
+ */
+static void *get_or_create(HASH_TABLE *table, const char *name, size_t size)
+{
+    void *value = hash_get(table, name);
+
+    if (value == NULL)
+    {
+        value = calloc(1, size);
+        if (value == NULL)
+        {
+            return NULL;
+        }
+        if (hash_put(table, name, value) != KB_OK)
+        {
+            free(value);
+            return NULL;
+        }
+    }
+    return value;
+}
+
+/*
+ * Replace a template string owned by a topic.
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int set_string(char **field, const char *str)
+{
+    char *copy = copy_string(str);
+
+    if (copy == NULL)
+    {
+        return KB_NOMEM;
+    }
+    free(*field);
+    *field = copy;
+
+    return KB_OK;
+}
+
+/*
+ * Erase all of the smalltalk content.
+ */
+void smalltalk_reset()
+{
+    // Patterns are owned by the patterns table; keywords only point at them
+    hash_destroy(keywords, NULL);
+    hash_destroy(patterns, free_pattern);
+    hash_destroy(reflections, free);
+    hash_destroy(topics, free_topic);
+
+    keywords = patterns = reflections = topics = NULL;
+}
+
+/*
+ * Read smalltalk content from a file. The file consists of sections:
+ *
+ *   [reflections]        word=reflected word
+ *   [smalltalk <name>]   match=<first word>, response=<template>,
+ *                        exit=yes, tell=yes
+ *   [tell <topic>]       response=<text>, riddle=<question>|<answer>,
+ *                        correct=<template>, wrong=<template>
+ *
+ * Keys may be repeated to add further matches or responses. Lines beginning
+ * with ';' or '#' are comments. Templates may contain {reflection} (the rest
+ * of the input, reflected) and {answer} (the answer to a riddle).
+ *
+ * Input:
+ *   f          - the file
+ *
+ * Returns:
+ *   the number of entries successfully read from the file,
+ *   or KB_NOMEM if there was a memory allocation failure
+ */
+int smalltalk_read(FILE *f)
+{
+    char line[MAX_INPUT];
+    int line_length;
+    int count = 0;
+    int status = KB_OK;
+
+    SMALLTALK_PATTERN *pattern = NULL;
+    SMALLTALK_TOPIC *topic = NULL;
+    bool in_reflections = false;
+
+    if (keywords == NULL)
+    {
+        keywords = hash_create(32);
+        patterns = hash_create(16);
+        reflections = hash_create(32);
+        topics = hash_create(8);
+    }
+    if (keywords == NULL || patterns == NULL || reflections == NULL || topics == NULL)
+    {
+        fclose(f);
+        smalltalk_reset();
+        return KB_NOMEM;
+    }
+
+    while (status == KB_OK && fgets(line, MAX_INPUT, f) != NULL)
+    {
+        // Account for "\r\n" at end of line
+        line[strcspn(line, "\r\n")] = 0;
+        line_length = strlen(line);
+
+        // Empty line or comment
+        if (line_length == 0 || line[0] == ';' || line[0] == '#')
+        {
+            continue;
+        }
+
+        // Section heading
+        if (line[0] == '[' && line[line_length - 1] == ']')
+        {
+            line[line_length - 1] = '\0';
+            char *name = strchr(line + 1, ' ');
+
+            pattern = NULL;
+            topic = NULL;
+            in_reflections = compare_token(line + 1, "reflections") == 0;
+
+            if (name != NULL)
+            {
+                *name++ = '\0';
+                if (compare_token(line + 1, "smalltalk") == 0)
+                {
+                    pattern = get_or_create(patterns, name, sizeof(SMALLTALK_PATTERN));
+                    status = pattern == NULL ? KB_NOMEM : KB_OK;
+                }
+                else if (compare_token(line + 1, "tell") == 0)
+                {
+                    topic = get_or_create(topics, name, sizeof(SMALLTALK_TOPIC));
+                    status = topic == NULL ? KB_NOMEM : KB_OK;
+                }
+            }
+            continue;
+        }
+
+        char *value = strchr(line, '=');
+        if (value == NULL)
+        {
+            continue;
+        }
+        *value++ = '\0';
+
+        if (in_reflections)
+        {
+            char *reflected = copy_string(value);
+            free(hash_get(reflections, line));
+
+            if (reflected == NULL || hash_put(reflections, line, reflected) != KB_OK)
+            {
+                free(reflected);
+                hash_remove(reflections, line);
+                status = KB_NOMEM;
+            }
+        }
+        else if (pattern != NULL)
+        {
+            if (compare_token(line, "match") == 0)
+            {
+                status = hash_put(keywords, value, pattern);
+            }
+            else if (compare_token(line, "response") == 0)
+            {
+                status = add_string(&pattern->responses, value);
+            }
+            else if (compare_token(line, "exit") == 0)
+            {
+                pattern->exit = compare_token(value, "yes") == 0;
+            }
+            else if (compare_token(line, "tell") == 0)
+            {
+                pattern->tell = compare_token(value, "yes") == 0;
+            }
+        }
+        else if (topic != NULL)
+        {
+            if (compare_token(line, "response") == 0)
+            {
+                status = add_string(&topic->responses, value);
+            }
+            else if (compare_token(line, "riddle") == 0)
+            {
+                char *answer = strchr(value, '|');
+                if (answer == NULL)
+                {
+                    continue;
+                }
+                *answer++ = '\0';
+
+                status = add_string(&topic->questions, value);
+                if (status == KB_OK)
+                {
+                    status = add_string(&topic->answers, answer);
+                    if (status != KB_OK)
+                    {
+                        free(topic->questions.items[--topic->questions.count]);
+                    }
+                }
+            }
+            else if (compare_token(line, "correct") == 0)
+            {
+                status = set_string(&topic->correct, value);
+            }
+            else if (compare_token(line, "wrong") == 0)
+            {
+                status = set_string(&topic->wrong, value);
+            }
+        }
+        else
+        {
+            continue;
+        }
+
+        count++;
+    }
+
+    fclose(f);
+
+    if (status != KB_OK)
+    {
+        return status;
+    }
+    return count;
+}
+
+/*
+ * Determine whether a word starts one of the smalltalk phrases.
+ *
+ * Input:
+ *   word       - the first word of the input
+ *
+ * Returns:
+ *   1, if the word is the first word of one of the smalltalk phrases
+ *   0, otherwise
+ */
+int smalltalk_is_keyword(const char *word)
+{
+    return keywords != NULL && hash_get(keywords, word) != NULL;
+}
+
+/*
+ * Append <text> to the response, truncating at the end of the buffer.
+ *
+ * Returns:
+ *   the new length of the response
+ */
+static int append_text(char *response, int n, int len, const char *text)
+{
+    while (*text != '\0' && len < n - 1)
+    {
+        response[len++] = *text++;
+    }
+    response[len] = '\0';
+
+    return len;
+}
+
+/*
+ * Append the user's message (minus its first word) to the response, reflected
+ * so that it is spoken from the perspective of the chatbot.
+ *
+ * Returns:
+ *   the new length of the response
+ */
+static int append_reflection(char *response, int n, int len, int inc, char *inv[])
+{
+    for (int i = 1; i < inc; i++)
+    {
+        if (i > 1)
+        {
+            len = append_text(response, n, len, " ");
+        }
+
+        const char *reflected = hash_get(reflections, inv[i]);
+        len = append_text(response, n, len, reflected != NULL ? reflected : inv[i]);
+    }
+    return len;
+}
+
+/*
+ * Write a response template to the response buffer in one pass, expanding
+ * {reflection} and {answer} as they are encountered.
+ */
+static void expand_template(char *response, int n, const char *template, int inc, char *inv[], const char *answer)
+{
+    int len = 0;
+
+    response[0] = '\0';
+    while (*template != '\0' && len < n - 1)
+    {
+        if (strncmp(template, "{reflection}", 12) == 0)
+        {
+            len = append_reflection(response, n, len, inc, inv);
+            template += 12;
+        }
+        else if (strncmp(template, "{answer}", 8) == 0 && answer != NULL)
+        {
+            len = append_text(response, n, len, answer);
+            template += 8;
+        }
+        else
+        {
+            response[len++] = *template++;
+            response[len] = '\0';
+        }
+    }
+}
+
+/*
+ * Tell a joke, fact or riddle from <topic>.
+ */
+static void tell(SMALLTALK_TOPIC *topic, int inc, char *inv[], char *response, int n)
+{
+    int total = topic->responses.count + topic->questions.count;
+    int chosen_resp = rand() % total;
+
+    if (chosen_resp < topic->responses.count)
+    {
+        expand_template(response, n, topic->responses.items[chosen_resp], inc, inv, NULL);
+        return;
+    }
+
+    // Ask a riddle
+    chosen_resp -= topic->responses.count;
+
+    char answer[MAX_INPUT];
+    memset(answer, 0, MAX_INPUT);
+    prompt_user(answer, MAX_INPUT, "%s", topic->questions.items[chosen_resp]);
+
+    const char *expected = topic->answers.items[chosen_resp];
+    if (compare_token(expected, answer) == 0)
+    {
+        expand_template(response, n, topic->correct != NULL ? topic->correct : "Correct!", inc, inv, expected);
+    }
+    else
+    {
+        expand_template(response, n, topic->wrong != NULL ? topic->wrong : "The answer was '{answer}'.", inc, inv, expected);
+    }
+}
+
+/*
+ * Respond to smalltalk.
+ *
+ * See the comment at the top of chatbot.c for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0, if the chatbot should continue chatting
+ *   1, if the chatbot should stop chatting (e.g. the smalltalk was "goodbye" etc.)
+ */
+int smalltalk_respond(int inc, char *inv[], char *response, int n)
+{
+    SMALLTALK_PATTERN *pattern = keywords == NULL ? NULL : hash_get(keywords, inv[0]);
+
+    response[0] = '\0';
+    if (pattern == NULL)
+    {
+        return 0;
+    }
+
+    // "Tell me a joke", "tell me a riddle", ...
+    if (pattern->tell)
+    {
+        SMALLTALK_TOPIC *topic = hash_get(topics, inv[inc - 1]);
+
+        if (inc > 1 && topic != NULL && topic->responses.count + topic->questions.count > 0)
+        {
+            tell(topic, inc, inv, response, n);
+            return pattern->exit;
+        }
+    }
+
+    if (pattern->responses.count > 0)
+    {
+        int chosen_resp = rand() % pattern->responses.count;
+        expand_template(response, n, pattern->responses.items[chosen_resp], inc, inv, NULL);
+    }
+
+    return pattern->exit;
+}
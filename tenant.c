@@ -0,0 +1,319 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements the tenant registry, which lets one process host the
+ * knowledge bases of many tenants. A tenant's knowledge base is loaded from
+ * TENANT_DIR/<name>.ini the first time it is used. When the resident knowledge
+ * bases use more memory than the budget, the least-recently-used tenants are
+ * evicted, being written back to their files first if they have changed. A
+ * tenant that cannot be written back is kept resident until it can be.
+ *
+ * tenant_open() returns a tenant's knowledge base, loading it if necessary.
+ * tenant_check_budget() evicts tenants once they no longer fit, as after
+ * opening a tenant or learning.
+ * tenant_set_budget() sets the memory budget for resident tenants.
+ * tenant_close_all() writes back and frees every resident tenant.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "chat1002.h"
+
+/* name -> KNOWLEDGE_BASE, for every resident tenant */
+static HASH_TABLE *tenants = NULL;
+
+/* resident tenants, from most to least recently used */
+static KNOWLEDGE_BASE *lru_head = NULL;
+static KNOWLEDGE_BASE *lru_tail = NULL;
+
+/* the memory budget for resident tenants, in bytes */
+static size_t budget = TENANT_BUDGET;
+
+/*
+ * Get the file holding a tenant's knowledge base.
+ *
+ * Returns:
+ *   true, if the name is a valid tenant name
+ *   false, if it is empty or could escape TENANT_DIR
+ */
+static bool tenant_filename(const char *name, char *filename, int n)
+{
+    if (name[0] == '\0' || name[0] == '.' || strpbrk(name, "/\\:") != NULL)
+    {
+        return false;
+    }
+
+    snprintf(filename, n, "%s/%s.ini", TENANT_DIR, name);
+    return true;
+}
+
+/*
+ * Unlink a tenant from the LRU list.
+ */
+static void lru_remove(KNOWLEDGE_BASE *kb)
+{
+    if (kb->lru_prev != NULL)
+    {
+        kb->lru_prev->lru_next = kb->lru_next;
+    }
+    else
+    {
+        lru_head = kb->lru_next;
+    }
+
+    if (kb->lru_next != NULL)
+    {
+        kb->lru_next->lru_prev = kb->lru_prev;
+    }
+    else
+    {
+        lru_tail = kb->lru_prev;
+    }
+
+    kb->lru_prev = kb->lru_next = NULL;
+}
+
+/*
+ * Link a tenant at the front (most recently used end) of the LRU list.
+ */
+static void lru_push_front(KNOWLEDGE_BASE *kb)
+{
+    kb->lru_prev = NULL;
+    kb->lru_next = lru_head;
+
+    if (lru_head != NULL)
+    {
+        lru_head->lru_prev = kb;
+    }
+    else
+    {
+        lru_tail = kb;
+    }
+    lru_head = kb;
+}
+
+/*
+ * Write a tenant back to its file if it has changed.
+ *
+ * Returns:
+ *   KB_OK, if the file is up to date
+ *   KB_INVALID, if the file could not be written
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int tenant_write_back(KNOWLEDGE_BASE *kb)
+{
+    char filename[MAX_INPUT];
+
+    if (!kb->dirty || !tenant_filename(kb->name, filename, MAX_INPUT))
+    {
+        return KB_OK;
+    }
+
+    int status = knowledge_write(kb, filename);
+    if (status == KB_OK)
+    {
+        kb->dirty = false;
+    }
+    return status;
+}
+
+/*
+ * Free a tenant, without writing it back.
+ */
+static void tenant_free(KNOWLEDGE_BASE *kb)
+{
+    lru_remove(kb);
+    hash_remove(tenants, kb->name);
+    knowledge_free(kb);
+}
+
+/*
+ * Evict least-recently-used tenants until the resident tenants fit in the
+ * memory budget. <keep> is never evicted, even if it alone exceeds the budget.
+ * A tenant that cannot be written back is kept, still dirty, and the next
+ * least-recently-used one is tried instead.
+ *
+ * Returns:
+ *   KB_OK, if every tenant evicted was written back
+ *   KB_INVALID or KB_NOMEM, if a tenant could not be written back (see
+ *     tenant_write_back())
+ */
+static int enforce_budget(KNOWLEDGE_BASE *keep)
+{
+    size_t used = tenant_memory();
+    int status = KB_OK;
+    KNOWLEDGE_BASE *victim = lru_tail;
+
+    while (used > budget && victim != NULL && victim != keep)
+    {
+        KNOWLEDGE_BASE *next = victim->lru_prev;
+
+        int written = tenant_write_back(victim);
+        if (written == KB_OK)
+        {
+            used -= knowledge_memory(victim);
+            tenant_free(victim);
+        }
+        else if (status == KB_OK)
+        {
+            status = written;
+        }
+        victim = next;
+    }
+    return status;
+}
+
+/*
+ * Get a tenant's knowledge base, loading it from TENANT_DIR/<name>.ini if it
+ * is not resident. A tenant without a file starts with an empty knowledge
+ * base. Opening a tenant makes it the most recently used; call
+ * tenant_check_budget() afterwards to evict others that no longer fit.
+ *
+ * Input:
+ *   name       - the name of the tenant
+ *   status     - set to KB_OK, KB_INVALID (not a valid tenant name) or
+ *                KB_NOMEM (memory allocation failure)
+ *
+ * Returns:
+ *   the tenant's knowledge base, if successful
+ *   NULL, otherwise
+ */
+KNOWLEDGE_BASE *tenant_open(const char *name, int *status)
+{
+    char filename[MAX_INPUT];
+
+    if (strlen(name) >= MAX_TENANT || !tenant_filename(name, filename, MAX_INPUT))
+    {
+        *status = KB_INVALID;
+        return NULL;
+    }
+
+    if (tenants == NULL && (tenants = hash_create(64)) == NULL)
+    {
+        *status = KB_NOMEM;
+        return NULL;
+    }
+
+    // Resident (mark as most recently used)
+    KNOWLEDGE_BASE *kb = hash_get(tenants, name);
+    if (kb != NULL)
+    {
+        lru_remove(kb);
+        lru_push_front(kb);
+        *status = KB_OK;
+        return kb;
+    }
+
+    // Not resident (load it)
+    kb = knowledge_create(name);
+    if (kb == NULL)
+    {
+        *status = KB_NOMEM;
+        return NULL;
+    }
+
+    FILE *f = fopen(filename, "r");
+    if (f != NULL && knowledge_read(kb, f) == KB_NOMEM)
+    {
+        knowledge_free(kb);
+        *status = KB_NOMEM;
+        return NULL;
+    }
+    kb->dirty = false;
+
+    if (hash_put(tenants, name, kb) != KB_OK)
+    {
+        knowledge_free(kb);
+        *status = KB_NOMEM;
+        return NULL;
+    }
+    lru_push_front(kb);
+
+    *status = KB_OK;
+    return kb;
+}
+
+/*
+ * Evict least-recently-used tenants until the resident tenants fit in the
+ * memory budget, keeping the most recently used one. Tenants grow as they
+ * learn, so this is checked again after each change as well as on opening.
+ *
+ * Returns:
+ *   KB_OK, if every tenant evicted was written back
+ *   KB_INVALID, if a tenant could not be written back (it is kept resident,
+ *     and the budget is exceeded until it can be)
+ *   KB_NOMEM, if there was a memory allocation failure writing a tenant back
+ */
+int tenant_check_budget()
+{
+    return enforce_budget(lru_head);
+}
+
+/*
+ * Set the memory budget for resident tenants, evicting tenants if they no
+ * longer fit.
+ *
+ * Input:
+ *   bytes      - the budget, in bytes
+ *
+ * Returns:
+ *   as tenant_check_budget()
+ */
+int tenant_set_budget(size_t bytes)
+{
+    budget = bytes;
+    return enforce_budget(lru_head);
+}
+
+/*
+ * Returns:
+ *   the number of bytes used by the resident tenants
+ */
+size_t tenant_memory()
+{
+    size_t used = 0;
+
+    for (KNOWLEDGE_BASE *kb = lru_head; kb != NULL; kb = kb->lru_next)
+    {
+        used += knowledge_memory(kb);
+    }
+    return used;
+}
+
+/*
+ * Returns:
+ *   the number of resident tenants
+ */
+int tenant_count()
+{
+    return tenants == NULL ? 0 : tenants->count;
+}
+
+/*
+ * Write back and free every resident tenant. Every tenant is freed, even one
+ * that could not be written back.
+ *
+ * Returns:
+ *   KB_OK, if every tenant that had changed was written back
+ *   KB_INVALID or KB_NOMEM, if one could not be (see tenant_write_back())
+ */
+int tenant_close_all()
+{
+    int status = KB_OK;
+
+    while (lru_head != NULL)
+    {
+        int written = tenant_write_back(lru_head);
+        if (written != KB_OK && status == KB_OK)
+        {
+            status = written;
+        }
+        tenant_free(lru_head);
+    }
+
+    hash_destroy(tenants, NULL);
+    tenants = NULL;
+    return status;
+}
@@ -0,0 +1,254 @@
+/*
+ * ICT1002 (C Language) Group Project.
+ *
+ * This file implements tracing: when the chatbot is compiled with
+ * -DKB_TRACING, each phase marked with TRACE_BEGIN() and TRACE_END() (reading
+ * a file, merging an intent, rebalancing a BST, answering a question...) is
+ * recorded with its start and duration, and trace_dump() writes the spans as
+ * a Chrome trace (open it at ui.perfetto.dev, or chrome://tracing). The spans
+ * are written to TRACE_FILE when the chatbot exits, or on demand with TRACE.
+ * Without -DKB_TRACING, the spans compile to nothing.
+ *
+ * Each thread records its spans into a ring buffer of its own, so recording
+ * takes no lock: the thread writes the span, then publishes it by advancing
+ * the ring's head. Only the last TRACE_EVENTS spans of each thread are kept.
+ * When a thread exits, its ring is kept (so that its spans can still be
+ * dumped) and is reused by the next thread that starts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chat1002.h"
+
+/* a span that has ended */
+typedef struct trace_event
+{
+    const char *name;                       // the name of the phase
+    const char *category;                   // the source file it is in
+    uint64_t start;                         // when it started, in ns since the first span
+    uint64_t duration;                      // how long it took, in ns
+    unsigned tid;                           // the thread it ran on
+} TRACE_EVENT;
+
+/* the spans of one thread */
+typedef struct trace_ring
+{
+    TRACE_EVENT events[TRACE_EVENTS];       // the last TRACE_EVENTS spans
+    atomic_ulong head;                      // the number of spans ever recorded
+    atomic_bool in_use;                     // owned by a running thread
+    unsigned tid;                           // the thread that owns it
+    struct trace_ring *next;                // the ring created before it
+} TRACE_RING;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static uint64_t epoch;                      // when tracing started, in ns
+static _Atomic(TRACE_RING *) rings = NULL;  // every ring ever created
+static atomic_uint next_tid = 0;            // the number of threads that have traced
+static _Thread_local TRACE_RING *ring = NULL;
+
+/*
+ * Get the time, in ns since an arbitrary point.
+ */
+static uint64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/*
+ * Give up the ring of a thread that is exiting, for another thread to reuse.
+ */
+static void release_ring(void *value)
+{
+    TRACE_RING *r = value;
+
+    atomic_store(&r->in_use, false);
+}
+
+/*
+ * Dump the trace when the chatbot exits (see atexit()).
+ */
+static void dump_at_exit()
+{
+    trace_dump(TRACE_FILE);
+}
+
+/*
+ * Start tracing, on the first span of any thread.
+ */
+static void trace_init()
+{
+    epoch = now();
+    pthread_key_create(&trace_key, release_ring);
+    atexit(dump_at_exit);
+}
+
+/*
+ * Get a ring for the calling thread: one given up by a thread that has
+ * exited, or else a new one.
+ *
+ * Returns:
+ *   the ring
+ *   NULL, if there was a memory allocation failure (the thread's spans are
+ *     then not recorded)
+ */
+static TRACE_RING *claim_ring()
+{
+    TRACE_RING *r;
+
+    for (r = atomic_load(&rings); r != NULL; r = r->next)
+    {
+        bool in_use = false;
+        if (atomic_compare_exchange_strong(&r->in_use, &in_use, true))
+        {
+            break;
+        }
+    }
+
+    if (r == NULL)
+    {
+        if ((r = calloc(1, sizeof(TRACE_RING))) == NULL)
+        {
+            return NULL;
+        }
+        atomic_init(&r->head, 0);
+        atomic_init(&r->in_use, true);
+        r->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+        {
+        }
+    }
+
+    r->tid = atomic_fetch_add(&next_tid, 1) + 1;
+    pthread_setspecific(trace_key, r);
+    return r;
+}
+
+/*
+ * Start a span (see TRACE_BEGIN()).
+ *
+ * Input:
+ *   name       - the name of the phase (a string that lives for ever)
+ *   file       - the source file it is in (__FILE__)
+ *
+ * Returns:
+ *   the span, to pass to trace_end()
+ */
+TRACE_SPAN trace_begin(const char *name, const char *file)
+{
+    TRACE_SPAN span;
+
+    pthread_once(&trace_once, trace_init);
+    span.name = name;
+    span.category = file;
+    span.start = now();
+    return span;
+}
+
+/*
+ * End a span, and record it in the calling thread's ring (see TRACE_END()).
+ *
+ * Input:
+ *   span       - the span, from trace_begin()
+ */
+void trace_end(TRACE_SPAN *span)
+{
+    uint64_t end = now();
+
+    if (ring == NULL && (ring = claim_ring()) == NULL)
+    {
+        return;
+    }
+
+    // Write the span, then publish it
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    TRACE_EVENT *event = &ring->events[head % TRACE_EVENTS];
+    event->name = span->name;
+    event->category = span->category;
+    event->start = span->start - epoch;
+    event->duration = end - span->start;
+    event->tid = ring->tid;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+ * Get the name of a source file, without its directory.
+ */
+static const char *base_name(const char *file)
+{
+    const char *name = file;
+
+    for (const char *c = file; *c != '\0'; c++)
+    {
+        if (*c == '/' || *c == '\\')
+        {
+            name = c + 1;
+        }
+    }
+    return name;
+}
+
+/*
+ * Write the spans recorded so far as a Chrome trace (a JSON object with an
+ * array of complete events). Threads may go on recording while it is written;
+ * a span that is overwritten while it is being copied is left out.
+ *
+ * Input:
+ *   filename   - the file to write to
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if the file could not be written
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int trace_dump(const char *filename)
+{
+    TRACE_EVENT *copy = malloc(TRACE_EVENTS * sizeof(TRACE_EVENT));
+    if (copy == NULL)
+    {
+        return KB_NOMEM;
+    }
+
+    FILE *f = fopen(filename, "w");
+    if (f == NULL)
+    {
+        free(copy);
+        return KB_INVALID;
+    }
+
+    fprintf(f, "{\"traceEvents\":[");
+    bool first = true;
+    for (TRACE_RING *r = atomic_load(&rings); r != NULL; r = r->next)
+    {
+        // Copy the published spans, then drop any that may have been
+        // overwritten meanwhile: once the head has reached <later>, the
+        // owner may be writing span <later> over span <later> - TRACE_EVENTS
+        unsigned long head = atomic_load_explicit(&r->head, memory_order_acquire);
+        unsigned long base = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+        for (unsigned long k = base; k < head; k++)
+        {
+            copy[k - base] = r->events[k % TRACE_EVENTS];
+        }
+        atomic_thread_fence(memory_order_acquire);
+        unsigned long later = atomic_load_explicit(&r->head, memory_order_relaxed);
+        unsigned long from = later >= TRACE_EVENTS && later - TRACE_EVENTS + 1 > base ? later - TRACE_EVENTS + 1 : base;
+
+        for (unsigned long k = from; k < head; k++)
+        {
+            TRACE_EVENT *event = &copy[k - base];
+            fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+                first ? "" : ",", event->name, base_name(event->category),
+                event->start / 1000.0, event->duration / 1000.0, event->tid);
+            first = false;
+        }
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+    free(copy);
+    return fclose(f) == 0 ? KB_OK : KB_INVALID;
+}